@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "main.h"
+#include "decim.h"
+#include "median.h"
+#include "filter.h"
+
+/*
+ * Acquisition settings that can change at run time. The DMA frame size follows
+ * from the conversion rate and the latency target: one frame per target period,
+ * but never more frames per second than the per-frame overhead allows, and never
+ * more samples than a frame_t holds.
+ */
+
+#define ADC_LATENCY_US 5000      // default frame period target
+#define ADC_MIN_FRAME_US 1000    // shortest frame period, per-frame cost dominates below
+#define ADC_POOL_FRAMES 2        // driver pool depth, it is never read, see s_conv_done_cb
+
+// fields of a DMA conversion, adc_digi_output_data_t
+#if CONFIG_IDF_TARGET_ESP32C3 || CONFIG_IDF_TARGET_ESP32C2 || CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_ESP32C6 || CONFIG_IDF_TARGET_ESP32H2 || CONFIG_IDF_TARGET_ESP32C5 || CONFIG_IDF_TARGET_ESP32C61
+#define ACDTYPE type2
+#define CONV_UNIT(p, j) ((p)->type2.unit)
+#else
+#define ACDTYPE type1
+// no unit field, in alternating mode the units take turns starting with ADC1
+#define CONV_UNIT(p, j) ((j) & 1)
+#endif
+
+typedef enum
+{
+    ADC_MODE_CHANNELS,    // ADC1, one stream per pattern channel
+    ADC_MODE_INTERLEAVED, // ADC1 and ADC2 in turn on one input, merged into channel 0 at the full rate
+} adc_mode_t;
+
+// applied by adc_dma_task between frames
+esp_err_t adc_set_rate(uint32_t hz, uint32_t latency_us);
+esp_err_t adc_set_mode(adc_mode_t mode);
+adc_mode_t adc_get_mode(void);
+// spike filter of an output channel, first stage after the ADC (median of 3 by default)
+esp_err_t adc_set_median(int channel, median_type_t type, unsigned window, float k);
+// filter chain of an output channel after the spike filter, stages are added one at a time
+esp_err_t adc_filter_clear(int channel);
+esp_err_t adc_filter_add(int channel, const filter_spec_t *spec);
+// decimation of an output channel after the filters, bits 16 or 24
+esp_err_t adc_set_decim(int channel, decim_type_t type, unsigned ratio, unsigned bits);
+
+// the conversions of one DMA frame into the frame's input channels, as the DMA ISR does
+void adc_demux(frame_t *frame, const uint8_t *buf, uint32_t bytes);
+
+// fit ADC2 offset and gain to ADC1 over the next second of input, kept in NVS
+esp_err_t adc_interleave_calibrate(void);
+// interleaving spurs of the latest capture, as text
+esp_err_t adc_interleave_spurs(char *out, size_t len);
+
+// "rate <hz> [latency_ms]", "mode channels|interleaved", "median <ch> off|<window>",
+// "hampel <ch> <window> [k]", "filter <ch> off|<stage>" (see filter_parse), "decim <ch> off|box|cic [ratio] [bits]",
+// "math <slot> ..." (see derived.h), "cal", "spurs", "segments ..." (see segment.h),
+// "mask ..." (see mask.h), "record ...", "event" (see record.h),
+// "caplog ..." (see caplog.h), "trend ..." (see trend.h), "trace ..." (see trace.h);
+// ESP_ERR_NOT_FOUND if cmd is not an ADC command
+esp_err_t adc_command(const char *cmd, char *reply, size_t len);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/*
+ * On-chip benchmark of the sample path, an esp_console REPL on the console port:
+ * "bench [stage ...] [-n frames]". Every stage runs the firmware's own code over
+ * the same synthetic frame set, a sine with noise and spikes from a fixed seed in
+ * the chip's DMA conversion format, and reports CPU cycles per sample from the
+ * cycle counter. The report leads with the target and the CPU clock, so the
+ * numbers of the platformio.ini builds compare one to one.
+ *
+ * Acquisition keeps running meanwhile, its interrupts land in some frames: "best"
+ * is the cleanest frame, "mean" includes them and the cold cache of the first.
+ */
+
+#define BENCH_FRAMES 64      // default frame set
+#define BENCH_MAX_FRAMES 4096
+#define BENCH_CONSOLE_STACK (1024 * 4)
+
+#if CONFIG_IDF_TARGET_LINUX
+// the numbers are the chips', the Linux build goes without
+static inline esp_err_t bench_console_start(void)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline bool bench_console_active(void)
+{
+    return false;
+}
+#else
+// register the commands and start the REPL task
+esp_err_t bench_console_start(void);
+// the REPL is reading the console
+bool bench_console_active(void);
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+/*
+ * Circular capture log in the raw "caplog" flash partition, it survives a
+ * reboot. caplog_task takes the min/max of every channel's capture in bins
+ * of 1/rate s and packs them as zigzag varint deltas into CAPLOG_BLOCK byte
+ * blocks, one channel per block. Blocks are appended page aligned into the
+ * current sector; a full log erases its oldest sector for the next one, so
+ * all sectors see the same number of erases.
+ *
+ * Every sector starts with a caplog_sector_t block, sequence numbers grow by
+ * one per sector: at boot the headers give the head and the tail, the first
+ * erased block of the head sector the write position. "caplog erase" leaves a
+ * CAPLOG_EMPTY header in every sector, so the erase counts outlive the data.
+ *
+ * Flash erases stall the cache; the ADC interrupt is IRAM safe
+ * (CONFIG_ADC_CONTINUOUS_ISR_IRAM_SAFE) so acquisition goes on meanwhile.
+ */
+
+#define CAPLOG_PARTITION "caplog"
+#define CAPLOG_TYPE 0x40 // custom partition type, subtype 0
+#define CAPLOG_SECTOR 4096
+#define CAPLOG_BLOCK 256
+#define CAPLOG_MAGIC 0x474f4c43 // "CLOG"
+#define CAPLOG_EMPTY 0x59544d45 // "EMTY", an erased sector keeping its count
+#define CAPLOG_TASK_MS 100
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t erases; // of this sector, this one included
+} caplog_sector_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t magic; // CAPLOG_BLOCK_MAGIC, 0xff for an erased block
+    uint8_t channel;
+    uint16_t bytes; // of the varint data
+    uint16_t count; // values, min and max of each bin in turn
+    uint16_t first; // the first value, the deltas start at the second
+    int64_t t0;     // us
+    uint32_t period_ns; // between values, half a bin
+    float scale, offset;
+} caplog_block_t;
+
+#define CAPLOG_BLOCK_MAGIC 0xa5
+#define CAPLOG_DATA (CAPLOG_BLOCK - sizeof(caplog_block_t))
+
+typedef struct
+{
+    uint32_t sectors;
+    uint32_t used;         // sectors holding data
+    uint32_t erase_min, erase_max;
+    uint64_t bytes;        // written since boot
+    uint64_t write_us;     // spent writing and erasing since boot
+    int64_t oldest;        // us, of the oldest block, 0 if empty
+} caplog_stats_t;
+
+esp_err_t caplog_init(void);
+void caplog_task(void *arg);
+
+// rate - bins per second, channels - bit mask; kept in NVS
+esp_err_t caplog_set(uint32_t rate, uint8_t channels);
+void caplog_stats(caplog_stats_t *out);
+
+// blocks oldest first, cb returns false to stop; the sector being erased is skipped
+typedef bool (*caplog_cb_t)(const caplog_block_t *block, const uint8_t *data, void *arg);
+esp_err_t caplog_read(caplog_cb_t cb, void *arg);
+
+// one zigzag varint delta into p, returns its bytes, at most 3 for 16 bit values
+static inline size_t caplog_put_delta(uint8_t *p, int32_t d)
+{
+    uint32_t z = (uint32_t)(d << 1) ^ (uint32_t)(d >> 31);
+    size_t n = 0;
+    do
+    {
+        p[n++] = (z & 0x7f) | (z > 0x7f ? 0x80 : 0);
+        z >>= 7;
+    } while (z);
+    return n;
+}
+
+// decode the varint deltas of a block, returns the number of values
+size_t caplog_decode(const caplog_block_t *block, const uint8_t *data, uint16_t *out, size_t max);
+
+// "caplog" for the statistics, "caplog <rate> [channel mask]", "caplog off", "caplog erase"
+// (in the background, the log reads empty until it is done)
+esp_err_t caplog_command(const char *cmd, char *reply, size_t len);
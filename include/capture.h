@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+/*
+ * Deep capture memory: one circular buffer of filtered samples per channel,
+ * in PSRAM when available (internal RAM otherwise), with a min/max pyramid
+ * maintained alongside it. Level 0 bins hold CAPTURE_BIN samples, every next
+ * level merges CAPTURE_FAN bins of the previous one.
+ *
+ * Samples are 16 bit, sample * scale + offset is the value: 12 bit counts for
+ * the inputs, decimated ones keep up to 16 bits, derived channels have their own.
+ * The PSRAM depth is halved until all channels fit.
+ */
+
+#define CAPTURE_CHANNELS 4 // inputs and derived channels, FRAME_CHANNELS
+#define CAPTURE_BIN 16
+#define CAPTURE_FAN 4
+#define CAPTURE_LEVELS 9
+
+// samples per channel, must be powers of two
+#define CAPTURE_PSRAM_SAMPLES (1 << 20)
+#define CAPTURE_INTERNAL_SAMPLES (1 << 13)
+
+typedef struct
+{
+    uint16_t min;
+    uint16_t max;
+} capture_minmax_t;
+
+// reply of the /capture query, followed by `points` capture_minmax_t
+typedef struct __attribute__((packed))
+{
+    int64_t t0;    // start of the first point, us
+    int64_t t1;    // end of the last point, us
+    int64_t first; // oldest sample still in memory, us
+    int64_t last;  // newest sample, us
+    uint32_t points;
+    uint16_t channel;
+    uint16_t reserved;
+    float scale;
+    float offset;
+} capture_query_hdr_t;
+
+esp_err_t capture_init(void);
+void capture_set_rate(int channel, uint32_t hz);
+uint32_t capture_get_rate(int channel);
+void capture_set_format(int channel, float scale, float offset);
+void capture_get_format(int channel, float *scale, float *offset);
+
+// append samples of one channel, t0 - timestamp of samples[0] in us
+void capture_write(int channel, const uint16_t *samples, size_t count, int64_t t0);
+
+// valid sample index range [first, head) and index <-> time mapping
+uint64_t capture_head(int channel);
+uint64_t capture_first(int channel);
+uint64_t capture_index(int channel, int64_t t);
+int64_t capture_time(int channel, uint64_t index);
+
+// copy raw samples [i0, i0 + count), returns how many were still in memory
+size_t capture_read(int channel, uint64_t i0, uint16_t *out, size_t count);
+
+// min/max of samples [i0, i1), O(log) in the span
+void capture_minmax(int channel, uint64_t i0, uint64_t i1, capture_minmax_t *out);
+// `points` equal slices of [i0, i1), O(points)
+void capture_query(int channel, uint64_t i0, uint64_t i1, capture_minmax_t *out, size_t points);
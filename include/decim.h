@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Decimation of one 12-bit stream by R = 2^shift, in fixed point. Boxcar is the
+ * mean of R samples. CIC is a DECIM_CIC_ORDER integrator/comb cascade followed
+ * by a 3-tap FIR at the output rate that lifts the sinc^N droop back up to about
+ * a quarter of the output rate. The output keeps the bits gained by averaging,
+ * scaled so that full scale is 2^bits (16 or 24).
+ *
+ * Plain C with no platform dependencies, tools/replay builds it for the host.
+ */
+
+#define DECIM_MAX_SHIFT 6 // R up to 64
+#define DECIM_CIC_ORDER 3
+
+typedef enum
+{
+    DECIM_OFF,
+    DECIM_BOXCAR,
+    DECIM_CIC,
+} decim_type_t;
+
+typedef struct
+{
+    decim_type_t type;
+    uint8_t shift;
+    uint8_t bits;
+    uint32_t phase; // input samples since the last output
+    uint32_t acc;   // boxcar sum
+    uint32_t integ[DECIM_CIC_ORDER];
+    uint32_t comb[DECIM_CIC_ORDER];
+    int64_t fir[2]; // previous CIC outputs
+} decim_t;
+
+// ratio a power of two up to 2^DECIM_MAX_SHIFT, bits 16 or 24; returns 0 or -1 on bad arguments
+int decim_init(decim_t *d, decim_type_t type, unsigned ratio, unsigned bits);
+
+/*
+ * Feed n input samples, out gets at most n / R + 1 values. *first is the index
+ * of the input sample on which out[0] was produced. Returns the output count.
+ */
+size_t decim_run(decim_t *d, const uint16_t *in, size_t n, uint32_t *out, size_t *first);
+
+static inline unsigned decim_ratio(const decim_t *d)
+{
+    return d->type == DECIM_OFF ? 1 : 1u << d->shift;
+}
+
+// group delay, input samples
+float decim_delay(const decim_t *d);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "main.h"
+
+/*
+ * Channels derived from the two inputs A (0) and B (1) at the full input rate,
+ * computed by adc_dma_task after the filters and before decimation and stored
+ * in frame channels FRAME_INPUTS and up.
+ *
+ * The inputs are sampled in turn and may be delayed differently by their
+ * filters, so the input whose samples are the older ones is the reference and
+ * the other is interpolated onto its sample times from a short history. The
+ * derived channels carry the reference's timing.
+ *
+ * Results are 16 bit with a fixed scale and offset per operation:
+ *   sub, add, xy  12 bit counts, xy is B on the reference's time base for XY plots
+ *   mul           counts^2, (A - zero A) * (B - zero B)
+ *   div           ratio (A - zero A) / (B - zero B), clamped to +-32
+ *   int           integral of A - zero A, count * s, clamped to +-4096
+ *   diff          derivative of A, counts / ms
+ */
+
+#define DERIVED_HISTORY 64 // input samples kept, covers the largest filter delay difference
+
+typedef enum
+{
+    DERIVED_OFF,
+    DERIVED_SUB,
+    DERIVED_ADD,
+    DERIVED_MUL,
+    DERIVED_DIV,
+    DERIVED_INT,
+    DERIVED_DIFF,
+    DERIVED_XY,
+} derived_op_t;
+
+typedef struct
+{
+    derived_op_t op;
+    int16_t zero[FRAME_INPUTS]; // input levels taken as zero, 12 bit counts
+} derived_t;
+
+void derived_set(int slot, const derived_t *d);
+void derived_get(int slot, derived_t *d);
+
+// sample * scale + offset of the output of an operation, period of the inputs in us
+void derived_format(derived_op_t op, double period, float *scale, float *offset);
+
+/*
+ * Add the derived channels to a frame with filtered inputs. t0 is the time of
+ * the first sample of each input and period the input sample period, us.
+ */
+void derived_frame(frame_t *frame, const double *t0, double period);
+
+// parse "math <slot> off|sub|add|mul|div|int|diff|xy [zero A] [zero B]"
+esp_err_t derived_command(const char *cmd);
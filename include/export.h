@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "capture.h"
+
+/*
+ * Capture export: [t0, t1) of a set of channels converted chunk by chunk
+ * into the caller's buffer and handed to a sink, so the size of the range
+ * never matters. Rows follow the sample grid of the first channel, the other
+ * channels contribute the sample nearest in time.
+ *
+ *   EXPORT_CSV  "t_us,ch0,..." header, one row per sample, values in channel units
+ *   EXPORT_WAV  32 bit float PCM at the first channel's rate, values in channel units
+ *   EXPORT_RAW  one channel wire frames (wire.h), every channel at its own rate
+ */
+
+typedef enum
+{
+    EXPORT_CSV,
+    EXPORT_WAV,
+    EXPORT_RAW,
+} export_format_t;
+
+typedef struct
+{
+    export_format_t format;
+    uint8_t channels; // bit mask
+    int64_t t0, t1;   // us
+} export_req_t;
+
+typedef struct
+{
+    uint64_t bytes;
+    int64_t us;
+    uint32_t lost; // samples gone from the capture before they were read
+} export_stats_t;
+
+// sink returns ESP_OK to go on
+typedef esp_err_t (*export_sink_t)(const char *data, size_t len, void *arg);
+
+esp_err_t export_parse_format(const char *name, export_format_t *out);
+const char *export_content_type(export_format_t format);
+// buf of at least 512 bytes
+esp_err_t export_run(const export_req_t *req, export_sink_t sink, void *arg, char *buf, size_t len, export_stats_t *stats);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// in-place radix-2 complex FFT, x holds n interleaved re/im pairs, n a power of two
+void fft(float *x, size_t n);
+
+/*
+ * Power spectrum of n real samples (n a power of two): mean removed, Hann window.
+ * work must hold 2 * n floats, power gets n / 2 + 1 bins scaled so that a full
+ * scale (4096 counts peak to peak) sine reads 1.0 through fft_tone().
+ */
+esp_err_t fft_power(const uint16_t *samples, size_t n, float *work, float *power);
+
+// bins a Hann windowed tone leaks into on each side
+#define FFT_HANN_SPREAD 3
+
+// power of the tone at bin k summed over its leakage, 10 * log10() of it is dBFS
+float fft_tone(const float *power, size_t bins, size_t k);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Filter chain of one 12-bit stream: up to FILTER_MAX_STAGES stages, biquads
+ * (RBJ cookbook) and at most one FIR (windowed sinc, Hamming), designed from
+ * frequencies for a given sample rate. Biquads run direct form I with Q30
+ * coefficients on Q12 samples and first order error feedback, the FIR runs
+ * Q15 taps on Q3 samples. Samples are filtered around mid scale, so high and
+ * band passes come out centred on 2048.
+ *
+ * Only the FIR delay is constant and reported by filter_delay().
+ *
+ * Plain C with no platform dependencies.
+ */
+
+#define FILTER_MAX_STAGES 4
+#define FILTER_MAX_TAPS 63
+#define FILTER_Q 0.7071f // Butterworth
+
+typedef enum
+{
+    FILTER_LOWPASS,
+    FILTER_HIGHPASS,
+    FILTER_BANDPASS,
+    FILTER_NOTCH, // biquad only
+} filter_kind_t;
+
+// one stage as requested, f1 the corner or centre, f2 the upper corner of an FIR band pass
+typedef struct
+{
+    uint8_t fir;
+    uint8_t kind;
+    uint8_t taps;
+    float f1, f2; // Hz
+    float q;
+} filter_spec_t;
+
+typedef struct
+{
+    int32_t b0, b1, b2, a1, a2; // Q30, normalised by a0
+    int32_t x1, x2, y1, y2;     // Q12
+    int64_t err;                // rounding error fed back into the next output
+} filter_biquad_t;
+
+typedef struct
+{
+    uint8_t stages;
+    filter_spec_t spec[FILTER_MAX_STAGES];
+    // designed by filter_design()
+    uint8_t biquads;
+    filter_biquad_t bq[FILTER_MAX_STAGES];
+    uint8_t taps;
+    uint8_t pos;
+    int16_t h[FILTER_MAX_TAPS];         // Q15
+    int16_t hist[2 * FILTER_MAX_TAPS]; // every sample twice, so the last taps ones are contiguous
+} filter_chain_t;
+
+void filter_clear(filter_chain_t *f);
+// append a stage, returns -1 if the chain is full or the spec is malformed
+int filter_add(filter_chain_t *f, const filter_spec_t *spec);
+// compute coefficients and clear the state, returns -1 if a frequency is not below rate / 2
+int filter_design(filter_chain_t *f, float rate);
+
+// filter n samples in place
+void filter_run(filter_chain_t *f, uint16_t *v, size_t n);
+
+static inline unsigned filter_delay(const filter_chain_t *f)
+{
+    return f->taps / 2;
+}
+
+// "lp|hp|bp|notch <hz> [q]" or "fir lp|hp <hz> <taps>" or "fir bp <hz> <hz> <taps>"
+int filter_parse(const char *text, filter_spec_t *spec);
@@ -12,10 +12,60 @@
 
 #define BLOCK 1000
 
+#define FRAME_INPUTS 2 // ADC channels
+#define FRAME_MATH 2   // channels derived from the inputs, see derived.h
+#define FRAME_CHANNELS (FRAME_INPUTS + FRAME_MATH)
+#define FRAME_SAMPLES 256 // per channel
+
+// samples of one DMA frame, demuxed in the DMA ISR, filtered and timed by adc_dma_task
+// and passed on to wifi_task through adc_queue
+typedef struct
+{
+    uint32_t seq;
+    uint16_t channels;
+    uint16_t count[FRAME_CHANNELS];
+    uint16_t conversions;          // in the DMA frame, all channels
+    uint16_t errors;               // conversions of no known channel
+    int16_t first[FRAME_CHANNELS]; // conversion index of the first sample of each channel
+    int16_t trigger;               // index of the trigger sample in its channel, -1 if none
+    uint8_t trigger_channel;
+    int64_t stamp;                 // esp_timer at DMA frame completion, taken in the ISR
+    uint32_t isr_cycles;           // CPU cycles the ISR spent on this frame
+    uint32_t period_ns[FRAME_CHANNELS]; // sample period of each channel from the clock estimator
+    uint8_t bits[FRAME_CHANNELS];       // full scale 2^bits: 12 raw, 16 or 24 decimated
+    float scale[FRAME_CHANNELS];        // sample * scale + offset is the value, 12 bit counts for inputs
+    float offset[FRAME_CHANNELS];
+    int64_t t0[FRAME_CHANNELS];         // time of the first sample of each channel, us
+    union
+    {
+        uint16_t data[FRAME_CHANNELS][FRAME_SAMPLES];
+        uint16_t merged[FRAME_CHANNELS * FRAME_SAMPLES]; // interleaved units, channel 0 may use the input slots
+        uint32_t wide[FRAME_CHANNELS * FRAME_SAMPLES / 2]; // channels of more than 16 bits
+    };
+} frame_t;
+
+static inline uint16_t *frame_samples(const frame_t *frame, int channel)
+{
+    return (uint16_t *)&frame->merged[channel * FRAME_SAMPLES];
+}
+
+static inline uint32_t *frame_samples32(const frame_t *frame, int channel)
+{
+    return (uint32_t *)&frame->wide[channel * FRAME_SAMPLES / 2];
+}
+
 extern QueueHandle_t adc_queue;
 extern QueueHandle_t ui_queue;
 
+// wifi_task wakeup events
+#define NET_FRAME (1 << 0) // a frame was published to adc_queue
+#define NET_CMD (1 << 1)   // a client command is waiting
+#define NET_MASK (1 << 2)  // a mask failure record is waiting
+
 void wifi_task(void *arg);
+void net_notify(uint32_t events);
+// a frame in the wire.h layout, out holds WS_BUF_SIZE bytes; returns the length
+size_t ws_encode_frame(const frame_t *frame, uint8_t *out);
 void adc_dma_task(void *arg);
 void task_SSD1306i2c(void *ignore);
 
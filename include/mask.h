@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "main.h"
+#include "capture.h"
+#include "wire.h"
+
+/*
+ * Mask test: every trigger edge (trigger.h settings, on the filtered input)
+ * starts an acquisition of `bins` bins of `bin` samples on the mask channel,
+ * `pre` bins of them before the edge. Once the capture holds the whole window,
+ * the min/max of every bin is checked against the mask, so each sample at the
+ * capture rate is judged. A new acquisition starts only after the previous
+ * window ended.
+ *
+ * Limits are raw capture samples of the mask channel, value = sample * scale + offset.
+ * Failures keep MASK_RECORD_SAMPLES around the first failing bin for the client,
+ * with "mask only on" the WebSocket carries nothing else, UDP and the wired
+ * stream keep every frame.
+ */
+
+#define MASK_BINS 256
+#define MASK_PENDING 8
+#define MASK_RECORDS 4
+#define MASK_RECORD_SAMPLES 1024
+
+// body of POST /mask, followed by `bins` capture_minmax_t limits
+typedef struct __attribute__((packed))
+{
+    uint8_t channel;
+    uint8_t reserved;
+    uint16_t bins;
+    uint16_t bin; // samples per bin
+    uint16_t pre; // bins before the trigger
+} mask_hdr_t;
+
+typedef struct
+{
+    uint32_t tested;
+    uint32_t failed;
+    uint32_t missed; // triggers that could not be tested: window busy, out of the capture
+    uint32_t unsent; // failures without a free record
+} mask_counters_t;
+
+// one failure, sent as a one channel wire frame, trigger is the index of the trigger sample
+typedef struct
+{
+    uint32_t test; // number of the acquisition, counts from 0 since the mask was set
+    uint16_t bin;  // first failing bin
+    uint16_t trigger;
+    wire_channel_hdr_t hdr;
+    uint16_t samples[MASK_RECORD_SAMPLES];
+} mask_record_t;
+
+_Static_assert(sizeof(wire_frame_hdr_t) + sizeof(wire_channel_hdr_t) + MASK_RECORD_SAMPLES * sizeof(uint16_t) <=
+                   WIRE_FRAME_MAX(FRAME_CHANNELS, FRAME_SAMPLES),
+               "mask record does not fit a WS buffer");
+
+// limits is hdr->bins entries
+esp_err_t mask_set(const mask_hdr_t *hdr, const capture_minmax_t *limits);
+void mask_off(void);
+bool mask_only(void);
+void mask_get_counters(mask_counters_t *out);
+
+// in adc_dma_task: look for edges in the trigger channel, then test finished windows,
+// mask_check returns the trigger time of the last failure, 0 if none
+void mask_scan(const frame_t *frame, const double *t_first, double period);
+int64_t mask_check(void);
+
+// oldest unsent failure, false if none; release it after sending
+bool mask_peek(const mask_record_t **rec);
+void mask_release(void);
+
+// "mask" for the counters, "mask off", "mask reset", "mask only on|off",
+// "mask learn <ch> <bins> <bin> <pre> <margin>" takes the next acquisition +- margin as the mask
+esp_err_t mask_command(const char *cmd, char *reply, size_t len);
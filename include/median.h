@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Sliding window median of any odd window up to MEDIAN_MAX_WINDOW, O(log window)
+ * per sample: a max heap of the lower half and a min heap of the upper half meet
+ * at the median, every value knows its heap position so the oldest one is
+ * replaced in place.
+ *
+ * The Hampel filter passes the window centre through unless it is further than
+ * k * 1.4826 * MAD from the median, then the median replaces it. MAD is the
+ * sliding median of the centre deviations over the same window. Until the window
+ * has filled it gives the median like the plain filter.
+ *
+ * Plain C with no platform dependencies.
+ */
+
+#define MEDIAN_MAX_WINDOW 31
+#define MEDIAN_HAMPEL_K 3.0f
+
+typedef enum
+{
+    MEDIAN_OFF,
+    MEDIAN_PLAIN,
+    MEDIAN_HAMPEL,
+} median_type_t;
+
+typedef struct
+{
+    uint8_t n;   // window
+    uint8_t ct;  // values in the window, n once filled
+    uint8_t idx; // slot of the oldest value
+    uint16_t data[MEDIAN_MAX_WINDOW];
+    int8_t pos[MEDIAN_MAX_WINDOW];  // heap position of each slot
+    int8_t heap[MEDIAN_MAX_WINDOW]; // slots, heap[n / 2] is the median: max heap below it, min heap above
+} median_window_t;
+
+typedef struct
+{
+    median_type_t type;
+    uint16_t k_q8;     // Hampel threshold k * 1.4826, 8 fractional bits
+    uint32_t outliers; // samples replaced by the Hampel filter
+    median_window_t values;
+    median_window_t deviations;
+} median_filter_t;
+
+// window odd, 1 to MEDIAN_MAX_WINDOW; k only for MEDIAN_HAMPEL; returns 0 or -1 on bad arguments
+int median_init(median_filter_t *f, median_type_t type, unsigned window, float k);
+
+// filter n samples in place, the output lags by median_delay() samples
+void median_run(median_filter_t *f, uint16_t *v, size_t n);
+
+static inline unsigned median_window(const median_filter_t *f)
+{
+    return f->type == MEDIAN_OFF ? 1 : f->values.n;
+}
+
+static inline unsigned median_delay(const median_filter_t *f)
+{
+    return median_window(f) / 2;
+}
+
+// k of the Hampel filter, for display
+static inline float median_k(const median_filter_t *f)
+{
+    return f->k_q8 / 256.0f / 1.4826f;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "main.h"
+#include "wire.h"
+
+/*
+ * Static memory plan. Everything the firmware needs in steady state is sized here
+ * and reserved at link time: fixed-block pools for frames and I/O buffers, and one
+ * arena that all task stacks are carved from. Nothing on the sample path may call
+ * malloc, with CONFIG_HEAP_USE_HOOKS this is checked at runtime.
+ */
+
+// fixed-block pools
+#define FRAME_POOL_SIZE 8
+#define WS_BUF_SIZE WIRE_FRAME_MAX(FRAME_CHANNELS, FRAME_SAMPLES)
+#define WS_POOL_SIZE 4
+#define FILE_BUF_SIZE CONFIG_LWIP_TCP_MSS
+#define FILE_POOL_SIZE 2
+
+// task stacks, bytes
+#define ADC_TASK_STACK (1024 * 4)
+#define WIFI_TASK_STACK (1024 * 6)
+#define RECORD_TASK_STACK (1024 * 4)
+#define CAPLOG_TASK_STACK (1024 * 3)
+#define TREND_TASK_STACK (1024 * 3)
+#define STACK_ARENA_SIZE (ADC_TASK_STACK + WIFI_TASK_STACK + RECORD_TASK_STACK + CAPLOG_TASK_STACK + TREND_TASK_STACK)
+#define MEM_TASKS_MAX 8
+
+typedef struct
+{
+    const char *name;
+    size_t block_size;
+    size_t count;
+    uint8_t *blocks;
+    uint8_t *queue_storage;
+    StaticQueue_t queue_buffer;
+    QueueHandle_t free;
+    size_t peak; // most blocks ever in use at once
+    uint32_t fails;
+} mem_pool_t;
+
+#define MEM_POOL_BLOCK(size) (((size) + 3) & ~3)
+
+#define MEM_POOL(var, size, n)                                                              \
+    static uint8_t var##_blocks[(n) * MEM_POOL_BLOCK(size)] __attribute__((aligned(4))); \
+    static uint8_t var##_queue[(n) * sizeof(void *)];                                     \
+    mem_pool_t var = {.name = #var, .block_size = MEM_POOL_BLOCK(size), .count = (n), .blocks = var##_blocks, .queue_storage = var##_queue}
+
+// WS send buffer, the payload follows the header inside one ws_pool block
+typedef struct
+{
+    size_t len;
+    int64_t stamp; // when the newest sample in data was taken, us
+    int fd;        // 0 for the streaming client
+    uint32_t seq;  // of the frame, for the trace
+    bool text;
+    uint8_t data[];
+} ws_buf_t;
+
+extern mem_pool_t frame_pool;
+extern mem_pool_t ws_pool;
+extern mem_pool_t file_pool;
+
+void mem_init(void);
+void *mem_pool_get(mem_pool_t *pool, TickType_t wait);
+void mem_pool_put(mem_pool_t *pool, void *block);
+void *mem_pool_get_from_isr(mem_pool_t *pool, BaseType_t *woken);
+void mem_pool_put_from_isr(mem_pool_t *pool, void *block, BaseType_t *woken);
+
+TaskHandle_t mem_task_create(TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg, UBaseType_t prio, BaseType_t core);
+
+// from here on every allocation made by the calling task is counted as a violation
+void mem_sample_path_begin(void);
+// and stop counting, around deliberate reconfiguration
+void mem_sample_path_end(void);
+
+void mem_report(void);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "main.h"
+#include "storage.h"
+
+/*
+ * Event recorder: the capture memory is the pre-event ring. Every event opens
+ * a window from pre ms before it to post ms after it; an event inside the
+ * still open window extends it, one after it starts where the last written
+ * window ended, so nothing is stored twice. Once the capture holds the whole
+ * window, record_task writes it to RECORD_DIR as one channel wire frames
+ * (wire.h) and appends a line to the event index RECORD_INDEX:
+ *
+ *   id,t0_us,t1_us,sources,bytes
+ */
+
+#define RECORD_DIR STORAGE_DIR
+#define RECORD_INDEX RECORD_DIR "/events.csv"
+#define RECORD_WINDOWS 4
+#define RECORD_FULL_PERCENT 90 // stop writing above this use of the file system
+
+// event sources
+#define RECORD_TRIGGER (1 << 0)
+#define RECORD_LEVEL (1 << 1) // a channel left [lo, hi]
+#define RECORD_MASK (1 << 2)  // mask test failure
+#define RECORD_MANUAL (1 << 3)
+
+esp_err_t record_set(uint32_t pre_ms, uint32_t post_ms, uint8_t channels);
+void record_off(void);
+
+// t in us, any task
+void record_event(int64_t t, uint8_t source);
+
+// in adc_dma_task: trigger and level events of the filtered inputs
+void record_scan(const frame_t *frame, const double *t_first, double period);
+
+void record_task(void *arg);
+
+// "record on <pre_ms> <post_ms> [channel mask]", "record off", "record trigger on|off",
+// "record mask on|off", "record level <ch> <lo> <hi>", "record level off", "record" for the status,
+// "event" marks one now
+esp_err_t record_command(const char *cmd, char *reply, size_t len);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "main.h"
+#include "capture.h"
+
+/*
+ * Segmented acquisition: once armed, every edge of the trigger (trigger.h
+ * settings, checked on the filtered full rate input) cuts a window of len
+ * samples, pre of them before the edge, out of the capture into the next of n
+ * segments, for every channel that has data. The next window may start right
+ * after the previous one ends, the time from that end until the trigger was
+ * ready again is the dead time of the segment. Windows are copied once the
+ * capture holds all of them, so shipping earlier segments costs no triggers.
+ *
+ * The segment memory is set aside once, before the capture takes the rest.
+ */
+
+#define SEGMENT_PSRAM_BYTES (1 << 20)
+#define SEGMENT_INTERNAL_BYTES (16 * 1024)
+#define SEGMENT_MAX 1024
+
+typedef struct
+{
+    uint8_t channel;
+    uint16_t count;
+    uint32_t period_ns;
+    int64_t t0; // us
+    float scale, offset;
+    const uint16_t *samples;
+} segment_channel_t;
+
+typedef struct
+{
+    int64_t trigger;  // us
+    uint32_t dead_us; // from the end of the previous segment until the trigger was ready again
+    uint16_t pre;     // samples before the trigger on the trigger channel
+    uint8_t trigger_channel;
+    uint8_t channels;
+    segment_channel_t ch[CAPTURE_CHANNELS];
+} segment_t;
+
+esp_err_t segment_init(void);
+
+// applied by adc_dma_task at the next frame
+esp_err_t segment_arm(unsigned n, unsigned len, unsigned pre);
+void segment_disarm(void);
+
+// in adc_dma_task: look for edges in the trigger channel, then copy finished windows
+void segment_scan(const frame_t *frame, const double *t_first, double period);
+void segment_collect(void);
+
+// finished segments; they stay valid while the generation is unchanged,
+// segment_get returns ESP_ERR_INVALID_STATE if it changed during the copy
+unsigned segment_filled(void);
+uint32_t segment_generation(void);
+esp_err_t segment_get(unsigned k, segment_t *out);
+
+// "segments <n> <len> [pre]", "segments off", "segments" for the status
+esp_err_t segment_command(const char *cmd, char *reply, size_t len);
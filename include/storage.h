@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/*
+ * The file system of the web pages, recordings and trend files: SPIFFS under
+ * STORAGE_DIR on the chip. The Linux build keeps them in a host directory, data/
+ * of the working tree unless the build sets STORAGE_DIR, and has stand-ins for
+ * esp_spiffs_info() and esp_spiffs_mounted().
+ */
+
+#if CONFIG_IDF_TARGET_LINUX
+
+#include <sys/statvfs.h>
+
+#ifndef STORAGE_DIR
+#define STORAGE_DIR "data"
+#endif
+
+static inline esp_err_t esp_spiffs_info(const char *label, size_t *total, size_t *used)
+{
+    struct statvfs s;
+    if (statvfs(STORAGE_DIR, &s) != 0)
+        return ESP_FAIL;
+    *total = (size_t)s.f_blocks * s.f_frsize;
+    *used = (size_t)(s.f_blocks - s.f_bavail) * s.f_frsize;
+    return ESP_OK;
+}
+
+static inline bool esp_spiffs_mounted(const char *label)
+{
+    return true;
+}
+
+#else
+
+#include "esp_spiffs.h"
+
+#define STORAGE_DIR "/spiffs"
+
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Sample clock estimator. A second order delay-locked loop is fed with the raw
+ * esp_timer timestamp taken in the DMA ISR at the end of every frame and the
+ * number of conversions in that frame. It returns a smoothed frame end time and
+ * tracks the true conversion period, so frame timestamps neither jitter with
+ * interrupt latency nor drift with the ADC clock divider error.
+ */
+
+typedef struct
+{
+    double nominal;   // configured conversion period, us
+    double period;    // estimated conversion period, us
+    double t;         // filtered time of the last conversion of the last frame, us
+    double bandwidth; // loop bandwidth, Hz
+    double err_rms;   // running RMS of the raw timestamp error, us
+    uint32_t frames;
+    uint32_t resets;
+} timebase_t;
+
+void timebase_init(timebase_t *tb, uint32_t sample_freq_hz);
+// returns the filtered time of the last conversion of this frame, us
+double timebase_update(timebase_t *tb, int64_t t_raw, uint32_t conversions);
+// estimated conversion rate, Hz
+double timebase_rate(const timebase_t *tb);
+// deviation of the estimated rate from the configured one, ppm
+double timebase_ppm(const timebase_t *tb);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/*
+ * Pipeline trace: begin/end/instant events of the sample path stages, tagged
+ * with the frame seq, in one ring per core. Writers only reserve a slot with an
+ * atomic add, so ISRs and tasks on the same core can trace; the export pauses
+ * tracing while it reads. GET /trace downloads the rings as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev): one thread per core, a flow arrow per frame.
+ *
+ * With a late threshold set tracing stops by itself at the first frame that
+ * took longer from sampling to the WS socket, so the rings end with that frame.
+ */
+
+#define TRACE_EVENTS 512 // per core
+
+typedef enum
+{
+    TRACE_ISR,      // DMA callback, demux included
+    TRACE_TRIGGER,  // inside the ISR
+    TRACE_RECEIVE,  // adc_dma_task has the frame
+    TRACE_FILTER,   // interleave merge, median and filters
+    TRACE_ANALYSIS, // derived channels, segments, mask, recorder
+    TRACE_CAPTURE,  // decimation and capture writes
+    TRACE_QUEUE,    // handed to the network task
+    TRACE_ENCODE,   // wire frame
+    TRACE_UDP,
+    TRACE_WIRED,
+    TRACE_WS_QUEUE, // httpd work queued
+    TRACE_WS_SEND,  // in the httpd task until the socket took it
+    TRACE_OLED,     // display flush
+    TRACE_STAGES,
+} trace_stage_t;
+
+typedef enum
+{
+    TRACE_BEGIN = 'B',
+    TRACE_END = 'E',
+    TRACE_INSTANT = 'i',
+} trace_phase_t;
+
+extern volatile bool trace_on;
+
+void trace_write(trace_stage_t stage, trace_phase_t phase, uint32_t seq);
+
+static inline __attribute__((always_inline)) void trace(trace_stage_t stage, trace_phase_t phase, uint32_t seq)
+{
+    if (trace_on)
+        trace_write(stage, phase, seq);
+}
+
+// frame to wire latency of a sent frame, stops tracing above the late threshold
+void trace_latency(uint32_t seq, int64_t us);
+
+// sink returns ESP_OK to go on
+typedef esp_err_t (*trace_sink_t)(const char *data, size_t len, void *arg);
+
+// Chrome trace JSON of the rings, buf of at least 512 bytes
+esp_err_t trace_export(trace_sink_t sink, void *arg, char *buf, size_t len);
+
+// "trace on [late us]", "trace off", "trace clear", "trace" for the state
+esp_err_t trace_command(const char *cmd, char *reply, size_t len);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "capture.h"
+#include "storage.h"
+
+/*
+ * Long term trend: min/max/mean/RMS of every sample of the chosen capture
+ * channels per second, rolled up per minute and per hour. Each resolution of
+ * each channel is a fixed size circular file in TREND_DIR, the newest second
+ * points are kept in RAM and written once a minute.
+ *
+ * Times are unix seconds once SNTP has set the clock, until then they go on
+ * from the newest stored point.
+ */
+
+#define TREND_DIR STORAGE_DIR
+#define TREND_LEVELS 3
+#define TREND_S_POINTS (15 * 60)       // 15 min of seconds
+#define TREND_MIN_POINTS (2 * 24 * 60) // 2 days of minutes
+#define TREND_H_POINTS (8 * 7 * 24)    // 8 weeks of hours
+#define TREND_MAX_POINTS 4096
+
+typedef struct __attribute__((packed))
+{
+    uint32_t t; // start, unix s
+    float min, max, mean, rms;
+} trend_point_t;
+
+// reply of the /trend query, followed by trend_point_t up to the end
+typedef struct __attribute__((packed))
+{
+    uint32_t now;        // device time, unix s
+    uint32_t resolution; // s
+    uint8_t channel;
+    uint8_t reserved[3];
+} trend_query_hdr_t;
+
+void trend_task(void *arg);
+
+// channels - bit mask of capture channels, kept in NVS
+esp_err_t trend_set(uint8_t channels);
+uint32_t trend_now(void);
+
+// coarsest resolution with at least n points in [t0, t1] that still holds t0
+int trend_level(int channel, uint32_t t0, uint32_t t1, size_t n);
+uint32_t trend_resolution(int level);
+// points of one level in [t0, t1] oldest first, cb returns false to stop
+typedef bool (*trend_cb_t)(const trend_point_t *p, size_t n, void *arg);
+esp_err_t trend_read(int channel, int level, uint32_t t0, uint32_t t1, trend_cb_t cb, void *arg);
+
+// "trend" for the status, "trend <channel mask>", "trend off"
+esp_err_t trend_command(const char *cmd, char *reply, size_t len);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "main.h"
+
+/*
+ * Edge trigger, checked in the DMA ISR on the raw samples of one channel.
+ * After firing it rearms only once the signal has gone back past the level
+ * by more than the hysteresis, so noise around the level does not retrigger.
+ */
+
+typedef enum
+{
+    TRIGGER_OFF,
+    TRIGGER_RISING,
+    TRIGGER_FALLING,
+} trigger_slope_t;
+
+typedef struct
+{
+    uint8_t channel;
+    trigger_slope_t slope;
+    uint16_t level;
+    uint16_t hysteresis;
+} trigger_t;
+
+// one sample through the edge detector, returns true when it fires; inlined into the ISR
+static inline __attribute__((always_inline)) bool trigger_step(const trigger_t *t, bool *armed, int v)
+{
+    if (t->slope == TRIGGER_RISING)
+    {
+        if (!*armed)
+            *armed = v < (int)t->level - t->hysteresis;
+        else if (v >= t->level)
+        {
+            *armed = false;
+            return true;
+        }
+    }
+    else if (t->slope == TRIGGER_FALLING)
+    {
+        if (!*armed)
+            *armed = v > (int)t->level + t->hysteresis;
+        else if (v <= t->level)
+        {
+            *armed = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+void trigger_set(const trigger_t *t);
+void trigger_get(trigger_t *t);
+
+// mark the first trigger in a freshly demuxed frame, sets frame->trigger and trigger_channel
+void trigger_frame_from_isr(frame_t *frame);
+// parse "trigger <channel> <level> <rising|falling|off> [hysteresis]"
+esp_err_t trigger_command(const char *cmd);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/*
+ * Low latency sample stream over UDP next to the WS one: the same wire frames,
+ * cut into MTU sized datagrams (wire.h) and sent the moment they are encoded to
+ * one host or a multicast group. Nothing is retransmitted, whatever is lost
+ * stays lost unless the optional parity restores it. Only the network task
+ * calls in here.
+ */
+
+#define UDP_FEC_MAX 32 // data datagrams per parity one
+
+// group - data datagrams per parity one, 0 turns FEC off
+esp_err_t udp_start(const char *host, uint16_t port, int group);
+void udp_stop(void);
+bool udp_active(void);
+
+// one encoded wire frame, stamp - when its newest sample was taken, us
+void udp_send_frame(const uint8_t *frame, size_t len, uint32_t seq, int64_t stamp);
+
+// "udp <ip> <port> [fec <n>]", "udp off", "udp" for the state
+esp_err_t udp_command(const char *cmd, char *reply, size_t len);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Binary frame sent to clients, little endian:
+ *
+ *   wire_frame_hdr_t
+ *   channels x { wire_channel_hdr_t, count x sample }
+ *
+ * Samples are unsigned with full scale 2^bits: uint16_t up to 16 bits, three
+ * bytes above that, sample * scale + offset is the value. Inputs are in 12 bit
+ * counts, decimated ones run at their own rate and resolution, derived channels
+ * have units of their own (derived.h).
+ *
+ * Times are device time (esp_timer, us since boot) corrected by the sample
+ * clock estimator, so samples of different channels and frames line up.
+ */
+
+#define WIRE_MAGIC 0x534f // "OS"
+#define WIRE_VERSION 3
+
+typedef struct __attribute__((packed))
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels;
+    uint32_t seq;     // frame counter, gaps mean lost frames
+    uint16_t trigger; // 1 + index of the trigger sample in its channel, 0 if none
+    uint8_t trigger_channel;
+    uint8_t reserved;
+} wire_frame_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t channel;
+    uint8_t bits; // resolution, 12 raw
+    uint16_t count;
+    uint32_t period_ns;
+    int64_t t0; // time of the first sample, us
+    float scale;
+    float offset;
+} wire_channel_hdr_t;
+
+static inline int wire_width(int bits)
+{
+    return bits > 16 ? 3 : 2;
+}
+
+// decimated channels have fewer samples than the raw ones, so 16 bit raw is the worst case
+#define WIRE_FRAME_MAX(channels, samples) \
+    (sizeof(wire_frame_hdr_t) + (channels) * (sizeof(wire_channel_hdr_t) + (samples) * sizeof(uint16_t)))
+
+/*
+ * UDP stream (udp.h): every wire frame is cut into datagrams that fit one Wi-Fi
+ * MTU, each led by wire_udp_hdr_t. seq counts data datagrams only, so a gap in it
+ * is that many lost ones. With FEC a parity datagram follows every group of data
+ * ones and at the end of each frame: the XOR of their bytes from `len` on, zero
+ * padded to the longest, which restores any single one of the group.
+ */
+
+#define WIRE_UDP_MAGIC 0x5553  // "US"
+#define WIRE_UDP_DATAGRAM 1472 // 1500 byte MTU less the IP and UDP headers
+#define WIRE_UDP_PARITY 0x01
+
+typedef struct __attribute__((packed))
+{
+    uint16_t magic;
+    uint8_t version; // WIRE_VERSION of the frames
+    uint8_t flags;
+    uint32_t seq;  // data datagram counter, for parity the first one it covers
+    uint8_t group; // data datagrams covered by a parity one, 0 without FEC
+    uint8_t reserved;
+    // covered by parity from here on
+    uint16_t len;    // payload bytes
+    uint32_t frame;  // wire_frame_hdr_t.seq
+    uint16_t offset; // of the payload in the frame
+    uint16_t total;  // frame bytes
+} wire_udp_hdr_t;
+
+#define WIRE_UDP_PROTECTED offsetof(wire_udp_hdr_t, len)
+#define WIRE_UDP_PAYLOAD (WIRE_UDP_DATAGRAM - sizeof(wire_udp_hdr_t))
+
+/*
+ * Byte stream framing (wired.h): a wire frame and its CRC-32 (IEEE, little
+ * endian) are COBS encoded, which leaves no zero byte in them, and sent between
+ * two zeros. A receiver that starts anywhere or drops bytes is back in step at
+ * the next zero.
+ */
+
+#define WIRE_COBS_MAX(n) ((n) + (n) / 254 + 2)
+
+static inline size_t wire_cobs_encode(const uint8_t *in, size_t n, uint8_t *out)
+{
+    uint8_t *code = out;
+    uint8_t *p = out + 1;
+    uint8_t c = 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (in[i] != 0)
+        {
+            *p++ = in[i];
+            c++;
+        }
+        if (in[i] == 0 || c == 0xFF)
+        {
+            *code = c;
+            code = p++;
+            c = 1;
+        }
+    }
+    *code = c;
+    return p - out;
+}
+
+// out may be in, returns the decoded length, 0 if the block is malformed
+static inline size_t wire_cobs_decode(const uint8_t *in, size_t n, uint8_t *out)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < n;)
+    {
+        uint8_t c = in[i++];
+        if (c == 0 || i + c - 1 > n)
+            return 0;
+        for (int k = 1; k < c; k++)
+            out[o++] = in[i++];
+        if (c < 0xFF && i < n)
+            out[o++] = 0;
+    }
+    return o;
+}
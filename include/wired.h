@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/*
+ * Wired sample stream: the wire frames COBS framed with a CRC (wire.h) over USB
+ * or a UART, for the bench where a cable carries the full rate Wi-Fi can't. The
+ * drivers queue the bytes and their interrupts feed the hardware, a frame that
+ * does not fit the queue is dropped whole and shows as a seq gap. USB and the CDC
+ * console may take part of a frame; that one is counted as torn, the receiver
+ * fails its CRC and resyncs at the next frame's leading zero. Log output is
+ * muted while the stream shares the console. The REPL of bench.h holds the
+ * console's driver, so while it runs "wired usb" or "wired uart" on the console
+ * port is refused. Only the network task calls in here.
+ */
+
+#define WIRED_TX_BUF (16 * 1024) // driver queue, several frames
+
+typedef enum
+{
+    WIRED_OFF,
+    WIRED_UART,
+    WIRED_USB, // USB Serial/JTAG, or the USB CDC console where there is none
+} wired_port_t;
+
+#if CONFIG_IDF_TARGET_LINUX
+// no serial port in the Linux build, the UDP stream stands in
+static inline bool wired_active(void)
+{
+    return false;
+}
+
+static inline void wired_send_frame(const uint8_t *frame, size_t len)
+{
+}
+
+static inline esp_err_t wired_command(const char *cmd, char *reply, size_t len)
+{
+    reply[0] = 0;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#else
+// tx_pin < 0 - the console UART at `baud`
+esp_err_t wired_start(wired_port_t port, uint32_t baud, int tx_pin);
+void wired_stop(void);
+bool wired_active(void);
+
+// one encoded wire frame
+void wired_send_frame(const uint8_t *frame, size_t len);
+
+// "wired uart <baud> [tx pin]", "wired usb", "wired off", "wired" for the state
+esp_err_t wired_command(const char *cmd, char *reply, size_t len);
+#endif
@@ -1,45 +1,645 @@
 #include "main.h"
+#include "adc.h"
+#include "mem.h"
+#include "capture.h"
+#include "timebase.h"
+#include "trigger.h"
+#include "fft.h"
+#include "median.h"
+#include "filter.h"
+#include "derived.h"
+#include "segment.h"
+#include "mask.h"
+#include "record.h"
+#include "caplog.h"
+#include "trend.h"
+#include "trace.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include "adc_sim.h"
+#else
 #include "esp_adc/adc_continuous.h"
-#include "esp_timer.h"
 #include "hal/adc_ll.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#endif
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "nvs.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "adc";
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MEDIAN(a) (MAX(a[0], a[1]) == MAX(a[1], a[2])) ? MAX(a[0], a[2]) : MAX(a[1], MIN(a[0], a[2]))
 
 adc_continuous_handle_t adchandle = NULL;
 
-#define BUFFER (200 * SOC_ADC_DIGI_RESULT_BYTES)
-
-#if CONFIG_IDF_TARGET_ESP32C3 || CONFIG_IDF_TARGET_ESP32C2 || CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_ESP32C6 || CONFIG_IDF_TARGET_ESP32H2 || CONFIG_IDF_TARGET_ESP32C5 || CONFIG_IDF_TARGET_ESP32C61
-#define ACDTYPE type2
+#define SAMPLE_FREQ (20000 * 3)
+#define CHANNELS 2 // conversions in the pattern, the per-channel rate is SAMPLE_FREQ / CHANNELS
+
+// running settings, and the ones requested by adc_set_rate / adc_set_mode
+static uint32_t s_rate = SAMPLE_FREQ;
+static uint32_t s_latency_us = ADC_LATENCY_US;
+static adc_mode_t s_mode = ADC_MODE_CHANNELS;
+static uint32_t s_conversions = 0; // per DMA frame
+static uint32_t s_new_rate = SAMPLE_FREQ, s_new_latency_us = ADC_LATENCY_US;
+static adc_mode_t s_new_mode = ADC_MODE_CHANNELS;
+static volatile bool s_retune = false;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#define MEDIAN_WINDOW 3 // default spike filter
+
+// per output channel filter stages, requested ones are taken over at a frame boundary
+static median_filter_t s_median[FRAME_INPUTS];
+static median_filter_t s_new_median[FRAME_INPUTS];
+static filter_chain_t s_filter[FRAME_INPUTS];
+static filter_chain_t s_new_filter[FRAME_INPUTS];
+static decim_t s_decim[FRAME_INPUTS];
+static decim_t s_new_decim[FRAME_INPUTS];
+static volatile bool s_restage = false;
+static uint32_t decimated[FRAME_INPUTS * FRAME_SAMPLES / 2];
+static uint16_t narrowed[FRAME_INPUTS * FRAME_SAMPLES / 2]; // 24 bit output cut down for the capture
+
+// one input sampled by both units in turn, where ADC2 can do DMA
+#if SOC_ADC_PERIPH_NUM > 1 && SOC_ADC_DIG_SUPPORTED_UNIT(1)
+#define INTERLEAVE 1
+#define INTERLEAVE_ADC1_CHANNEL ADC_CHANNEL_0
+#define INTERLEAVE_ADC2_CHANNEL ADC_CHANNEL_0 // its pin is wired to the same input
 #else
-#define ACDTYPE type1
+#define INTERLEAVE 0
 #endif
 
-static TaskHandle_t s_task_handle;
+// ADC2 correction in interleaved mode: v * gain / 65536 + offset
+static int32_t s_gain_q16 = 65536;
+static int32_t s_offset = 0;
+
+#define CAL_MS 1000
+#define CAL_MIN_VARIANCE 100 // counts^2, the input has to move for the gain to show
+#define SPUR_FFT 4096
+
+// calibration run, accumulated by adc_dma_task
+static struct
+{
+    volatile bool request;
+    uint32_t frames; // still to go
+    double sx, sy, sxx, sxy;
+    uint32_t n;
+} cal;
+
+// filled frames, from the DMA ISR to adc_dma_task
+static QueueHandle_t dma_queue;
+static StaticQueue_t dma_queue_buffer;
+static uint8_t dma_queue_storage[FRAME_POOL_SIZE * sizeof(frame_t *)];
+
+static uint32_t s_seq = 0;
+static volatile uint32_t s_overruns = 0; // DMA frames lost because adc_dma_task was behind
+
+static timebase_t timebase;
 
+void IRAM_ATTR adc_demux(frame_t *frame, const uint8_t *buf, uint32_t bytes)
+{
+    frame->channels = FRAME_INPUTS;
+    frame->conversions = bytes / SOC_ADC_DIGI_RESULT_BYTES;
+    frame->errors = 0;
+    for (int c = 0; c < FRAME_CHANNELS; c++)
+    {
+        frame->count[c] = 0;
+        frame->first[c] = -1;
+    }
+
+    const adc_digi_output_data_t *p = (const void *)buf;
+    for (int j = 0; j < frame->conversions; j++, p++)
+    {
+        // units stand in for channels while interleaving
+        uint32_t c = s_mode == ADC_MODE_INTERLEAVED ? CONV_UNIT(p, j) : p->ACDTYPE.channel;
+        if (c >= FRAME_INPUTS || frame->count[c] >= FRAME_SAMPLES)
+        {
+            frame->errors++;
+            continue;
+        }
+        if (frame->first[c] < 0)
+            frame->first[c] = j;
+        frame->data[c][frame->count[c]++] = p->ACDTYPE.data;
+    }
+}
+
+/*
+ * Runs in the DMA ISR on the driver's own frame buffer: stamp the frame, demux it
+ * into a frame_t from the pool and check the trigger. Everything else is left to
+ * adc_dma_task, which gets the frame pointer, so samples are never read back from
+ * the driver pool.
+ */
 static bool IRAM_ATTR s_conv_done_cb(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
 {
     BaseType_t mustYield = pdFALSE;
-    // Notify that ADC continuous driver has done enough number of conversions
-    vTaskNotifyGiveFromISR(s_task_handle, &mustYield);
+    int64_t stamp = esp_timer_get_time();
+    uint32_t cycles = esp_cpu_get_cycle_count();
+    uint32_t seq = s_seq++;
+
+    trace(TRACE_ISR, TRACE_BEGIN, seq);
+    frame_t *frame = mem_pool_get_from_isr(&frame_pool, &mustYield);
+    if (frame == NULL)
+    {
+        s_overruns++;
+        trace(TRACE_ISR, TRACE_END, seq);
+        return (mustYield == pdTRUE);
+    }
+
+    frame->seq = seq;
+    frame->stamp = stamp;
+    adc_demux(frame, edata->conv_frame_buffer, edata->size);
+
+    trace(TRACE_TRIGGER, TRACE_BEGIN, seq);
+    trigger_frame_from_isr(frame);
+    trace(TRACE_TRIGGER, TRACE_END, seq);
+    frame->isr_cycles = esp_cpu_get_cycle_count() - cycles;
+
+    if (xQueueSendFromISR(dma_queue, &frame, &mustYield) != pdTRUE)
+    {
+        mem_pool_put_from_isr(&frame_pool, frame, &mustYield);
+        s_overruns++;
+    }
+    trace(TRACE_ISR, TRACE_END, seq);
 
     return (mustYield == pdTRUE);
 }
 
+// conversions per DMA frame for a rate and frame period target, whole patterns only
+static uint32_t frame_conversions(uint32_t rate, uint32_t latency_us)
+{
+    uint64_t n = (uint64_t)rate * MAX(latency_us, ADC_MIN_FRAME_US) / 1000000;
+    n -= n % CHANNELS;
+    if (n < CHANNELS)
+        n = CHANNELS;
+    if (n > FRAME_INPUTS * FRAME_SAMPLES)
+        n = FRAME_INPUTS * FRAME_SAMPLES;
+    return n;
+}
+
+esp_err_t adc_set_rate(uint32_t hz, uint32_t latency_us)
+{
+    if (hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW || hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH || latency_us == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new_rate = hz;
+    s_new_latency_us = latency_us;
+    s_retune = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+esp_err_t adc_set_mode(adc_mode_t mode)
+{
+    if (mode == ADC_MODE_INTERLEAVED && !INTERLEAVE)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new_mode = mode;
+    s_retune = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+adc_mode_t adc_get_mode(void)
+{
+    return s_mode;
+}
+
+esp_err_t adc_set_decim(int channel, decim_type_t type, unsigned ratio, unsigned bits)
+{
+    decim_t d;
+    if (channel < 0 || channel >= FRAME_INPUTS || decim_init(&d, type, ratio, bits) != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new_decim[channel] = d;
+    s_restage = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+esp_err_t adc_set_median(int channel, median_type_t type, unsigned window, float k)
+{
+    median_filter_t f;
+    if (channel < 0 || channel >= FRAME_INPUTS || median_init(&f, type, window, k) != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new_median[channel] = f;
+    s_restage = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+// ADC conversions behind one output sample
+static inline int conversions_per_sample(void)
+{
+    return s_mode == ADC_MODE_INTERLEAVED ? 1 : CHANNELS;
+}
+
+esp_err_t adc_filter_clear(int channel)
+{
+    if (channel < 0 || channel >= FRAME_INPUTS)
+        return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&s_lock);
+    filter_clear(&s_new_filter[channel]);
+    s_restage = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+esp_err_t adc_filter_add(int channel, const filter_spec_t *spec)
+{
+    if (channel < 0 || channel >= FRAME_INPUTS)
+        return ESP_ERR_INVALID_ARG;
+
+    // try it on a copy at the current rate, the real design happens in stages_apply
+    filter_chain_t f;
+    taskENTER_CRITICAL(&s_lock);
+    f = s_new_filter[channel];
+    taskEXIT_CRITICAL(&s_lock);
+    if (filter_add(&f, spec) != 0 || filter_design(&f, (float)s_rate / conversions_per_sample()) != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new_filter[channel] = f;
+    s_restage = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+// coefficients for the per-channel rate, a chain that no longer fits is dropped
+static void filters_design(void)
+{
+    float rate = timebase_rate(&timebase) / conversions_per_sample();
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        if (s_filter[c].stages > 0 && filter_design(&s_filter[c], rate) != 0)
+        {
+            ESP_LOGE(TAG, "channel %d: filter does not fit %.0f Hz, removed", c, rate);
+            filter_clear(&s_filter[c]);
+        }
+}
+
+// rate: conversions per second
+static void capture_rates(double rate)
+{
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        capture_set_rate(c, lround(rate / conversions_per_sample() / decim_ratio(&s_decim[c])));
+    // derived channels run at the input rate
+    for (int c = FRAME_INPUTS; c < FRAME_CHANNELS; c++)
+        capture_set_rate(c, lround(rate / conversions_per_sample()));
+}
+
+// take over the requested filter stages from a clean state
+static void stages_apply(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    memcpy(s_median, s_new_median, sizeof(s_median));
+    memcpy(s_filter, s_new_filter, sizeof(s_filter));
+    memcpy(s_decim, s_new_decim, sizeof(s_decim));
+    s_restage = false;
+    taskEXIT_CRITICAL(&s_lock);
+
+    filters_design();
+
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        median_filter_t *m = &s_median[c];
+        if (m->type == MEDIAN_PLAIN)
+            ESP_LOGI(TAG, "channel %d: median of %d", c, median_window(m));
+        else if (m->type == MEDIAN_HAMPEL)
+            ESP_LOGI(TAG, "channel %d: Hampel filter of %d, k %.1f", c, median_window(m), median_k(m));
+
+        if (s_filter[c].stages > 0)
+            ESP_LOGI(TAG, "channel %d: %d biquads, %d FIR taps", c, s_filter[c].biquads, s_filter[c].taps);
+
+        decim_t *d = &s_decim[c];
+        if (d->type != DECIM_OFF)
+            ESP_LOGI(TAG, "channel %d: %s decimation by %d, %d bits, delay %.1f samples", c,
+                     d->type == DECIM_CIC ? "CIC" : "boxcar", decim_ratio(d), d->bits, decim_delay(d));
+    }
+    capture_rates(timebase_rate(&timebase));
+}
+
+// samples the median and filter stages delay channel c by
+static inline unsigned stages_delay(int c)
+{
+    return median_delay(&s_median[c]) + filter_delay(&s_filter[c]);
+}
+
+/*
+ * Replace the raw samples of channel c by the decimated ones. t_first is the time
+ * of the first raw sample and period the raw sample period, us. Output samples are
+ * placed where the filter centres them, decim_delay() raw samples before the input
+ * they were produced on.
+ */
+static void decimate(frame_t *frame, int c, double t_first, double period)
+{
+    decim_t *d = &s_decim[c];
+    const int r = decim_ratio(d);
+    size_t first;
+    size_t n = decim_run(d, frame_samples(frame, c), frame->count[c], decimated, &first);
+
+    double skip = first - decim_delay(d); // raw samples from the first input to the first output
+    frame->t0[c] = llround(t_first + skip * period);
+    frame->period_ns[c] = lround(period * r * 1000);
+    frame->bits[c] = d->bits;
+    frame->scale[c] = 1.0f / (1 << (d->bits - 12));
+    frame->offset[c] = 0;
+
+    if (frame->trigger >= 0 && frame->trigger_channel == c)
+    {
+        long k = lround((frame->trigger - skip) / r);
+        frame->trigger = n == 0 ? -1 : k < 0 ? 0 : k >= (long)n ? n - 1 : k;
+    }
+
+    frame->count[c] = n;
+    if (d->bits > 16)
+    {
+        memcpy(frame_samples32(frame, c), decimated, n * sizeof(uint32_t));
+        for (size_t i = 0; i < n; i++)
+            narrowed[i] = decimated[i] >> (d->bits - 16);
+        capture_set_format(c, frame->scale[c] * (1 << (d->bits - 16)), 0);
+        capture_write(c, narrowed, n, frame->t0[c]);
+    }
+    else
+    {
+        uint16_t *v = frame_samples(frame, c);
+        for (size_t i = 0; i < n; i++)
+            v[i] = decimated[i];
+        capture_set_format(c, frame->scale[c], 0);
+        capture_write(c, v, n, frame->t0[c]);
+    }
+}
+
+esp_err_t adc_interleave_calibrate(void)
+{
+    if (s_mode != ADC_MODE_INTERLEAVED)
+        return ESP_ERR_INVALID_STATE;
+    cal.request = true;
+    return ESP_OK;
+}
+
+static void interleave_load(void)
+{
+    nvs_handle_t h;
+    if (nvs_open("adc", NVS_READONLY, &h) != ESP_OK)
+        return;
+    nvs_get_i32(h, "gain", &s_gain_q16);
+    nvs_get_i32(h, "offset", &s_offset);
+    nvs_close(h);
+}
+
+static void interleave_save(void)
+{
+    nvs_handle_t h;
+    if (nvs_open("adc", NVS_READWRITE, &h) != ESP_OK)
+        return;
+    nvs_set_i32(h, "gain", s_gain_q16);
+    nvs_set_i32(h, "offset", s_offset);
+    nvs_commit(h);
+    nvs_close(h);
+}
+
+static inline bool adc2_leads(const frame_t *frame)
+{
+    return frame->first[1] >= 0 && (frame->first[0] < 0 || frame->first[1] < frame->first[0]);
+}
+
+// every ADC2 sample sits halfway between two ADC1 samples, fit it to their mean
+static void interleave_calibrate(const frame_t *frame)
+{
+    const uint16_t *u1 = frame->data[0];
+    const uint16_t *u2 = frame->data[1];
+    bool lead2 = adc2_leads(frame);
+
+    for (int i = 0; i < frame->count[1]; i++)
+    {
+        int a = lead2 ? i - 1 : i;
+        if (a < 0 || a + 1 >= frame->count[0])
+            continue;
+        double x = u2[i];
+        double y = 0.5 * (u1[a] + u1[a + 1]);
+        cal.sx += x;
+        cal.sy += y;
+        cal.sxx += x * x;
+        cal.sxy += x * y;
+        cal.n++;
+    }
+
+    if (--cal.frames > 0)
+        return;
+
+    double n = cal.n;
+    double var = cal.sxx / n - (cal.sx / n) * (cal.sx / n);
+    double gain = 1;
+    if (var >= CAL_MIN_VARIANCE)
+        gain = (n * cal.sxy - cal.sx * cal.sy) / (n * cal.sxx - cal.sx * cal.sx);
+    else
+        ESP_LOGW(TAG, "calibration: input too steady for a gain estimate, offset only");
+
+    if (n < 100 || gain < 0.8 || gain > 1.25)
+    {
+        ESP_LOGE(TAG, "calibration failed: %" PRIu32 " pairs, gain %.4f", cal.n, gain);
+        return;
+    }
+
+    double offset = (cal.sy - gain * cal.sx) / n;
+    s_gain_q16 = lround(gain * 65536);
+    s_offset = lround(offset);
+    ESP_LOGI(TAG, "calibration: %" PRIu32 " pairs, ADC2 gain %.4f, offset %+.1f", cal.n, gain, offset);
+
+    mem_sample_path_end();
+    interleave_save();
+    mem_sample_path_begin();
+}
+
+// correct ADC2 against ADC1 and merge both unit streams into channel 0 in conversion order
+static void interleave_merge(frame_t *frame)
+{
+    static uint16_t merged[FRAME_INPUTS * FRAME_SAMPLES];
+    uint16_t *u1 = frame->data[0];
+    uint16_t *u2 = frame->data[1];
+
+    for (int i = 0; i < frame->count[1]; i++)
+    {
+        int v = (int)(((int64_t)u2[i] * s_gain_q16 + 32768) >> 16) + s_offset;
+        u2[i] = v < 0 ? 0 : v > 0xfff ? 0xfff : v;
+    }
+
+    bool lead2 = adc2_leads(frame);
+    const uint16_t *a = lead2 ? u2 : u1;
+    const uint16_t *b = lead2 ? u1 : u2;
+    int na = frame->count[lead2 ? 1 : 0];
+    int nb = frame->count[lead2 ? 0 : 1];
+    int n = 0, i = 0;
+    for (; i < na && i < nb; i++)
+    {
+        merged[n++] = a[i];
+        merged[n++] = b[i];
+    }
+    for (int k = i; k < na; k++)
+        merged[n++] = a[k];
+    for (int k = i; k < nb; k++)
+        merged[n++] = b[k];
+    memcpy(frame->merged, merged, n * sizeof(uint16_t));
+
+    if (frame->trigger >= 0)
+        frame->trigger = 2 * frame->trigger + ((frame->trigger_channel == 1) != lead2);
+    frame->trigger_channel = 0;
+
+    frame->first[0] = lead2 ? frame->first[1] : MAX(frame->first[0], 0);
+    frame->first[1] = -1;
+    frame->count[0] = n;
+    frame->count[1] = 0;
+    frame->channels = 1;
+}
+
+esp_err_t adc_interleave_spurs(char *out, size_t len)
+{
+    // the capture has to hold the raw merged stream
+    if (s_mode != ADC_MODE_INTERLEAVED || s_decim[0].type != DECIM_OFF)
+        return ESP_ERR_INVALID_STATE;
+
+    uint16_t *samples = heap_caps_malloc(SPUR_FFT * sizeof(uint16_t), MALLOC_CAP_8BIT);
+    float *work = heap_caps_malloc(2 * SPUR_FFT * sizeof(float), MALLOC_CAP_8BIT);
+    float *power = heap_caps_malloc((SPUR_FFT / 2 + 1) * sizeof(float), MALLOC_CAP_8BIT);
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    if (samples == NULL || work == NULL || power == NULL)
+        goto done;
+
+    uint64_t head = capture_head(0);
+    ret = ESP_ERR_NOT_FINISHED;
+    if (head < SPUR_FFT || capture_read(0, head - SPUR_FFT, samples, SPUR_FFT) != SPUR_FFT)
+        goto done;
+
+    ret = fft_power(samples, SPUR_FFT, work, power);
+    if (ret != ESP_OK)
+        goto done;
+
+    // offset mismatch shows at fs/2, gain and timing mismatch at fs/2 - fin
+    const size_t bins = SPUR_FFT / 2 + 1;
+    const size_t nyq = bins - 1;
+    size_t k = FFT_HANN_SPREAD + 1;
+    for (size_t i = k; i < nyq - FFT_HANN_SPREAD; i++)
+        if (power[i] > power[k])
+            k = i;
+    size_t image = nyq - k;
+
+    size_t worst = 0;
+    for (size_t i = FFT_HANN_SPREAD + 1; i < bins; i++)
+        if ((i + FFT_HANN_SPREAD < k || i > k + FFT_HANN_SPREAD) && (worst == 0 || power[i] > power[worst]))
+            worst = i;
+
+    double hz_per_bin = (double)capture_get_rate(0) / SPUR_FFT;
+    double fund = fft_tone(power, bins, k);
+    snprintf(out, len, "fin %.0f Hz %.1f dBFS, fs/2 %.1f dBc, fs/2-fin %.1f dBc, SFDR %.1f dBc at %.0f Hz",
+             k * hz_per_bin, 10 * log10(fund),
+             10 * log10(fft_tone(power, bins, nyq) / fund),
+             image + FFT_HANN_SPREAD < k || image > k + FFT_HANN_SPREAD ? 10 * log10(fft_tone(power, bins, image) / fund) : NAN,
+             -10 * log10(fft_tone(power, bins, worst) / fund), worst * hz_per_bin);
+    ret = ESP_OK;
+
+done:
+    heap_caps_free(samples);
+    heap_caps_free(work);
+    heap_caps_free(power);
+    return ret;
+}
+
+esp_err_t adc_command(const char *cmd, char *reply, size_t len)
+{
+    reply[0] = 0;
+
+    if (strncmp(cmd, "rate ", 5) == 0)
+    {
+        unsigned hz, latency_ms = s_latency_us / 1000;
+        if (sscanf(cmd, "rate %u %u", &hz, &latency_ms) < 1)
+            return ESP_ERR_INVALID_ARG;
+        return adc_set_rate(hz, latency_ms * 1000);
+    }
+    if (strcmp(cmd, "mode channels") == 0)
+        return adc_set_mode(ADC_MODE_CHANNELS);
+    if (strcmp(cmd, "mode interleaved") == 0)
+        return adc_set_mode(ADC_MODE_INTERLEAVED);
+    if (strncmp(cmd, "median ", 7) == 0 || strncmp(cmd, "hampel ", 7) == 0)
+    {
+        int ch;
+        char window[8];
+        float k = MEDIAN_HAMPEL_K;
+        if (sscanf(cmd + 7, "%d %7s %f", &ch, window, &k) < 2)
+            return ESP_ERR_INVALID_ARG;
+        if (strcmp(window, "off") == 0)
+            return adc_set_median(ch, MEDIAN_OFF, 1, 0);
+        return adc_set_median(ch, cmd[0] == 'h' ? MEDIAN_HAMPEL : MEDIAN_PLAIN, atoi(window), k);
+    }
+    if (strncmp(cmd, "filter ", 7) == 0)
+    {
+        int ch, used = 0;
+        filter_spec_t spec;
+        if (sscanf(cmd, "filter %d %n", &ch, &used) < 1 || used == 0)
+            return ESP_ERR_INVALID_ARG;
+        if (strcmp(cmd + used, "off") == 0)
+            return adc_filter_clear(ch);
+        if (filter_parse(cmd + used, &spec) != 0)
+            return ESP_ERR_INVALID_ARG;
+        return adc_filter_add(ch, &spec);
+    }
+    if (strncmp(cmd, "decim ", 6) == 0)
+    {
+        int ch;
+        char type[8];
+        unsigned ratio = 1, bits = 16;
+        if (sscanf(cmd, "decim %d %7s %u %u", &ch, type, &ratio, &bits) < 2)
+            return ESP_ERR_INVALID_ARG;
+        if (strcmp(type, "off") == 0)
+            return adc_set_decim(ch, DECIM_OFF, 1, 16);
+        if (strcmp(type, "box") == 0)
+            return adc_set_decim(ch, DECIM_BOXCAR, ratio, bits);
+        if (strcmp(type, "cic") == 0)
+            return adc_set_decim(ch, DECIM_CIC, ratio, bits);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (strncmp(cmd, "math ", 5) == 0)
+        return derived_command(cmd);
+    if (strcmp(cmd, "cal") == 0)
+        return adc_interleave_calibrate();
+    if (strcmp(cmd, "spurs") == 0)
+        return adc_interleave_spurs(reply, len);
+    if (strncmp(cmd, "segments", 8) == 0)
+        return segment_command(cmd, reply, len);
+    if (strcmp(cmd, "mask") == 0 || strncmp(cmd, "mask ", 5) == 0)
+        return mask_command(cmd, reply, len);
+    if (strcmp(cmd, "event") == 0 || strncmp(cmd, "record", 6) == 0)
+        return record_command(cmd, reply, len);
+    if (strncmp(cmd, "caplog", 6) == 0)
+        return caplog_command(cmd, reply, len);
+    if (strncmp(cmd, "trend", 5) == 0)
+        return trend_command(cmd, reply, len);
+    if (strncmp(cmd, "trace", 5) == 0)
+        return trace_command(cmd, reply, len);
+    return ESP_ERR_NOT_FOUND;
+}
+
 static void continuous_adc_init()
 {
+    s_conversions = frame_conversions(s_rate, s_latency_us);
+    cal.frames = 0;
 
     adc_continuous_handle_cfg_t adc_config = {
-        .max_store_buf_size = BUFFER * 2,
-        .conv_frame_size = BUFFER,
-        .flags = 0};
+        .max_store_buf_size = s_conversions * SOC_ADC_DIGI_RESULT_BYTES * ADC_POOL_FRAMES,
+        .conv_frame_size = s_conversions * SOC_ADC_DIGI_RESULT_BYTES,
+        // samples are taken in s_conv_done_cb, nobody reads the driver pool, let it overwrite itself
+        .flags = {.flush_pool = 1}};
     ESP_ERROR_CHECK(adc_continuous_new_handle(&adc_config, &adchandle));
 
     adc_continuous_config_t dig_cfg = {
-        .sample_freq_hz = 20000 * 3 , //SOC_ADC_SAMPLE_FREQ_THRES_LOW * 2,
+        .sample_freq_hz = s_rate, //SOC_ADC_SAMPLE_FREQ_THRES_LOW * 2,
         .conv_mode = ADC_CONV_SINGLE_UNIT_1,
 #if CONFIG_IDF_TARGET_ESP32C3 || CONFIG_IDF_TARGET_ESP32C2 || CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_ESP32C6 || CONFIG_IDF_TARGET_ESP32H2 || CONFIG_IDF_TARGET_ESP32C5 || CONFIG_IDF_TARGET_ESP32C61
         .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
@@ -61,123 +661,252 @@ static void continuous_adc_init()
     adc_pattern[1].unit = ADC_UNIT_1;
     adc_pattern[1].bit_width = ADC_BITWIDTH_12;
 
+#if INTERLEAVE
+    if (s_mode == ADC_MODE_INTERLEAVED)
+    {
+        dig_cfg.conv_mode = ADC_CONV_ALTER_UNIT;
+        dig_cfg.pattern_num = 2;
+        adc_pattern[0].channel = INTERLEAVE_ADC1_CHANNEL;
+        adc_pattern[0].unit = ADC_UNIT_1;
+        adc_pattern[1].channel = INTERLEAVE_ADC2_CHANNEL;
+        adc_pattern[1].unit = ADC_UNIT_2;
+    }
+#endif
+
     dig_cfg.adc_pattern = adc_pattern;
     ESP_ERROR_CHECK(adc_continuous_config(adchandle, &dig_cfg));
+
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = s_conv_done_cb,
+    };
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(adchandle, &cbs, NULL));
+
+    ESP_ERROR_CHECK(adc_continuous_start(adchandle));
+    adc_ll_digi_set_convert_limit_num(2);
+
+    timebase_init(&timebase, s_rate);
+    capture_rates(s_rate);
+
+    ESP_LOGI(TAG, "Start: %s, %" PRIu32 " Hz, %" PRIu32 " conversions per frame (%.2f ms), frame pool covers %.0f ms",
+             s_mode == ADC_MODE_INTERLEAVED ? "interleaved" : "channels", s_rate, s_conversions, s_conversions * 1e3 / s_rate, FRAME_POOL_SIZE * s_conversions * 1e3 / s_rate);
 };
 
-void adc_dma_task(void *arg)
+// stop the DMA, give back every frame it produced and start again with the requested settings
+static void continuous_adc_retune()
 {
+    taskENTER_CRITICAL(&s_lock);
+    s_rate = s_new_rate;
+    s_latency_us = s_new_latency_us;
+    s_mode = s_new_mode;
+    s_retune = false;
+    taskEXIT_CRITICAL(&s_lock);
+
+    ESP_ERROR_CHECK(adc_continuous_stop(adchandle));
+    ESP_ERROR_CHECK(adc_continuous_deinit(adchandle));
+
+    frame_t *frame;
+    while (xQueueReceive(dma_queue, &frame, 0) == pdTRUE)
+        mem_pool_put(&frame_pool, frame);
+
+    // the streams restart, so do the filters
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        median_init(&s_median[c], s_median[c].type, median_window(&s_median[c]), median_k(&s_median[c]));
+        decim_init(&s_decim[c], s_decim[c].type, decim_ratio(&s_decim[c]), s_decim[c].bits);
+    }
 
-    esp_err_t ret;
-    uint32_t ret_num = 0;
-    uint8_t result[BUFFER] = {0};
-    int median_filter_current[3];
-    uint8_t median_filter_current_fill = 0;
-    int median_filter_setup[3];
-    uint8_t median_filter_setup_fill = 0;
-    int digital_filter;
+    continuous_adc_init();
+    filters_design();
+}
 
-    s_task_handle = xTaskGetCurrentTaskHandle();
+void adc_dma_task(void *arg)
+{
+    uint32_t next_seq = 0;
+    uint32_t dropped = 0;
+    uint32_t errors = 0;
 
-    continuous_adc_init();
+    dma_queue = xQueueCreateStatic(FRAME_POOL_SIZE, sizeof(frame_t *), dma_queue_storage, &dma_queue_buffer);
 
-    adc_continuous_evt_cbs_t cbs = {
-        .on_conv_done = s_conv_done_cb,
-    };
-    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(adchandle, &cbs, NULL));
+    // before the capture takes what is left of the PSRAM
+    segment_init();
+    capture_init();
+    interleave_load();
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        median_init(&s_median[c], MEDIAN_PLAIN, MEDIAN_WINDOW, 0);
+        s_new_median[c] = s_median[c];
+        filter_clear(&s_filter[c]);
+        filter_clear(&s_new_filter[c]);
+        decim_init(&s_decim[c], DECIM_OFF, 1, 16);
+        s_new_decim[c] = s_decim[c];
+    }
 
-    ESP_ERROR_CHECK(adc_continuous_start(adchandle));
-    ESP_LOGI(TAG, "Start");
+    continuous_adc_init();
 
-    int err_count = 0;
     int64_t time1 = esp_timer_get_time();
     int64_t time2 = esp_timer_get_time();
     int64_t time100 = esp_timer_get_time();
+    int64_t time_clock = esp_timer_get_time();
 
     int counter = 0;
 
-    adc_ll_digi_set_convert_limit_num(2);
+    // per-frame cost, CPU cycles
+    uint64_t isr_cycles = 0, task_cycles = 0;
+    uint32_t cost_frames = 0;
+
+    mem_sample_path_begin();
 
     while (1)
     {
-        //ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-
-        ret = adc_continuous_read(adchandle, result, BUFFER, &ret_num, ADC_MAX_DELAY);
-
-        // ESP_LOGW(TAG, "time: %8lld; ret: %d, %d", time2 - time1, ret_num, ret);
-
-        adc_digi_output_data_t *p = (void *)result;
-        int sum_current = 0;
-        int count_current = 0;
-        int sum_setup = 0;
-        int count_setup = 0;
-
-        if (ret != ESP_OK)
+        if (s_retune)
         {
-            ESP_LOGW(TAG, "time: %8lld; ret: %d, %x", time2 - time1, ret_num, ret);
-            vTaskDelay(1);
-            continue;
+            // the driver allocates, this is not the steady state sample path
+            mem_sample_path_end();
+            continuous_adc_retune();
+            next_seq = s_seq;
+            isr_cycles = task_cycles = cost_frames = 0;
+            mem_sample_path_begin();
         }
+        if (s_restage)
+            stages_apply();
 
-        while ((uint8_t *)p < result + ret_num)
+        frame_t *frame;
+        if (xQueueReceive(dma_queue, &frame, pdMS_TO_TICKS(100)) != pdTRUE)
+            continue;
+        uint32_t cycles = esp_cpu_get_cycle_count();
+        trace(TRACE_RECEIVE, TRACE_INSTANT, frame->seq);
+
+        // frames lost in the ISR still took their time, keep the clock loop on track
+        uint32_t gap = frame->seq - next_seq + 1;
+        next_seq = frame->seq + 1;
+        double t_end = timebase_update(&timebase, frame->stamp, frame->conversions * (gap < 16 ? gap : 1));
+        double period = timebase.period;
+        errors += frame->errors;
+
+        trace(TRACE_FILTER, TRACE_BEGIN, frame->seq);
+        if (s_mode == ADC_MODE_INTERLEAVED)
         {
-            switch (p->ACDTYPE.channel)
+            if (cal.request)
             {
-            case ADC_CHANNEL_0:
-                median_filter_current[median_filter_current_fill % 3] = p->ACDTYPE.data;
-                median_filter_current_fill++;
+                memset(&cal, 0, sizeof(cal));
+                cal.frames = MAX(1, (uint64_t)s_rate * CAL_MS / 1000 / s_conversions);
+            }
+            if (cal.frames > 0)
+                interleave_calibrate(frame);
+            interleave_merge(frame);
+        }
 
-                if (median_filter_current_fill >= 3)
-                {
-                    digital_filter = MEDIAN(median_filter_current);
-                    if (median_filter_current_fill >= 6)
-                        median_filter_current_fill = 3;
-                }
-                else
-                {
-                    digital_filter = p->ACDTYPE.data;
-                }
+        // the median and the FIR lag by half their window, which the trigger index and t0 make up for
+        for (int c = 0; c < frame->channels; c++)
+        {
+            median_run(&s_median[c], frame_samples(frame, c), frame->count[c]);
+            filter_run(&s_filter[c], frame_samples(frame, c), frame->count[c]);
+            if (frame->trigger >= 0 && frame->trigger_channel == c)
+                frame->trigger = MIN(frame->trigger + stages_delay(c), frame->count[c] - 1);
+        }
+        trace(TRACE_FILTER, TRACE_END, frame->seq);
 
-                sum_current += digital_filter;
-                count_current++;
-                break;
+        time2 = esp_timer_get_time();
 
-            case ADC_CHANNEL_1:
-                median_filter_setup[median_filter_setup_fill % 3] = p->ACDTYPE.data;
-                median_filter_setup_fill++;
+        const int inputs = frame->channels;
+        const double sample_period = period * conversions_per_sample();
+        double t_first[FRAME_INPUTS];
+        for (int c = 0; c < inputs; c++)
+        {
+            t_first[c] = t_end - (frame->conversions - 1 - MAX(frame->first[c], 0)) * period;
+            t_first[c] -= stages_delay(c) * sample_period;
+        }
 
-                if (median_filter_setup_fill >= 3)
-                {
-                    digital_filter = MEDIAN(median_filter_setup);
-                    if (median_filter_setup_fill >= 6)
-                        median_filter_setup_fill = 3;
-                }
-                else
-                {
-                    digital_filter = p->ACDTYPE.data;
-                }
+        // from the full rate inputs, before they are decimated
+        trace(TRACE_ANALYSIS, TRACE_BEGIN, frame->seq);
+        derived_frame(frame, t_first, sample_period);
+        segment_scan(frame, t_first, sample_period);
+        mask_scan(frame, t_first, sample_period);
+        record_scan(frame, t_first, sample_period);
+        trace(TRACE_ANALYSIS, TRACE_END, frame->seq);
 
-                sum_setup += digital_filter;
-                count_setup++;
-                break;
+        trace(TRACE_CAPTURE, TRACE_BEGIN, frame->seq);
 
-            default:
-                err_count++;
-                break;
+        for (int c = 0; c < inputs; c++)
+        {
+            if (s_decim[c].type != DECIM_OFF)
+            {
+                decimate(frame, c, t_first[c], sample_period);
+                continue;
             }
-            p++;
+            frame->t0[c] = llround(t_first[c]);
+            frame->period_ns[c] = lround(sample_period * 1000);
+            frame->bits[c] = 12;
+            frame->scale[c] = 1;
+            frame->offset[c] = 0;
+            capture_set_format(c, 1, 0);
+            capture_write(c, frame_samples(frame, c), frame->count[c], frame->t0[c]);
+        }
+        for (int c = inputs; c < frame->channels; c++)
+        {
+            capture_set_format(c, frame->scale[c], frame->offset[c]);
+            capture_write(c, frame_samples(frame, c), frame->count[c], frame->t0[c]);
+        }
+        segment_collect();
+        int64_t failed = mask_check();
+        if (failed)
+            record_event(failed, RECORD_MASK);
+        trace(TRACE_CAPTURE, TRACE_END, frame->seq);
+
+        isr_cycles += frame->isr_cycles;
+        task_cycles += esp_cpu_get_cycle_count() - cycles;
+        cost_frames++;
+
+        trace(TRACE_QUEUE, TRACE_INSTANT, frame->seq);
+        if (xQueueSend(adc_queue, &frame, 0) == pdTRUE)
+            net_notify(NET_FRAME);
+        else
+        {
+            mem_pool_put(&frame_pool, frame);
+            dropped++;
         }
 
-        time2 = esp_timer_get_time();
-        ESP_LOGW(TAG, "time: %8lld; cnt: %d; ret: %d, %x; err: %d", time2 - time1, count_current, ret_num, ret, err_count);
+        ESP_LOGD(TAG, "time: %8" PRId64 "; cnt: %d; conv: %d; err: %" PRIu32, time2 - time1, frame->count[0], frame->conversions, errors);
         time1 = time2;
 
         counter++;
 
         if (esp_timer_get_time() - time100 >= 100000)
         {
-            ESP_LOGE(TAG, "time: %8lld; cnt: %d; ret: %d, %x; err: %d", time2 - time100, counter, ret_num, ret, err_count);
+            ESP_LOGE(TAG, "time: %8" PRId64 "; cnt: %d; err: %" PRIu32 "; dropped: %" PRIu32 "; overruns: %" PRIu32, time2 - time100, counter, errors, dropped, s_overruns);
             time100 = time2;
         }
+
+        if (time2 - time_clock >= 1000000)
+        {
+            double rate = timebase_rate(&timebase);
+            capture_rates(rate);
+            ESP_LOGI(TAG, "clock: %.1f Hz, %+.0f ppm, jitter %.1f us, resets %" PRIu32,
+                     rate, timebase_ppm(&timebase), timebase.err_rms, timebase.resets);
+            for (int c = 0; c < FRAME_INPUTS; c++)
+                if (s_median[c].outliers > 0)
+                {
+                    ESP_LOGI(TAG, "channel %d: %" PRIu32 " outliers replaced", c, s_median[c].outliers);
+                    s_median[c].outliers = 0;
+                }
+
+            if (cost_frames > 0)
+            {
+                // the task share also covers everything per sample, the ISR share is mostly per frame
+#if CONFIG_IDF_TARGET_LINUX
+                double mhz = ADC_SIM_CYCLES_PER_US;
+#else
+                double mhz = esp_rom_get_cpu_ticks_per_us();
+#endif
+                double isr_us = isr_cycles / mhz / cost_frames;
+                double task_us = task_cycles / mhz / cost_frames;
+                double frame_us = s_conversions * 1e6 / s_rate;
+                ESP_LOGI(TAG, "frame: %" PRIu32 " conversions, %.0f us; isr %.1f us, task %.1f us per frame; %.2f us per sample; load %.1f%%",
+                         s_conversions, frame_us, isr_us, task_us, (isr_us + task_us) / s_conversions,
+                         100 * (isr_us + task_us) / frame_us);
+                isr_cycles = task_cycles = cost_frames = 0;
+            }
+            time_clock = time2;
+        }
     }
 }
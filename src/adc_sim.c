@@ -0,0 +1,189 @@
+#include "adc_sim.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "adc_sim";
+
+#define SIM_HZ0 1000.0 // channel 0
+#define SIM_HZ 50.0    // the other channels
+#define SIM_AMPLITUDE 1800
+#define SIM_NOISE 16 // counts peak
+
+struct adc_sim_s
+{
+    adc_continuous_handle_cfg_t cfg;
+    adc_continuous_config_t dig;
+    adc_digi_pattern_config_t pattern[SOC_ADC_PATT_LEN_MAX];
+    adc_continuous_evt_cbs_t cbs;
+    void *user_data;
+    uint8_t *buf; // one frame
+    FILE *replay;
+    uint64_t conversions; // since start, the generator's clock
+    unsigned seed;
+    TaskHandle_t task;
+    volatile bool running;
+};
+
+static void sim_generate(adc_continuous_handle_t h, adc_digi_output_data_t *p, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++, p++, h->conversions++)
+    {
+        const adc_digi_pattern_config_t *pt = &h->pattern[h->conversions % h->dig.pattern_num];
+        double t = (double)h->conversions / h->dig.sample_freq_hz;
+        double hz = pt->channel == 0 ? SIM_HZ0 : SIM_HZ;
+        int v = 2048 + SIM_AMPLITUDE * sin(2 * M_PI * hz * t) + rand_r(&h->seed) % (2 * SIM_NOISE + 1) - SIM_NOISE;
+        p->val = 0;
+        p->type1.channel = pt->channel;
+        p->type1.data = v < 0 ? 0 : v > 0xfff ? 0xfff : v;
+    }
+}
+
+static void sim_replay(adc_continuous_handle_t h, uint8_t *buf, uint32_t bytes)
+{
+    size_t got = 0;
+    while (got < bytes)
+    {
+        size_t n = fread(buf + got, 1, bytes - got, h->replay);
+        if (n == 0 && got == 0 && ftell(h->replay) == 0)
+        {
+            // an empty file, the generator takes over
+            fclose(h->replay);
+            h->replay = NULL;
+            sim_generate(h, (adc_digi_output_data_t *)buf, bytes / SOC_ADC_DIGI_RESULT_BYTES);
+            return;
+        }
+        if (n == 0)
+            rewind(h->replay);
+        got += n;
+    }
+}
+
+// stands in for the DMA interrupt
+static void sim_task(void *arg)
+{
+    adc_continuous_handle_t h = arg;
+    uint32_t per_frame = h->cfg.conv_frame_size / SOC_ADC_DIGI_RESULT_BYTES;
+    int64_t start = esp_timer_get_time();
+    uint64_t frames = 0;
+    uint32_t skipped = 0;
+
+    while (h->running)
+    {
+        uint64_t due = (uint64_t)(esp_timer_get_time() - start) * h->dig.sample_freq_hz / 1000000 / per_frame;
+        if (due > frames + ADC_SIM_BURST)
+        {
+            // the process was stopped or starved, those conversions are gone as on the chip
+            skipped += due - ADC_SIM_BURST - frames;
+            h->conversions += (due - ADC_SIM_BURST - frames) * per_frame;
+            frames = due - ADC_SIM_BURST;
+        }
+        for (; frames < due && h->running; frames++)
+        {
+            if (h->replay != NULL)
+                sim_replay(h, h->buf, h->cfg.conv_frame_size);
+            else
+                sim_generate(h, (adc_digi_output_data_t *)h->buf, per_frame);
+
+            adc_continuous_evt_data_t edata = {.conv_frame_buffer = h->buf, .size = h->cfg.conv_frame_size};
+            if (h->cbs.on_conv_done != NULL && h->cbs.on_conv_done(h, &edata, h->user_data))
+                taskYIELD();
+        }
+        vTaskDelay(1);
+    }
+
+    if (skipped > 0)
+        ESP_LOGW(TAG, "%lu frames skipped", (unsigned long)skipped);
+    h->task = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t adc_continuous_new_handle(const adc_continuous_handle_cfg_t *cfg, adc_continuous_handle_t *ret)
+{
+    if (cfg->conv_frame_size == 0 || cfg->conv_frame_size % SOC_ADC_DIGI_RESULT_BYTES != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    adc_continuous_handle_t h = calloc(1, sizeof(struct adc_sim_s));
+    if (h == NULL)
+        return ESP_ERR_NO_MEM;
+    h->buf = malloc(cfg->conv_frame_size);
+    if (h->buf == NULL)
+    {
+        free(h);
+        return ESP_ERR_NO_MEM;
+    }
+    h->cfg = *cfg;
+    h->seed = 1;
+
+    const char *name = getenv(ADC_SIM_REPLAY_ENV);
+    if (name != NULL && (h->replay = fopen(name, "rb")) == NULL)
+        ESP_LOGW(TAG, "Can't open %s, generating", name);
+    else if (name != NULL)
+        ESP_LOGI(TAG, "Replaying %s", name);
+
+    *ret = h;
+    return ESP_OK;
+}
+
+esp_err_t adc_continuous_config(adc_continuous_handle_t handle, const adc_continuous_config_t *config)
+{
+    if (config->pattern_num == 0 || config->pattern_num > SOC_ADC_PATT_LEN_MAX || config->sample_freq_hz == 0 ||
+        config->format != ADC_DIGI_OUTPUT_FORMAT_TYPE1 || config->conv_mode == ADC_CONV_ALTER_UNIT)
+        return ESP_ERR_INVALID_ARG;
+
+    handle->dig = *config;
+    memcpy(handle->pattern, config->adc_pattern, config->pattern_num * sizeof(adc_digi_pattern_config_t));
+    handle->dig.adc_pattern = handle->pattern;
+    return ESP_OK;
+}
+
+esp_err_t adc_continuous_register_event_callbacks(adc_continuous_handle_t handle, const adc_continuous_evt_cbs_t *cbs, void *user_data)
+{
+    if (handle->running)
+        return ESP_ERR_INVALID_STATE;
+    handle->cbs = *cbs;
+    handle->user_data = user_data;
+    return ESP_OK;
+}
+
+esp_err_t adc_continuous_start(adc_continuous_handle_t handle)
+{
+    if (handle->running || handle->dig.pattern_num == 0)
+        return ESP_ERR_INVALID_STATE;
+    handle->running = true;
+    if (xTaskCreate(sim_task, "adc_sim", ADC_SIM_STACK, handle, configMAX_PRIORITIES - 1, &handle->task) != pdPASS)
+    {
+        handle->running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t adc_continuous_stop(adc_continuous_handle_t handle)
+{
+    if (!handle->running)
+        return ESP_ERR_INVALID_STATE;
+    handle->running = false;
+    while (handle->task != NULL)
+        vTaskDelay(1);
+    return ESP_OK;
+}
+
+esp_err_t adc_continuous_deinit(adc_continuous_handle_t handle)
+{
+    if (handle->running)
+        return ESP_ERR_INVALID_STATE;
+    if (handle->replay != NULL)
+        fclose(handle->replay);
+    free(handle->buf);
+    free(handle);
+    return ESP_OK;
+}
@@ -0,0 +1,330 @@
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_console.h"
+#include "esp_chip_info.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "hal/adc_types.h"
+
+#include "main.h"
+#include "adc.h"
+#include "mem.h"
+#include "trigger.h"
+#include "median.h"
+#include "filter.h"
+#include "fft.h"
+#include "caplog.h"
+
+static const char *TAG = "bench";
+
+#define BENCH_RATE 30000.0f // per channel, filter design
+#define BENCH_SEED 12345
+
+typedef struct
+{
+    frame_t frame;
+    adc_digi_output_data_t conv[FRAME_INPUTS * FRAME_SAMPLES];
+    uint8_t out[WS_BUF_SIZE];
+    float work[2 * FRAME_SAMPLES];
+    float power[FRAME_SAMPLES / 2 + 1];
+    median_filter_t median[FRAME_INPUTS];
+    filter_chain_t filter[FRAME_INPUTS];
+    filter_chain_t fir[FRAME_INPUTS];
+    trigger_t trigger;
+    bool armed[FRAME_INPUTS];
+    uint32_t rng;
+    uint32_t n; // frames so far
+    volatile uint32_t sink; // keeps results the compiler could drop alive
+} bench_t;
+
+// one stage over the current frame, returns the samples it went through
+typedef uint32_t (*bench_run_t)(bench_t *b);
+
+typedef struct
+{
+    const char *name;
+    bench_run_t run;
+    const char *what;
+} bench_stage_t;
+
+static esp_console_repl_t *s_repl = NULL;
+
+static uint32_t bench_random(bench_t *b)
+{
+    b->rng = b->rng * 1664525 + 1013904223;
+    return b->rng >> 16;
+}
+
+// sines on both inputs, noise and a spike now and then, in the chip's DMA format
+static void bench_synth(bench_t *b)
+{
+    memset(b->conv, 0, sizeof(b->conv));
+    for (int i = 0; i < FRAME_SAMPLES; i++)
+    {
+        uint32_t t = b->n * FRAME_SAMPLES + i;
+        for (int c = 0; c < FRAME_INPUTS; c++)
+        {
+            int v = 2048 + 1500 * sinf(2 * M_PI * t / (37.3f * (c + 1))) + (int)(bench_random(b) & 63) - 32;
+            if (bench_random(b) % 97 == 0)
+                v = bench_random(b) & 0xfff;
+            adc_digi_output_data_t *p = &b->conv[i * FRAME_INPUTS + c];
+            p->ACDTYPE.channel = c;
+            p->ACDTYPE.data = v < 0 ? 0 : v > 0xfff ? 0xfff : v;
+        }
+    }
+}
+
+static uint32_t run_parse(bench_t *b)
+{
+    uint32_t sum = 0;
+    for (int j = 0; j < FRAME_INPUTS * FRAME_SAMPLES; j++)
+        if (b->conv[j].ACDTYPE.channel < FRAME_INPUTS)
+            sum += b->conv[j].ACDTYPE.data;
+    b->sink = sum;
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+static uint32_t run_demux(bench_t *b)
+{
+    adc_demux(&b->frame, (const uint8_t *)b->conv, sizeof(b->conv));
+    return b->frame.conversions;
+}
+
+static uint32_t run_trigger(bench_t *b)
+{
+    b->frame.trigger = -1;
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        const uint16_t *v = b->frame.data[c];
+        for (int i = 0; i < b->frame.count[c]; i++)
+            if (trigger_step(&b->trigger, &b->armed[c], v[i]) && b->frame.trigger < 0 && c == b->trigger.channel)
+                b->frame.trigger = i;
+    }
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+static uint32_t run_median(bench_t *b)
+{
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        median_run(&b->median[c], frame_samples(&b->frame, c), b->frame.count[c]);
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+static uint32_t run_filter(bench_t *b)
+{
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        filter_run(&b->filter[c], frame_samples(&b->frame, c), b->frame.count[c]);
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+// on a copy, the other stages keep the biquad output
+static uint32_t run_fir(bench_t *b)
+{
+    uint16_t *v = (uint16_t *)b->out;
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        filter_run(&b->fir[c], v + c * FRAME_SAMPLES, b->frame.count[c]);
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+static uint32_t run_codec(bench_t *b)
+{
+    size_t pos = 0;
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        const uint16_t *v = frame_samples(&b->frame, c);
+        for (int i = 1; i < b->frame.count[c]; i++)
+            pos += caplog_put_delta(b->out + pos, (int32_t)v[i] - v[i - 1]);
+    }
+    b->sink = pos;
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+static uint32_t run_fft(bench_t *b)
+{
+    fft_power(frame_samples(&b->frame, 0), FRAME_SAMPLES, b->work, b->power);
+    return FRAME_SAMPLES;
+}
+
+static uint32_t run_ws(bench_t *b)
+{
+    b->sink = ws_encode_frame(&b->frame, b->out);
+    return FRAME_INPUTS * FRAME_SAMPLES;
+}
+
+// pipeline order, every stage runs on every frame, the selected ones are reported
+static const bench_stage_t stages[] = {
+    {"parse", run_parse, "DMA conversion fields"},
+    {"demux", run_demux, "adc_demux, as in the DMA ISR"},
+    {"trigger", run_trigger, "rising edge detector, all inputs"},
+    {"median", run_median, "median of 3"},
+    {"filter", run_filter, "biquad lp 2 kHz"},
+    {"fir", run_fir, "FIR lp 2 kHz, 31 taps"},
+    {"codec", run_codec, "caplog zigzag varint deltas"},
+    {"fft", run_fft, "fft_power of 256 samples"},
+    {"ws", run_ws, "wire frame for the WS client"},
+};
+
+#define STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static bench_t *bench_new(void)
+{
+    bench_t *b = heap_caps_calloc(1, sizeof(bench_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (b == NULL)
+        return NULL;
+
+    filter_spec_t lp, fir;
+    filter_parse("lp 2000", &lp);
+    filter_parse("fir lp 2000 31", &fir);
+    for (int c = 0; c < FRAME_INPUTS; c++)
+    {
+        median_init(&b->median[c], MEDIAN_PLAIN, 3, 0);
+        filter_clear(&b->filter[c]);
+        filter_add(&b->filter[c], &lp);
+        filter_design(&b->filter[c], BENCH_RATE);
+        filter_clear(&b->fir[c]);
+        filter_add(&b->fir[c], &fir);
+        filter_design(&b->fir[c], BENCH_RATE);
+
+        b->frame.bits[c] = 12;
+        b->frame.period_ns[c] = 1e9f / BENCH_RATE;
+        b->frame.scale[c] = 1;
+    }
+    b->trigger = (trigger_t){.channel = 0, .slope = TRIGGER_RISING, .level = 2048, .hysteresis = 32};
+    b->rng = BENCH_SEED;
+    return b;
+}
+
+static int bench_cmd(int argc, char **argv)
+{
+    bool selected[STAGES] = {0};
+    bool any = false;
+    long frames = BENCH_FRAMES;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            frames = atol(argv[++i]);
+            continue;
+        }
+        size_t s = 0;
+        while (s < STAGES && strcmp(argv[i], stages[s].name) != 0)
+            s++;
+        if (s == STAGES)
+        {
+            printf("unknown stage %s, one of:", argv[i]);
+            for (s = 0; s < STAGES; s++)
+                printf(" %s", stages[s].name);
+            printf("\n");
+            return 1;
+        }
+        selected[s] = any = true;
+    }
+    if (frames < 1 || frames > BENCH_MAX_FRAMES)
+    {
+        printf("frames 1 to %d\n", BENCH_MAX_FRAMES);
+        return 1;
+    }
+
+    bench_t *b = bench_new();
+    if (b == NULL)
+    {
+        printf("out of memory\n");
+        return 1;
+    }
+
+    uint64_t cycles[STAGES] = {0}, samples[STAGES] = {0};
+    float best[STAGES];
+    for (size_t s = 0; s < STAGES; s++)
+        best[s] = INFINITY;
+
+    for (b->n = 0; b->n < frames; b->n++)
+    {
+        bench_synth(b);
+        for (size_t s = 0; s < STAGES; s++)
+        {
+            // the FIR input, untimed
+            if (stages[s].run == run_fir)
+                for (int c = 0; c < FRAME_INPUTS; c++)
+                    memcpy(b->out + c * FRAME_SAMPLES * sizeof(uint16_t), frame_samples(&b->frame, c),
+                           FRAME_SAMPLES * sizeof(uint16_t));
+
+            uint32_t start = esp_cpu_get_cycle_count();
+            uint32_t n = stages[s].run(b);
+            uint32_t dt = esp_cpu_get_cycle_count() - start;
+
+            cycles[s] += dt;
+            samples[s] += n;
+            if (n > 0 && (float)dt / n < best[s])
+                best[s] = (float)dt / n;
+        }
+    }
+
+    esp_chip_info_t chip;
+    esp_chip_info(&chip);
+    uint32_t mhz = esp_rom_get_cpu_ticks_per_us();
+    printf("%s rev v%d.%d, %d cores, %lu MHz, %ld frames of %d x %d samples\n", CONFIG_IDF_TARGET,
+           chip.revision / 100, chip.revision % 100, chip.cores, mhz, frames, FRAME_INPUTS, FRAME_SAMPLES);
+    printf("%-8s %10s %10s %10s  %s\n", "stage", "best", "mean", "ns/sample", "cycles/sample");
+    for (size_t s = 0; s < STAGES; s++)
+    {
+        if (any && !selected[s])
+            continue;
+        float mean = samples[s] ? (float)cycles[s] / samples[s] : 0;
+        printf("%-8s %10.1f %10.1f %10.1f  %s\n", stages[s].name, best[s], mean, best[s] * 1000 / mhz, stages[s].what);
+    }
+
+    heap_caps_free(b);
+    return 0;
+}
+
+esp_err_t bench_console_start(void)
+{
+    esp_console_repl_config_t config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    config.prompt = "oscill>";
+    config.task_stack_size = BENCH_CONSOLE_STACK;
+
+    // the REPL installs the console driver and its own task, off the memory plan
+    esp_err_t err;
+#if CONFIG_ESP_CONSOLE_UART_DEFAULT || CONFIG_ESP_CONSOLE_UART_CUSTOM
+    esp_console_dev_uart_config_t dev = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    err = esp_console_new_repl_uart(&dev, &config, &s_repl);
+#elif CONFIG_ESP_CONSOLE_USB_CDC
+    esp_console_dev_usb_cdc_config_t dev = ESP_CONSOLE_DEV_CDC_CONFIG_DEFAULT();
+    err = esp_console_new_repl_usb_cdc(&dev, &config, &s_repl);
+#elif CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    esp_console_dev_usb_serial_jtag_config_t dev = ESP_CONSOLE_DEV_USB_SERIAL_JTAG_CONFIG_DEFAULT();
+    err = esp_console_new_repl_usb_serial_jtag(&dev, &config, &s_repl);
+#else
+    err = ESP_ERR_NOT_SUPPORTED;
+#endif
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "No console REPL: %s", esp_err_to_name(err));
+        s_repl = NULL;
+        return err;
+    }
+
+    const esp_console_cmd_t cmd = {
+        .command = "bench",
+        .help = "Cycles per sample of the sample path stages over a synthetic frame set, "
+                "stages parse demux trigger median filter fir codec fft ws, all by default",
+        .hint = "[stage ...] [-n frames]",
+        .func = bench_cmd,
+    };
+    esp_console_register_help_command();
+    esp_console_cmd_register(&cmd);
+    return esp_console_start_repl(s_repl);
+}
+
+bool bench_console_active(void)
+{
+    return s_repl != NULL;
+}
@@ -0,0 +1,448 @@
+#include "main.h"
+#include "caplog.h"
+#include "capture.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/semphr.h"
+
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+static const char *TAG = "caplog";
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define CAPLOG_MAX_SECTORS 512
+#define CAPLOG_BLOCKS (CAPLOG_SECTOR / CAPLOG_BLOCK) // the first one holds caplog_sector_t
+
+typedef struct
+{
+    bool on;
+    uint64_t cursor; // next capture index
+    uint32_t bin;    // capture samples per bin
+    float scale, offset;
+    int pos;
+    uint16_t last;
+    union
+    {
+        caplog_block_t hdr;
+        uint8_t raw[CAPLOG_BLOCK];
+    } block;
+} encoder_t;
+
+static const esp_partition_t *s_part = NULL;
+static uint32_t s_sectors;
+static uint32_t s_erases[CAPLOG_MAX_SECTORS];
+static uint32_t s_head, s_head_seq, s_used;
+static unsigned s_block; // next block in the head sector
+static uint64_t s_bytes, s_write_us;
+
+// flash access, the log task against readers
+static SemaphoreHandle_t s_mutex;
+static StaticSemaphore_t s_mutex_buffer;
+
+static uint32_t s_rate;
+static uint8_t s_channels;
+static volatile bool s_changed;
+static volatile bool s_erase;    // requested, caplog_task erases
+static volatile bool s_erasing;  // nothing to read meanwhile
+static encoder_t enc[CAPTURE_CHANNELS];
+
+static bool read_sector(uint32_t i, caplog_sector_t *h)
+{
+    return esp_partition_read(s_part, i * CAPLOG_SECTOR, h, sizeof(*h)) == ESP_OK && h->magic == CAPLOG_MAGIC;
+}
+
+esp_err_t caplog_init(void)
+{
+    s_mutex = xSemaphoreCreateMutexStatic(&s_mutex_buffer);
+    s_part = esp_partition_find_first(CAPLOG_TYPE, 0, CAPLOG_PARTITION);
+    if (s_part == NULL)
+    {
+        ESP_LOGW(TAG, "No %s partition", CAPLOG_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_sectors = s_part->size / CAPLOG_SECTOR;
+    if (s_sectors > CAPLOG_MAX_SECTORS)
+        s_sectors = CAPLOG_MAX_SECTORS;
+
+    // the newest sector is the head, the sectors after it around the ring are older
+    int64_t t = esp_timer_get_time();
+    bool found = false;
+    s_used = 0;
+    for (uint32_t i = 0; i < s_sectors; i++)
+    {
+        caplog_sector_t h;
+        s_erases[i] = 0;
+        if (esp_partition_read(s_part, i * CAPLOG_SECTOR, &h, sizeof(h)) != ESP_OK)
+            continue;
+        if (h.magic == CAPLOG_MAGIC || h.magic == CAPLOG_EMPTY)
+            s_erases[i] = h.erases;
+        if (h.magic != CAPLOG_MAGIC)
+            continue;
+        s_used++;
+        if (!found || (int32_t)(h.seq - s_head_seq) > 0)
+        {
+            s_head = i;
+            s_head_seq = h.seq;
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        // the first block goes to sector 0
+        s_head = s_sectors - 1;
+        s_head_seq = 0;
+        s_block = CAPLOG_BLOCKS;
+    }
+    else
+    {
+        for (s_block = 1; s_block < CAPLOG_BLOCKS; s_block++)
+        {
+            uint8_t magic;
+            esp_partition_read(s_part, s_head * CAPLOG_SECTOR + s_block * CAPLOG_BLOCK, &magic, 1);
+            if (magic == 0xff)
+                break;
+        }
+    }
+    ESP_LOGI(TAG, "%" PRIu32 " sectors, %" PRIu32 " used, head %" PRIu32 " block %d, recovered in %" PRId64 " us", s_sectors, s_used, s_head, s_block,
+             esp_timer_get_time() - t);
+
+    nvs_handle_t nvs;
+    if (nvs_open("caplog", NVS_READONLY, &nvs) == ESP_OK)
+    {
+        nvs_get_u32(nvs, "rate", &s_rate);
+        nvs_get_u8(nvs, "channels", &s_channels);
+        nvs_close(nvs);
+    }
+    s_changed = true;
+    return ESP_OK;
+}
+
+// erase the sector after the head, the oldest one once the log is full
+static esp_err_t next_sector(void)
+{
+    uint32_t n = (s_head + 1) % s_sectors;
+    caplog_sector_t h;
+    bool valid = read_sector(n, &h);
+    uint32_t erases = (valid ? h.erases : s_erases[n]) + 1;
+
+    esp_err_t err = esp_partition_erase_range(s_part, n * CAPLOG_SECTOR, CAPLOG_SECTOR);
+    if (err != ESP_OK)
+        return err;
+    h = (caplog_sector_t){.magic = CAPLOG_MAGIC, .seq = s_head_seq + 1, .erases = erases};
+    err = esp_partition_write(s_part, n * CAPLOG_SECTOR, &h, sizeof(h));
+    if (err != ESP_OK)
+        return err;
+
+    s_erases[n] = erases;
+    if (!valid)
+        s_used++;
+    s_head = n;
+    s_head_seq++;
+    s_block = 1;
+    return ESP_OK;
+}
+
+// every sector, one at a time so readers get their turn
+static void erase_all(void)
+{
+    int64_t t = esp_timer_get_time();
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    s_erasing = true;
+    s_used = 0;
+    s_head = s_sectors - 1;
+    s_head_seq = 0;
+    s_block = CAPLOG_BLOCKS;
+    xSemaphoreGive(s_mutex);
+
+    esp_err_t err = ESP_OK;
+    for (uint32_t i = 0; i < s_sectors && err == ESP_OK; i++)
+    {
+        caplog_sector_t h = {.magic = CAPLOG_EMPTY, .erases = s_erases[i] + 1};
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        err = esp_partition_erase_range(s_part, i * CAPLOG_SECTOR, CAPLOG_SECTOR);
+        if (err == ESP_OK)
+        {
+            s_erases[i] = h.erases;
+            err = esp_partition_write(s_part, i * CAPLOG_SECTOR, &h, sizeof(h));
+        }
+        xSemaphoreGive(s_mutex);
+    }
+    s_erasing = false;
+
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Erase failed: %s", esp_err_to_name(err));
+    else
+        ESP_LOGI(TAG, "Erased in %" PRId64 " ms", (esp_timer_get_time() - t) / 1000);
+}
+
+static void flush(encoder_t *e)
+{
+    if (e->block.hdr.count == 0)
+        return;
+    e->block.hdr.bytes = e->pos;
+    memset(e->block.raw + sizeof(caplog_block_t) + e->pos, 0xff, CAPLOG_DATA - e->pos);
+
+    int64_t t = esp_timer_get_time();
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (s_block >= CAPLOG_BLOCKS)
+        err = next_sector();
+    if (err == ESP_OK)
+        err = esp_partition_write(s_part, s_head * CAPLOG_SECTOR + s_block * CAPLOG_BLOCK, e->block.raw, CAPLOG_BLOCK);
+    if (err == ESP_OK)
+    {
+        s_block++;
+        s_bytes += CAPLOG_BLOCK;
+    }
+    s_write_us += esp_timer_get_time() - t;
+    xSemaphoreGive(s_mutex);
+
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Write failed: %s", esp_err_to_name(err));
+    e->block.hdr.count = 0;
+}
+
+static void put(encoder_t *e, uint16_t v, int64_t t0, uint32_t period_ns, int channel)
+{
+    // a zigzag delta of 16 bit values takes up to 3 varint bytes
+    if (e->block.hdr.count > 0 && e->pos + 3 > CAPLOG_DATA)
+        flush(e);
+
+    caplog_block_t *h = &e->block.hdr;
+    if (h->count == 0)
+    {
+        *h = (caplog_block_t){
+            .magic = CAPLOG_BLOCK_MAGIC,
+            .channel = channel,
+            .first = v,
+            .t0 = t0,
+            .period_ns = period_ns,
+            .scale = e->scale,
+            .offset = e->offset,
+        };
+        e->pos = 0;
+    }
+    else
+        e->pos += caplog_put_delta(e->block.raw + sizeof(caplog_block_t) + e->pos, (int32_t)v - e->last);
+    e->last = v;
+    h->count++;
+}
+
+size_t caplog_decode(const caplog_block_t *block, const uint8_t *data, uint16_t *out, size_t max)
+{
+    size_t n = 0, i = 0;
+    if (block->count == 0 || max == 0)
+        return 0;
+    uint16_t v = out[n++] = block->first;
+    while (n < block->count && n < max && i < block->bytes)
+    {
+        uint32_t z = 0;
+        for (int shift = 0; i < block->bytes; shift += 7)
+        {
+            uint8_t b = data[i++];
+            z |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        v += (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+        out[n++] = v;
+    }
+    return n;
+}
+
+static void log_channel(int c)
+{
+    encoder_t *e = &enc[c];
+    uint32_t rate = capture_get_rate(c);
+    uint32_t bin = rate / s_rate > 0 ? rate / s_rate : 1;
+    float scale, offset;
+    capture_get_format(c, &scale, &offset);
+    uint64_t head = capture_head(c);
+    uint64_t first = capture_first(c);
+
+    // anything that breaks the even spacing or the format starts a new block
+    if (!e->on || bin != e->bin || scale != e->scale || offset != e->offset || e->cursor < first)
+    {
+        flush(e);
+        if (!e->on || e->cursor < first)
+            e->cursor = head;
+        e->on = true;
+        e->bin = bin;
+        e->scale = scale;
+        e->offset = offset;
+    }
+
+    uint32_t period_ns = (uint64_t)bin * 1000000000ull / rate / 2;
+    for (; e->cursor + bin <= head; e->cursor += bin)
+    {
+        capture_minmax_t mm;
+        capture_minmax(c, e->cursor, e->cursor + bin, &mm);
+        int64_t t0 = capture_time(c, e->cursor);
+        put(e, mm.min, t0, period_ns, c);
+        put(e, mm.max, t0, period_ns, c);
+    }
+}
+
+void caplog_task(void *arg)
+{
+    while (1)
+    {
+        vTaskDelay(pdMS_TO_TICKS(CAPLOG_TASK_MS));
+        if (s_part == NULL)
+            continue;
+
+        if (s_erase)
+        {
+            // the blocks being encoded belong to the erased log
+            for (int c = 0; c < CAPTURE_CHANNELS; c++)
+            {
+                enc[c].block.hdr.count = 0;
+                enc[c].on = false;
+            }
+            erase_all();
+            s_erase = false;
+        }
+        if (s_changed)
+        {
+            s_changed = false;
+            for (int c = 0; c < CAPTURE_CHANNELS; c++)
+            {
+                flush(&enc[c]);
+                enc[c].on = false;
+            }
+        }
+        if (s_rate == 0)
+            continue;
+        for (int c = 0; c < CAPTURE_CHANNELS; c++)
+            if ((s_channels & (1 << c)) && capture_get_rate(c) > 0)
+                log_channel(c);
+    }
+}
+
+esp_err_t caplog_set(uint32_t rate, uint8_t channels)
+{
+    if (s_part == NULL)
+        return ESP_ERR_NOT_FOUND;
+    if (channels >= 1 << CAPTURE_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+    s_rate = rate;
+    s_channels = channels;
+    s_changed = true;
+
+    nvs_handle_t nvs;
+    if (nvs_open("caplog", NVS_READWRITE, &nvs) != ESP_OK)
+        return ESP_FAIL;
+    nvs_set_u32(nvs, "rate", rate);
+    nvs_set_u8(nvs, "channels", channels);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    return ESP_OK;
+}
+
+esp_err_t caplog_read(caplog_cb_t cb, void *arg)
+{
+    if (s_part == NULL)
+        return ESP_ERR_NOT_FOUND;
+
+    uint8_t raw[CAPLOG_BLOCK];
+    const caplog_block_t *b = (const caplog_block_t *)raw;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    uint32_t head = s_head;
+    bool erasing = s_erasing;
+    xSemaphoreGive(s_mutex);
+    if (erasing)
+        return ESP_OK;
+
+    for (uint32_t k = 1; k <= s_sectors; k++)
+    {
+        uint32_t i = (head + k) % s_sectors;
+        caplog_sector_t h;
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        bool valid = read_sector(i, &h);
+        xSemaphoreGive(s_mutex);
+        if (!valid)
+            continue;
+
+        for (unsigned j = 1; j < CAPLOG_BLOCKS; j++)
+        {
+            // the sector may be recycled while the previous block was sent
+            caplog_sector_t now;
+            xSemaphoreTake(s_mutex, portMAX_DELAY);
+            esp_err_t err = esp_partition_read(s_part, i * CAPLOG_SECTOR + j * CAPLOG_BLOCK, raw, CAPLOG_BLOCK);
+            valid = read_sector(i, &now) && now.seq == h.seq;
+            xSemaphoreGive(s_mutex);
+            if (err != ESP_OK || !valid || b->magic != CAPLOG_BLOCK_MAGIC)
+                break;
+            if (b->bytes > CAPLOG_DATA)
+                continue;
+            if (!cb(b, raw + sizeof(caplog_block_t), arg))
+                return ESP_OK;
+        }
+    }
+    return ESP_OK;
+}
+
+static bool oldest_cb(const caplog_block_t *block, const uint8_t *data, void *arg)
+{
+    *(int64_t *)arg = block->t0;
+    return false;
+}
+
+void caplog_stats(caplog_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (s_part == NULL)
+        return;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    out->sectors = s_sectors;
+    out->used = s_used;
+    out->erase_min = UINT32_MAX;
+    for (uint32_t i = 0; i < s_sectors; i++)
+    {
+        out->erase_min = MIN(out->erase_min, s_erases[i]);
+        out->erase_max = MAX(out->erase_max, s_erases[i]);
+    }
+    out->bytes = s_bytes;
+    out->write_us = s_write_us;
+    xSemaphoreGive(s_mutex);
+    caplog_read(oldest_cb, &out->oldest);
+}
+
+esp_err_t caplog_command(const char *cmd, char *reply, size_t len)
+{
+    unsigned rate, channels = (1 << FRAME_INPUTS) - 1;
+
+    if (strcmp(cmd, "caplog") == 0)
+    {
+        caplog_stats_t st;
+        caplog_stats(&st);
+        int64_t now = esp_timer_get_time();
+        double rate_bps = (double)st.bytes * 1e6 / now;
+        snprintf(reply, len, "caplog %" PRIu32 "/%" PRIu32 " sectors, erases %" PRIu32 "..%" PRIu32 ", %.0f B/s, flash %.0f kB/s, oldest %.0f s ago, %.0f s capacity",
+                 st.used, st.sectors, st.erase_min, st.erase_max, rate_bps,
+                 st.write_us ? (double)st.bytes * 1e3 / st.write_us : 0.0, st.oldest ? (now - st.oldest) / 1e6 : 0.0,
+                 rate_bps > 0 ? (double)(st.sectors - 1) * (CAPLOG_BLOCKS - 1) * CAPLOG_BLOCK / rate_bps : 0.0);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "caplog off") == 0)
+        return caplog_set(0, 0);
+    if (strcmp(cmd, "caplog erase") == 0)
+    {
+        // takes seconds, caplog_task does it
+        if (s_part == NULL)
+            return ESP_ERR_NOT_FOUND;
+        s_erase = true;
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "caplog %u %x", &rate, &channels) >= 1)
+        return caplog_set(rate, channels);
+    return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,316 @@
+#include "main.h"
+#include "capture.h"
+
+#include <string.h>
+
+#include "esp_heap_caps.h"
+
+static const char *TAG = "capture";
+
+typedef struct
+{
+    uint16_t *raw;
+    capture_minmax_t *level[CAPTURE_LEVELS];
+    capture_minmax_t open[CAPTURE_LEVELS]; // bins being filled
+    uint64_t head;
+    uint64_t anchor_index; // index of the sample taken at anchor_time
+    int64_t anchor_time;
+    uint32_t rate; // samples per second
+    float scale, offset;
+} capture_channel_t;
+
+static capture_channel_t channels[CAPTURE_CHANNELS];
+static size_t size = 0; // samples per channel
+static int levels = 0;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// number of bins on level l
+static inline size_t level_bins(int l)
+{
+    size_t bin = CAPTURE_BIN;
+    while (l--)
+        bin *= CAPTURE_FAN;
+    return size / bin;
+}
+
+static size_t capture_bytes(size_t samples, int *nlevels)
+{
+    size_t bytes = samples * sizeof(uint16_t);
+    int l = 0;
+    // keep at least CAPTURE_FAN bins on the top level
+    for (size_t bin = CAPTURE_BIN; l < CAPTURE_LEVELS && samples / bin >= CAPTURE_FAN; bin *= CAPTURE_FAN, l++)
+        bytes += samples / bin * sizeof(capture_minmax_t);
+    *nlevels = l;
+    return bytes;
+}
+
+esp_err_t capture_init(void)
+{
+    uint8_t *mem[CAPTURE_CHANNELS] = {0};
+
+    size = CAPTURE_PSRAM_SAMPLES;
+    size_t bytes = capture_bytes(size, &levels);
+    uint32_t caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+
+    // as deep as the PSRAM allows
+    while (size > CAPTURE_INTERNAL_SAMPLES &&
+           (heap_caps_get_largest_free_block(caps) < bytes || heap_caps_get_free_size(caps) < bytes * CAPTURE_CHANNELS))
+    {
+        size /= 2;
+        bytes = capture_bytes(size, &levels);
+    }
+
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+    {
+        mem[c] = heap_caps_malloc(bytes, caps);
+        if (mem[c] == NULL)
+        {
+            // no PSRAM, fall back to a small buffer in internal RAM
+            for (int i = 0; i < c; i++)
+                heap_caps_free(mem[i]);
+
+            size = CAPTURE_INTERNAL_SAMPLES;
+            bytes = capture_bytes(size, &levels);
+            caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+            for (c = 0; c < CAPTURE_CHANNELS; c++)
+            {
+                mem[c] = heap_caps_malloc(bytes, caps);
+                if (mem[c] == NULL)
+                {
+                    ESP_LOGE(TAG, "No memory for %zu bytes", bytes * CAPTURE_CHANNELS);
+                    for (int i = 0; i < c; i++)
+                        heap_caps_free(mem[i]);
+                    size = 0;
+                    return ESP_ERR_NO_MEM;
+                }
+            }
+            break;
+        }
+    }
+
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+    {
+        capture_channel_t *ch = &channels[c];
+        memset(ch, 0, sizeof(capture_channel_t));
+        ch->rate = 1;
+        ch->scale = 1;
+        ch->raw = (uint16_t *)mem[c];
+        uint8_t *p = mem[c] + size * sizeof(uint16_t);
+        for (int l = 0; l < levels; l++)
+        {
+            ch->level[l] = (capture_minmax_t *)p;
+            p += level_bins(l) * sizeof(capture_minmax_t);
+        }
+    }
+
+    ESP_LOGI(TAG, "%zu samples x %d channels in %s, %d levels, %zu bytes", size, CAPTURE_CHANNELS,
+             (caps & MALLOC_CAP_SPIRAM) ? "PSRAM" : "internal RAM", levels, bytes * CAPTURE_CHANNELS);
+    return ESP_OK;
+}
+
+void capture_set_rate(int channel, uint32_t hz)
+{
+    channels[channel].rate = hz ? hz : 1;
+}
+
+uint32_t capture_get_rate(int channel)
+{
+    return channels[channel].rate;
+}
+
+void capture_set_format(int channel, float scale, float offset)
+{
+    taskENTER_CRITICAL(&s_lock);
+    channels[channel].scale = scale;
+    channels[channel].offset = offset;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void capture_get_format(int channel, float *scale, float *offset)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *scale = channels[channel].scale;
+    *offset = channels[channel].offset;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static inline void merge(capture_minmax_t *to, const capture_minmax_t *from)
+{
+    if (from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+// store the finished bin and fold it into the parent level
+static void close_bin(capture_channel_t *ch, int l, uint64_t bin)
+{
+    ch->level[l][bin & (level_bins(l) - 1)] = ch->open[l];
+
+    if (l + 1 >= levels)
+        return;
+
+    if (bin % CAPTURE_FAN == 0)
+        ch->open[l + 1] = ch->open[l];
+    else
+        merge(&ch->open[l + 1], &ch->open[l]);
+
+    if (bin % CAPTURE_FAN == CAPTURE_FAN - 1)
+        close_bin(ch, l + 1, bin / CAPTURE_FAN);
+}
+
+void capture_write(int channel, const uint16_t *samples, size_t count, int64_t t0)
+{
+    if (size == 0 || channel >= CAPTURE_CHANNELS)
+        return;
+
+    capture_channel_t *ch = &channels[channel];
+    uint64_t h = ch->head;
+    const uint64_t first = h;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t v = samples[i];
+        ch->raw[h & (size - 1)] = v;
+
+        capture_minmax_t *o = &ch->open[0];
+        if (h % CAPTURE_BIN == 0)
+        {
+            o->min = v;
+            o->max = v;
+        }
+        else
+        {
+            if (v < o->min)
+                o->min = v;
+            if (v > o->max)
+                o->max = v;
+        }
+
+        h++;
+        if (h % CAPTURE_BIN == 0)
+            close_bin(ch, 0, h / CAPTURE_BIN - 1);
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    ch->head = h;
+    ch->anchor_index = first;
+    ch->anchor_time = t0;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+uint64_t capture_head(int channel)
+{
+    taskENTER_CRITICAL(&s_lock);
+    uint64_t h = channels[channel].head;
+    taskEXIT_CRITICAL(&s_lock);
+    return h;
+}
+
+uint64_t capture_first(int channel)
+{
+    uint64_t h = capture_head(channel);
+    // keep a guard band, the writer may be overwriting the oldest samples right now
+    size_t depth = size - size / 16;
+    return h > depth ? h - depth : 0;
+}
+
+uint64_t capture_index(int channel, int64_t t)
+{
+    taskENTER_CRITICAL(&s_lock);
+    uint64_t i = channels[channel].anchor_index;
+    int64_t dt = t - channels[channel].anchor_time;
+    uint32_t rate = channels[channel].rate;
+    taskEXIT_CRITICAL(&s_lock);
+
+    int64_t di = dt * rate / 1000000;
+    if (di < 0 && (uint64_t)-di > i)
+        return 0;
+    return i + di;
+}
+
+int64_t capture_time(int channel, uint64_t index)
+{
+    taskENTER_CRITICAL(&s_lock);
+    uint64_t i = channels[channel].anchor_index;
+    int64_t t = channels[channel].anchor_time;
+    uint32_t rate = channels[channel].rate;
+    taskEXIT_CRITICAL(&s_lock);
+
+    return t + ((int64_t)index - (int64_t)i) * 1000000 / rate;
+}
+
+size_t capture_read(int channel, uint64_t i0, uint16_t *out, size_t count)
+{
+    if (size == 0 || channel >= CAPTURE_CHANNELS)
+        return 0;
+
+    uint64_t first = capture_first(channel);
+    uint64_t head = capture_head(channel);
+    if (i0 < first)
+        i0 = first;
+    if (i0 >= head)
+        return 0;
+    if (count > head - i0)
+        count = head - i0;
+
+    const uint16_t *raw = channels[channel].raw;
+    for (size_t i = 0; i < count; i++)
+        out[i] = raw[(i0 + i) & (size - 1)];
+    return count;
+}
+
+void capture_minmax(int channel, uint64_t i0, uint64_t i1, capture_minmax_t *out)
+{
+    capture_channel_t *ch = &channels[channel];
+
+    out->min = UINT16_MAX;
+    out->max = 0;
+
+    // raw samples up to the first bin boundary
+    while (i0 < i1 && (i0 % CAPTURE_BIN != 0 || i1 - i0 < CAPTURE_BIN))
+    {
+        uint16_t v = ch->raw[i0++ & (size - 1)];
+        if (v < out->min)
+            out->min = v;
+        if (v > out->max)
+            out->max = v;
+    }
+    // and after the last one
+    while (i1 > i0 && i1 % CAPTURE_BIN != 0)
+    {
+        uint16_t v = ch->raw[--i1 & (size - 1)];
+        if (v < out->min)
+            out->min = v;
+        if (v > out->max)
+            out->max = v;
+    }
+
+    // whole bins: peel off unaligned edges on each level, move the rest up
+    uint64_t b0 = i0 / CAPTURE_BIN;
+    uint64_t b1 = i1 / CAPTURE_BIN;
+    for (int l = 0; b0 < b1 && l < levels; l++)
+    {
+        size_t mask = level_bins(l) - 1;
+        if (l + 1 == levels)
+        {
+            while (b0 < b1)
+                merge(out, &ch->level[l][b0++ & mask]);
+            break;
+        }
+        while (b0 < b1 && b0 % CAPTURE_FAN != 0)
+            merge(out, &ch->level[l][b0++ & mask]);
+        while (b1 > b0 && b1 % CAPTURE_FAN != 0)
+            merge(out, &ch->level[l][--b1 & mask]);
+        b0 /= CAPTURE_FAN;
+        b1 /= CAPTURE_FAN;
+    }
+}
+
+void capture_query(int channel, uint64_t i0, uint64_t i1, capture_minmax_t *out, size_t points)
+{
+    uint64_t span = i1 - i0;
+    for (size_t j = 0; j < points; j++)
+        capture_minmax(channel, i0 + span * j / points, i0 + span * (j + 1) / points, &out[j]);
+}
@@ -0,0 +1,107 @@
+#include "decim.h"
+
+#include <string.h>
+
+// compensator taps, sixteenths: -a, 1 + 2a, -a with a = 3/16
+#define COMP_SIDE -3
+#define COMP_MID 22
+#define COMP_SHIFT 4
+
+int decim_init(decim_t *d, decim_type_t type, unsigned ratio, unsigned bits)
+{
+    unsigned shift = 0;
+    while ((1u << shift) < ratio)
+        shift++;
+
+    if ((1u << shift) != ratio || shift > DECIM_MAX_SHIFT || (bits != 16 && bits != 24))
+        return -1;
+    if (type != DECIM_OFF && shift == 0)
+        return -1;
+
+    memset(d, 0, sizeof(decim_t));
+    d->type = type;
+    d->shift = shift;
+    d->bits = bits;
+    return 0;
+}
+
+// v has full scale 2^in_bits, rescale to d->bits and clamp
+static inline uint32_t scale(const decim_t *d, int64_t v, unsigned in_bits)
+{
+    if (in_bits > d->bits)
+        v = (v + ((int64_t)1 << (in_bits - d->bits - 1))) >> (in_bits - d->bits);
+    else
+        v <<= d->bits - in_bits;
+
+    int64_t max = ((int64_t)1 << d->bits) - 1;
+    return v < 0 ? 0 : v > max ? max : v;
+}
+
+size_t decim_run(decim_t *d, const uint16_t *in, size_t n, uint32_t *out, size_t *first)
+{
+    const uint32_t r = 1u << d->shift;
+    size_t k = 0;
+    *first = 0;
+
+    if (d->type == DECIM_BOXCAR)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            d->acc += in[i];
+            if (++d->phase == r)
+            {
+                if (k == 0)
+                    *first = i;
+                out[k++] = scale(d, d->acc, 12 + d->shift);
+                d->acc = 0;
+                d->phase = 0;
+            }
+        }
+    }
+    else if (d->type == DECIM_CIC)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            // modular arithmetic, the combs undo any wrap of the integrators
+            uint32_t x = in[i];
+            for (int s = 0; s < DECIM_CIC_ORDER; s++)
+                x = d->integ[s] += x;
+
+            if (++d->phase == r)
+            {
+                d->phase = 0;
+                for (int s = 0; s < DECIM_CIC_ORDER; s++)
+                {
+                    uint32_t y = x - d->comb[s];
+                    d->comb[s] = x;
+                    x = y;
+                }
+
+                int64_t c = x;
+                int64_t y = (COMP_SIDE * (c + d->fir[1]) + COMP_MID * d->fir[0]) >> COMP_SHIFT;
+                d->fir[1] = d->fir[0];
+                d->fir[0] = c;
+
+                if (k == 0)
+                    *first = i;
+                out[k++] = scale(d, y, 12 + DECIM_CIC_ORDER * d->shift);
+            }
+        }
+    }
+    return k;
+}
+
+float decim_delay(const decim_t *d)
+{
+    float r = 1u << d->shift;
+    switch (d->type)
+    {
+    case DECIM_BOXCAR:
+        return (r - 1) / 2;
+    case DECIM_CIC:
+        // the compensator centre tap is one output sample back
+        return DECIM_CIC_ORDER * (r - 1) / 2 + r;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,221 @@
+#include "main.h"
+#include "derived.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "derived";
+
+#define H DERIVED_HISTORY
+#define MID 32768
+
+static const char *const ops[] = {"off", "sub", "add", "mul", "div", "int", "diff", "xy"};
+
+static derived_t s_slots[FRAME_MATH];
+static bool s_changed = true;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// per input: H samples of the previous frames followed by the current frame
+static uint16_t history[FRAME_INPUTS][H + FRAME_SAMPLES];
+
+static struct
+{
+    int64_t integral; // Q3 counts * samples
+    int32_t last;     // previous A, Q3
+    bool primed;      // last holds a sample, not the reset zero
+} state[FRAME_MATH];
+
+void derived_set(int slot, const derived_t *d)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_slots[slot] = *d;
+    s_changed = true;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void derived_get(int slot, derived_t *d)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *d = s_slots[slot];
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void derived_format(derived_op_t op, double period, float *scale, float *offset)
+{
+    switch (op)
+    {
+    case DERIVED_SUB:
+        *scale = 1 / 8.0f;
+        *offset = -MID / 8.0f;
+        break;
+    case DERIVED_MUL:
+        *scale = 512;
+        *offset = -MID * 512.0f;
+        break;
+    case DERIVED_DIV:
+        *scale = 1 / 1024.0f;
+        *offset = -MID / 1024.0f;
+        break;
+    case DERIVED_INT:
+        *scale = 1 / 8.0f;
+        *offset = -MID / 8.0f;
+        break;
+    case DERIVED_DIFF:
+        *scale = 1000 / (8 * period);
+        *offset = -MID * *scale;
+        break;
+    default:
+        *scale = 1 / 8.0f;
+        *offset = 0;
+        break;
+    }
+}
+
+static inline uint16_t clamp16(int64_t v)
+{
+    return v < 0 ? 0 : v > 0xffff ? 0xffff : v;
+}
+
+void derived_frame(frame_t *frame, const double *t0, double period)
+{
+    derived_t slots[FRAME_MATH];
+    taskENTER_CRITICAL(&s_lock);
+    memcpy(slots, s_slots, sizeof(slots));
+    bool changed = s_changed;
+    s_changed = false;
+    taskEXIT_CRITICAL(&s_lock);
+
+    // interleaved inputs are a single stream
+    if (frame->channels < FRAME_INPUTS)
+        changed = true;
+    if (changed)
+    {
+        memset(history, 0, sizeof(history));
+        memset(state, 0, sizeof(state));
+    }
+    if (frame->channels < FRAME_INPUTS)
+        return;
+
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        memcpy(&history[c][H], frame_samples(frame, c), frame->count[c] * sizeof(uint16_t));
+
+    // the other input is looked up lag samples back in its own history
+    const int ref = t0[1] < t0[0] ? 1 : 0;
+    const int other = 1 - ref;
+    double lag = (t0[other] - t0[ref]) / period;
+    int lag_i = floor(lag);
+    int frac = lround((lag - lag_i) * 256); // weight of the older sample
+    if (frac == 256)
+    {
+        lag_i++;
+        frac = 0;
+    }
+    if (lag_i > H - 1)
+        lag_i = H - 1;
+
+    const uint16_t *x_ref = &history[ref][H];
+    const uint16_t *x_other = &history[other][H];
+    const int n = frame->count[ref];
+    const int last_other = frame->count[other] - 1;
+    const uint64_t k_int = period * 1e-6 * 4294967296.0; // us per sample as Q32 seconds
+    int active = 0;
+
+    for (int s = 0; s < FRAME_MATH; s++)
+    {
+        const int c = FRAME_INPUTS + s;
+        const derived_t *d = &slots[s];
+        frame->count[c] = 0;
+        if (d->op == DERIVED_OFF)
+            continue;
+
+        uint16_t *out = frame_samples(frame, c);
+        const int32_t za = d->zero[0] << 3, zb = d->zero[1] << 3;
+        for (int i = 0; i < n; i++)
+        {
+            int p = i - lag_i;
+            if (p > last_other)
+                p = last_other;
+            int32_t vr = x_ref[i] << 3;
+            int32_t vo = (x_other[p - 1] * frac + x_other[p] * (256 - frac)) >> 5;
+            int32_t a = ref == 0 ? vr : vo;
+            int32_t b = ref == 0 ? vo : vr;
+
+            switch (d->op)
+            {
+            case DERIVED_SUB:
+                out[i] = clamp16(a - b + MID);
+                break;
+            case DERIVED_ADD:
+                out[i] = clamp16(a + b);
+                break;
+            case DERIVED_MUL:
+                out[i] = clamp16(((a - za) * (b - zb) >> 15) + MID);
+                break;
+            case DERIVED_DIV:
+            {
+                int32_t num = a - za, den = b - zb;
+                out[i] = den == 0 ? (num < 0 ? 0 : num > 0 ? 0xffff : MID) : clamp16(num * 1024 / den + MID);
+                break;
+            }
+            case DERIVED_INT:
+            {
+                // held at the ends of the range so it comes straight back
+                const int64_t limit = (int64_t)MID << 32;
+                int64_t acc = state[s].integral + a - za;
+                int64_t v = acc * (int64_t)k_int;
+                if (v >= limit || v <= -limit)
+                    acc = state[s].integral;
+                state[s].integral = acc;
+                out[i] = clamp16((acc * (int64_t)k_int >> 32) + MID);
+                break;
+            }
+            case DERIVED_DIFF:
+                // the first sample after a reset has no predecessor, it reads as flat
+                if (!state[s].primed)
+                {
+                    state[s].last = a;
+                    state[s].primed = true;
+                }
+                out[i] = clamp16(a - state[s].last + MID);
+                state[s].last = a;
+                break;
+            default:
+                out[i] = clamp16(b);
+                break;
+            }
+        }
+
+        frame->count[c] = n;
+        frame->t0[c] = llround(t0[ref]);
+        frame->period_ns[c] = lround(period * 1000);
+        frame->bits[c] = 16;
+        derived_format(d->op, period, &frame->scale[c], &frame->offset[c]);
+        active = c + 1;
+    }
+    if (active > 0)
+        frame->channels = active;
+
+    for (int c = 0; c < FRAME_INPUTS; c++)
+        memmove(history[c], &history[c][frame->count[c]], H * sizeof(uint16_t));
+}
+
+esp_err_t derived_command(const char *cmd)
+{
+    int slot;
+    char op[8];
+    int za = 0, zb = 0;
+    if (sscanf(cmd, "math %d %7s %d %d", &slot, op, &za, &zb) < 2 || slot < 0 || slot >= FRAME_MATH ||
+        za < 0 || za > 0xfff || zb < 0 || zb > 0xfff)
+        return ESP_ERR_INVALID_ARG;
+
+    for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (strcmp(op, ops[i]) == 0)
+        {
+            derived_t d = {.op = i, .zero = {za, zb}};
+            derived_set(slot, &d);
+            ESP_LOGI(TAG, "channel %d: %s", FRAME_INPUTS + slot, op);
+            return ESP_OK;
+        }
+    return ESP_ERR_INVALID_ARG;
+}
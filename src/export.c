@@ -0,0 +1,275 @@
+#include "main.h"
+#include "export.h"
+#include "wire.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+static const char *TAG = "export";
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// samples per channel read at once
+#define EXPORT_CHUNK 64
+
+typedef struct
+{
+    int n;
+    int ch[CAPTURE_CHANNELS];
+    float scale[CAPTURE_CHANNELS], offset[CAPTURE_CHANNELS];
+    uint32_t rate[CAPTURE_CHANNELS];
+    uint64_t i0, i1; // of the first channel
+} export_grid_t;
+
+esp_err_t export_parse_format(const char *name, export_format_t *out)
+{
+    if (strcmp(name, "csv") == 0)
+        *out = EXPORT_CSV;
+    else if (strcmp(name, "wav") == 0)
+        *out = EXPORT_WAV;
+    else if (strcmp(name, "raw") == 0)
+        *out = EXPORT_RAW;
+    else
+        return ESP_ERR_INVALID_ARG;
+    return ESP_OK;
+}
+
+const char *export_content_type(export_format_t format)
+{
+    switch (format)
+    {
+    case EXPORT_CSV:
+        return "text/csv";
+    case EXPORT_WAV:
+        return "audio/wav";
+    default:
+        return "application/octet-stream";
+    }
+}
+
+// buffered output, the sink sees full buffers only
+typedef struct
+{
+    char *buf;
+    size_t len, used;
+    export_sink_t sink;
+    void *arg;
+    esp_err_t err;
+    uint64_t bytes;
+} out_t;
+
+static void out_flush(out_t *o)
+{
+    if (o->used > 0 && o->err == ESP_OK)
+        o->err = o->sink(o->buf, o->used, o->arg);
+    o->bytes += o->used;
+    o->used = 0;
+}
+
+static void out_write(out_t *o, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0 && o->err == ESP_OK)
+    {
+        size_t n = MIN(len, o->len - o->used);
+        memcpy(o->buf + o->used, p, n);
+        o->used += n;
+        p += n;
+        len -= n;
+        if (o->used == o->len)
+            out_flush(o);
+    }
+}
+
+// samples of the other channels nearest to those of the first one
+static size_t read_rows(const export_grid_t *g, uint64_t i, size_t n, uint16_t v[][EXPORT_CHUNK], uint32_t *lost)
+{
+    size_t got = capture_read(g->ch[0], i, v[0], n);
+    if (got < n && capture_first(g->ch[0]) > i)
+        *lost += n - got;
+    int64_t t = capture_time(g->ch[0], i);
+    for (int k = 1; k < g->n; k++)
+    {
+        int c = g->ch[k];
+        uint64_t j0 = capture_index(c, t);
+        if (g->rate[c] == g->rate[g->ch[0]])
+        {
+            size_t m = capture_read(c, j0, v[k], got);
+            for (; m < got; m++)
+                v[k][m] = m > 0 ? v[k][m - 1] : 0;
+            continue;
+        }
+        for (size_t r = 0; r < got; r++)
+        {
+            uint64_t j = j0 + (uint64_t)r * g->rate[c] / g->rate[g->ch[0]];
+            if (capture_read(c, j, &v[k][r], 1) == 0)
+                v[k][r] = r > 0 ? v[k][r - 1] : 0;
+        }
+    }
+    return got;
+}
+
+static void wav_header(out_t *o, const export_grid_t *g)
+{
+    uint32_t frames = g->i1 - g->i0;
+    uint32_t data = frames * g->n * sizeof(float);
+    uint16_t block = g->n * sizeof(float);
+    struct __attribute__((packed))
+    {
+        char riff[4];
+        uint32_t size;
+        char wave[4], fmt[4];
+        uint32_t fmt_size;
+        uint16_t format, channels;
+        uint32_t rate, byte_rate;
+        uint16_t block, bits;
+        char data[4];
+        uint32_t data_size;
+    } h = {
+        .riff = "RIFF",
+        .size = 36 + data,
+        .wave = "WAVE",
+        .fmt = "fmt ",
+        .fmt_size = 16,
+        .format = 3, // IEEE float
+        .channels = g->n,
+        .rate = g->rate[g->ch[0]],
+        .byte_rate = g->rate[g->ch[0]] * block,
+        .block = block,
+        .bits = 32,
+        .data = "data",
+        .data_size = data,
+    };
+    out_write(o, &h, sizeof(h));
+}
+
+static void export_grid(const export_req_t *req, out_t *o, export_grid_t *g, export_stats_t *stats)
+{
+    uint16_t v[CAPTURE_CHANNELS][EXPORT_CHUNK];
+    char line[16 + CAPTURE_CHANNELS * 16];
+
+    if (req->format == EXPORT_WAV)
+        wav_header(o, g);
+    else
+    {
+        int l = snprintf(line, sizeof(line), "t_us");
+        for (int k = 0; k < g->n; k++)
+            l += snprintf(line + l, sizeof(line) - l, ",ch%d", g->ch[k]);
+        line[l++] = '\n';
+        out_write(o, line, l);
+    }
+
+    for (uint64_t i = g->i0; i < g->i1 && o->err == ESP_OK;)
+    {
+        size_t n = read_rows(g, i, MIN(EXPORT_CHUNK, g->i1 - i), v, &stats->lost);
+        if (n == 0)
+        {
+            // gone already, a WAV still gets the samples its header promised
+            n = MIN(EXPORT_CHUNK, g->i1 - i);
+            memset(v, 0, sizeof(v));
+        }
+        int64_t t = capture_time(g->ch[0], i);
+        for (size_t r = 0; r < n; r++)
+        {
+            if (req->format == EXPORT_WAV)
+            {
+                for (int k = 0; k < g->n; k++)
+                {
+                    float f = v[k][r] * g->scale[g->ch[k]] + g->offset[g->ch[k]];
+                    out_write(o, &f, sizeof(f));
+                }
+                continue;
+            }
+            int l = snprintf(line, sizeof(line), "%" PRId64, (int64_t)(t + (int64_t)r * 1000000 / g->rate[g->ch[0]]));
+            for (int k = 0; k < g->n; k++)
+                l += snprintf(line + l, sizeof(line) - l, ",%.6g", v[k][r] * g->scale[g->ch[k]] + g->offset[g->ch[k]]);
+            line[l++] = '\n';
+            out_write(o, line, l);
+        }
+        i += n;
+        // share the core with acquisition, the sink may not block
+        taskYIELD();
+    }
+}
+
+static void export_raw(const export_req_t *req, out_t *o, export_grid_t *g, export_stats_t *stats)
+{
+    uint32_t seq = 0;
+    for (int k = 0; k < g->n && o->err == ESP_OK; k++)
+    {
+        int c = g->ch[k];
+        uint64_t i1 = capture_index(c, req->t1);
+        for (uint64_t i = capture_index(c, req->t0); i < i1 && o->err == ESP_OK;)
+        {
+            uint16_t v[EXPORT_CHUNK * 4];
+            uint64_t first = capture_first(c);
+            if (i < first)
+            {
+                stats->lost += MIN(first, i1) - i;
+                i = first;
+                continue;
+            }
+            size_t n = capture_read(c, i, v, MIN(EXPORT_CHUNK * 4, i1 - i));
+            if (n == 0)
+                break;
+            wire_frame_hdr_t h = {.magic = WIRE_MAGIC, .version = WIRE_VERSION, .channels = 1, .seq = seq++};
+            wire_channel_hdr_t ch = {
+                .channel = c,
+                .bits = 16,
+                .count = n,
+                .period_ns = 1000000000ull / g->rate[c],
+                .t0 = capture_time(c, i),
+                .scale = g->scale[c],
+                .offset = g->offset[c],
+            };
+            out_write(o, &h, sizeof(h));
+            out_write(o, &ch, sizeof(ch));
+            out_write(o, v, n * sizeof(uint16_t));
+            i += n;
+            taskYIELD();
+        }
+    }
+}
+
+esp_err_t export_run(const export_req_t *req, export_sink_t sink, void *arg, char *buf, size_t len, export_stats_t *stats)
+{
+    export_grid_t g = {0};
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+    {
+        if (!(req->channels & (1 << c)))
+            continue;
+        g.rate[c] = capture_get_rate(c);
+        if (g.rate[c] == 0)
+            return ESP_ERR_INVALID_STATE;
+        capture_get_format(c, &g.scale[c], &g.offset[c]);
+        g.ch[g.n++] = c;
+    }
+    if (g.n == 0 || req->t1 <= req->t0)
+        return ESP_ERR_INVALID_ARG;
+
+    // the range as it is now, samples written later are not included
+    g.i0 = capture_index(g.ch[0], req->t0);
+    g.i1 = MIN(capture_index(g.ch[0], req->t1), capture_head(g.ch[0]));
+    if (g.i0 < capture_first(g.ch[0]))
+        g.i0 = capture_first(g.ch[0]);
+    if (g.i1 < g.i0)
+        g.i1 = g.i0;
+
+    memset(stats, 0, sizeof(*stats));
+    out_t o = {.buf = buf, .len = len, .sink = sink, .arg = arg};
+    int64_t start = esp_timer_get_time();
+    if (req->format == EXPORT_RAW)
+        export_raw(req, &o, &g, stats);
+    else
+        export_grid(req, &o, &g, stats);
+    out_flush(&o);
+    stats->bytes = o.bytes;
+    stats->us = esp_timer_get_time() - start;
+
+    ESP_LOGI(TAG, "%" PRIu64 " bytes in %" PRId64 " us, %.2f MB/s, %" PRIu32 " samples lost", stats->bytes, stats->us,
+             stats->us > 0 ? (double)stats->bytes / stats->us : 0.0, stats->lost);
+    return o.err;
+}
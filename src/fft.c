@@ -0,0 +1,84 @@
+#include "fft.h"
+
+#include <math.h>
+
+void fft(float *x, size_t n)
+{
+    // bit reversed order
+    for (size_t i = 1, j = 0; i < n; i++)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            float re = x[2 * i], im = x[2 * i + 1];
+            x[2 * i] = x[2 * j];
+            x[2 * i + 1] = x[2 * j + 1];
+            x[2 * j] = re;
+            x[2 * j + 1] = im;
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1)
+    {
+        size_t half = len / 2;
+        for (size_t k = 0; k < half; k++)
+        {
+            // twiddles computed directly, a recurrence loses too much for spur levels
+            float wr = cosf(-2 * M_PI * k / len);
+            float wi = sinf(-2 * M_PI * k / len);
+            for (size_t i = k; i < n; i += len)
+            {
+                float *a = x + 2 * i;
+                float *b = x + 2 * (i + half);
+                float tr = b[0] * wr - b[1] * wi;
+                float ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+esp_err_t fft_power(const uint16_t *samples, size_t n, float *work, float *power)
+{
+    if (n < 16 || (n & (n - 1)) != 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    double mean = 0;
+    for (size_t i = 0; i < n; i++)
+        mean += samples[i];
+    mean /= n;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float w = 0.5f - 0.5f * cosf(2 * M_PI * i / n);
+        work[2 * i] = (samples[i] - mean) * w;
+        work[2 * i + 1] = 0;
+    }
+    fft(work, n);
+
+    // a full scale sine (amplitude 2048) peaks at 2048 * n / 4 with the Hann window's coherent gain
+    float scale = 4.0f / (2048.0f * n);
+    for (size_t k = 0; k <= n / 2; k++)
+    {
+        float re = work[2 * k] * scale;
+        float im = work[2 * k + 1] * scale;
+        power[k] = re * re + im * im;
+    }
+    return ESP_OK;
+}
+
+float fft_tone(const float *power, size_t bins, size_t k)
+{
+    float p = 0;
+    for (int i = (int)k - FFT_HANN_SPREAD; i <= (int)k + FFT_HANN_SPREAD; i++)
+        if (i >= 0 && i < bins)
+            p += power[i];
+    // the window spreads the tone over 1.5 bins worth of noise bandwidth
+    return p / 1.5f;
+}
@@ -0,0 +1,243 @@
+#include "filter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BQ_SHIFT 30
+#define BQ_IN_SHIFT 12  // Q12 samples
+#define FIR_SHIFT 15
+#define FIR_IN_SHIFT 3  // Q3 samples, headroom for an FIR gain of 2
+#define MID 2048
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static const char *const kinds[] = {"lp", "hp", "bp", "notch"};
+
+void filter_clear(filter_chain_t *f)
+{
+    memset(f, 0, sizeof(filter_chain_t));
+}
+
+int filter_add(filter_chain_t *f, const filter_spec_t *spec)
+{
+    if (f->stages >= FILTER_MAX_STAGES || spec->kind > FILTER_NOTCH || spec->f1 <= 0)
+        return -1;
+    if (spec->fir)
+    {
+        if (spec->kind == FILTER_NOTCH || spec->taps < 3 || spec->taps > FILTER_MAX_TAPS || (spec->taps & 1) == 0)
+            return -1;
+        if (spec->kind == FILTER_BANDPASS && spec->f2 <= spec->f1)
+            return -1;
+        for (int i = 0; i < f->stages; i++)
+            if (f->spec[i].fir)
+                return -1;
+    }
+    else if (spec->q <= 0)
+        return -1;
+
+    f->spec[f->stages++] = *spec;
+    return 0;
+}
+
+static int32_t q30(double v)
+{
+    return lround(v * (1 << BQ_SHIFT));
+}
+
+static void design_biquad(filter_biquad_t *bq, const filter_spec_t *s, float rate)
+{
+    double w = 2 * M_PI * s->f1 / rate;
+    double cw = cos(w);
+    double alpha = sin(w) / (2 * s->q);
+    double b0, b1, b2;
+
+    switch (s->kind)
+    {
+    case FILTER_LOWPASS:
+        b0 = b2 = (1 - cw) / 2;
+        b1 = 1 - cw;
+        break;
+    case FILTER_HIGHPASS:
+        b0 = b2 = (1 + cw) / 2;
+        b1 = -(1 + cw);
+        break;
+    case FILTER_BANDPASS:
+        b0 = alpha;
+        b1 = 0;
+        b2 = -alpha;
+        break;
+    default:
+        b0 = b2 = 1;
+        b1 = -2 * cw;
+        break;
+    }
+
+    double a0 = 1 + alpha;
+    memset(bq, 0, sizeof(filter_biquad_t));
+    bq->b0 = q30(b0 / a0);
+    bq->b1 = q30(b1 / a0);
+    bq->b2 = q30(b2 / a0);
+    bq->a1 = q30(-2 * cw / a0);
+    bq->a2 = q30((1 - alpha) / a0);
+}
+
+// ideal low pass of corner fc (cycles per sample) at offset k from the centre
+static double sinc_lp(double fc, int k)
+{
+    return k == 0 ? 2 * fc : sin(2 * M_PI * fc * k) / (M_PI * k);
+}
+
+static void design_fir(filter_chain_t *f, const filter_spec_t *s, float rate)
+{
+    int n = s->taps, m = n / 2;
+    double f1 = s->f1 / rate, f2 = s->f2 / rate;
+    double lp[FILTER_MAX_TAPS], lp2[FILTER_MAX_TAPS];
+    double sum = 0, sum2 = 0;
+
+    // windowed low passes scaled to exactly unity at DC, so the high and band
+    // passes built from them block DC
+    for (int i = 0; i < n; i++)
+    {
+        double w = 0.54 - 0.46 * cos(2 * M_PI * i / (n - 1));
+        lp[i] = sinc_lp(f1, i - m) * w;
+        lp2[i] = sinc_lp(f2, i - m) * w;
+        sum += lp[i];
+        sum2 += lp2[i];
+    }
+
+    int32_t total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        double h;
+        if (s->kind == FILTER_LOWPASS)
+            h = lp[i] / sum;
+        else if (s->kind == FILTER_HIGHPASS)
+            h = (i == m) - lp[i] / sum;
+        else
+            h = lp2[i] / sum2 - lp[i] / sum;
+        f->h[i] = lround(h * (1 << FIR_SHIFT));
+        total += f->h[i];
+    }
+    // rounding leftovers go to the centre tap
+    f->h[m] += (s->kind == FILTER_LOWPASS ? 1 << FIR_SHIFT : 0) - total;
+    f->taps = n;
+}
+
+int filter_design(filter_chain_t *f, float rate)
+{
+    f->biquads = 0;
+    f->taps = 0;
+    f->pos = 0;
+    memset(f->hist, 0, sizeof(f->hist));
+
+    for (int i = 0; i < f->stages; i++)
+    {
+        const filter_spec_t *s = &f->spec[i];
+        if (s->f1 >= rate / 2 || (s->fir && s->kind == FILTER_BANDPASS && s->f2 >= rate / 2))
+            return -1;
+        if (s->fir)
+            design_fir(f, s, rate);
+        else
+            design_biquad(&f->bq[f->biquads++], s, rate);
+    }
+    return 0;
+}
+
+static inline int32_t sat32(int64_t v)
+{
+    return v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v;
+}
+
+static inline int32_t biquad(filter_biquad_t *bq, int32_t x)
+{
+    int64_t acc = bq->err;
+    acc += (int64_t)bq->b0 * x + (int64_t)bq->b1 * bq->x1 + (int64_t)bq->b2 * bq->x2;
+    acc -= (int64_t)bq->a1 * bq->y1 + (int64_t)bq->a2 * bq->y2;
+    int32_t y = sat32(acc >> BQ_SHIFT);
+    bq->err = acc - ((int64_t)y << BQ_SHIFT);
+
+    bq->x2 = bq->x1;
+    bq->x1 = x;
+    bq->y2 = bq->y1;
+    bq->y1 = y;
+    return y;
+}
+
+static inline int32_t fir(filter_chain_t *f, int32_t x)
+{
+    int16_t s = x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : x;
+    f->hist[f->pos] = s;
+    f->hist[f->pos + f->taps] = s;
+    if (++f->pos == f->taps)
+        f->pos = 0;
+
+    // oldest sample first, the taps are symmetric so their order does not matter
+    const int16_t *p = &f->hist[f->pos];
+    const int16_t *h = f->h;
+    int32_t acc = 0;
+    int i = 0;
+    for (; i + 4 <= f->taps; i += 4)
+        acc += h[i] * p[i] + h[i + 1] * p[i + 1] + h[i + 2] * p[i + 2] + h[i + 3] * p[i + 3];
+    for (; i < f->taps; i++)
+        acc += h[i] * p[i];
+    return acc;
+}
+
+void filter_run(filter_chain_t *f, uint16_t *v, size_t n)
+{
+    if (f->biquads == 0 && f->taps == 0)
+        return;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t x = ((int32_t)v[i] - MID) << BQ_IN_SHIFT;
+        for (int b = 0; b < f->biquads; b++)
+            x = biquad(&f->bq[b], x);
+
+        int shift = BQ_IN_SHIFT;
+        if (f->taps)
+        {
+            x = fir(f, (x + (1 << (BQ_IN_SHIFT - FIR_IN_SHIFT - 1))) >> (BQ_IN_SHIFT - FIR_IN_SHIFT));
+            shift = FIR_SHIFT + FIR_IN_SHIFT;
+        }
+
+        int32_t y = MID + ((x + (1 << (shift - 1))) >> shift);
+        v[i] = y < 0 ? 0 : y > 0xfff ? 0xfff : y;
+    }
+}
+
+int filter_parse(const char *text, filter_spec_t *spec)
+{
+    char kind[8];
+    float a = 0, b = 0, c = 0;
+    memset(spec, 0, sizeof(filter_spec_t));
+
+    spec->fir = strncmp(text, "fir ", 4) == 0;
+    int n = sscanf(spec->fir ? text + 4 : text, "%7s %f %f %f", kind, &a, &b, &c);
+    if (n < 2)
+        return -1;
+
+    spec->kind = 0xff;
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+        if (strcmp(kind, kinds[i]) == 0)
+            spec->kind = i;
+
+    spec->f1 = a;
+    if (!spec->fir)
+    {
+        // a constant skirt band pass or notch of Q 0.7 would be too wide to be of use
+        spec->q = n > 2 ? b : spec->kind >= FILTER_BANDPASS ? 10 : FILTER_Q;
+        return 0;
+    }
+    if (spec->kind == FILTER_BANDPASS)
+    {
+        spec->f2 = b;
+        spec->taps = c;
+        return n == 4 ? 0 : -1;
+    }
+    spec->taps = b;
+    return n == 3 ? 0 : -1;
+}
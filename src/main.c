@@ -1,21 +1,33 @@
 #include "main.h"
+#include "mem.h"
+#include "record.h"
+#include "caplog.h"
+#include "trend.h"
+#include "bench.h"
 
 #include "freertos/queue.h"
 
 #include "esp_system.h"
 
+#if SOC_TEMPERATURE_SENSOR_SUPPORT_FAST_RC
 #include "driver/temperature_sensor.h"
+#endif
 
 #include "nvs.h"
 #include "nvs_flash.h"
 
+#if !CONFIG_IDF_TARGET_LINUX
 #include "esp_chip_info.h"
-#include "esp_system.h"
 #include "esp_flash.h"
+#endif
+#include "esp_timer.h"
 
 QueueHandle_t adc_queue;
 QueueHandle_t ui_queue;
 
+static StaticQueue_t adc_queue_buffer;
+static uint8_t adc_queue_storage[FRAME_POOL_SIZE * sizeof(frame_t *)];
+
 #if SOC_TEMPERATURE_SENSOR_SUPPORT_FAST_RC
 
 float get_temperature_sensor()
@@ -39,11 +51,31 @@ float get_temperature_sensor()
 };
 #endif
 
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// share of time each core spent in its idle task since the last call
+static void cpu_report(void)
+{
+    static configRUN_TIME_COUNTER_TYPE idle_last[portNUM_PROCESSORS];
+    static int64_t time_last = 0;
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < portNUM_PROCESSORS; i++)
+    {
+        configRUN_TIME_COUNTER_TYPE idle = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(i));
+        if (time_last > 0)
+            ESP_LOGI("main", "cpu%d idle %.1f%%", i, 100.0 * (configRUN_TIME_COUNTER_TYPE)(idle - idle_last[i]) / (now - time_last));
+        idle_last[i] = idle;
+    }
+    time_last = now;
+}
+#endif
+
 void app_main()
 {
 
     vTaskDelay(5000 / portTICK_PERIOD_MS);
 
+#if !CONFIG_IDF_TARGET_LINUX
     /* Print chip information */
     esp_chip_info_t chip_info;
     uint32_t flash_size;
@@ -64,6 +96,7 @@ void app_main()
 
     printf("%dMB %s flash\n", flash_size / (1024 * 1024),
            (chip_info.features & CHIP_FEATURE_EMB_FLASH) ? "embedded" : "external");
+#endif
 
 #if SOC_TEMPERATURE_SENSOR_SUPPORT_FAST_RC
     ESP_LOGI("main", "Temperature out celsius %f°C", get_temperature_sensor());
@@ -90,16 +123,35 @@ void app_main()
     }
     ESP_ERROR_CHECK(err);
 
-    // adc_queue = xQueueCreate(10, BLOCK);
+    mem_init();
+    caplog_init();
+
+    // frame_t pointers, every frame in flight comes from frame_pool
+    adc_queue = xQueueCreateStatic(FRAME_POOL_SIZE, sizeof(frame_t *), adc_queue_storage, &adc_queue_buffer);
     ui_queue = xQueueCreate(100, 1);
 
-    xTaskCreate(adc_dma_task, "adc_dma_task", 1024 * 6, NULL, 5, NULL);
+    mem_task_create(adc_dma_task, "adc_dma_task", ADC_TASK_STACK, NULL, 5, tskNO_AFFINITY);
     // vTaskDelay(1000 / portTICK_PERIOD_MS);
     // xTaskCreate(task_SSD1306i2c, "SSD1306", 1024 * 6, NULL, 5, NULL);
-    // xTaskCreate(wifi_task, "wifi_task", 1024 * 6, NULL, 5, NULL);
-
+    mem_task_create(wifi_task, "wifi_task", WIFI_TASK_STACK, NULL, 5, tskNO_AFFINITY);
+    // below the sample path, file system writes may take a while
+    mem_task_create(record_task, "record_task", RECORD_TASK_STACK, NULL, 3, tskNO_AFFINITY);
+    mem_task_create(caplog_task, "caplog_task", CAPLOG_TASK_STACK, NULL, 3, tskNO_AFFINITY);
+    mem_task_create(trend_task, "trend_task", TREND_TASK_STACK, NULL, 3, tskNO_AFFINITY);
+    // "bench" on the console, below the sample path
+    bench_console_start();
+
+    int seconds = 0;
     while (1)
     {
         vTaskDelay(1000 / portTICK_PERIOD_MS);
+
+        if (++seconds % 60 == 0)
+            mem_report();
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        if (seconds % 10 == 0)
+            cpu_report();
+#endif
     };
 }
@@ -0,0 +1,345 @@
+#include "main.h"
+#include "mask.h"
+#include "trigger.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "mask";
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// written by mask_set/mask_command, taken over by adc_dma_task at the next frame
+static struct
+{
+    bool writing, request;
+    bool on, learn;
+    uint16_t margin;
+    mask_hdr_t hdr;
+    capture_minmax_t limits[MASK_BINS];
+} s_new;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile bool s_only = false;
+static mask_counters_t s_counters;
+
+// owned by adc_dma_task
+static struct
+{
+    bool on, learn;
+    uint16_t margin;
+    mask_hdr_t hdr;
+    capture_minmax_t limits[MASK_BINS];
+    int64_t pending[MASK_PENDING]; // trigger times, us
+    unsigned head, tail;
+    bool edge_armed;
+    int64_t hold_until;
+    uint32_t test;
+} m;
+
+// failures, adc_dma_task writes at head, wifi_task reads at tail
+static mask_record_t s_records[MASK_RECORDS];
+static volatile unsigned s_rec_head, s_rec_tail;
+
+static esp_err_t request_begin(void)
+{
+    esp_err_t err = ESP_OK;
+    taskENTER_CRITICAL(&s_lock);
+    if (s_new.writing || s_new.request)
+        err = ESP_ERR_INVALID_STATE;
+    else
+        s_new.writing = true;
+    taskEXIT_CRITICAL(&s_lock);
+    return err;
+}
+
+static void request_end(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_new.writing = false;
+    s_new.request = true;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static esp_err_t check_hdr(const mask_hdr_t *hdr)
+{
+    if (hdr->channel >= CAPTURE_CHANNELS || hdr->bins == 0 || hdr->bins > MASK_BINS || hdr->bin == 0 ||
+        hdr->pre > hdr->bins)
+        return ESP_ERR_INVALID_ARG;
+    return ESP_OK;
+}
+
+esp_err_t mask_set(const mask_hdr_t *hdr, const capture_minmax_t *limits)
+{
+    esp_err_t err = check_hdr(hdr);
+    if (err != ESP_OK || (err = request_begin()) != ESP_OK)
+        return err;
+    s_new.on = true;
+    s_new.learn = false;
+    s_new.hdr = *hdr;
+    memcpy(s_new.limits, limits, hdr->bins * sizeof(capture_minmax_t));
+    request_end();
+    return ESP_OK;
+}
+
+static esp_err_t mask_learn(const mask_hdr_t *hdr, uint16_t margin)
+{
+    esp_err_t err = check_hdr(hdr);
+    if (err != ESP_OK || (err = request_begin()) != ESP_OK)
+        return err;
+    s_new.on = true;
+    s_new.learn = true;
+    s_new.margin = margin;
+    s_new.hdr = *hdr;
+    request_end();
+    return ESP_OK;
+}
+
+void mask_off(void)
+{
+    while (request_begin() != ESP_OK)
+        vTaskDelay(1);
+    s_new.on = false;
+    request_end();
+}
+
+bool mask_only(void)
+{
+    return s_only;
+}
+
+void mask_get_counters(mask_counters_t *out)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *out = s_counters;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static void count(uint32_t *counter)
+{
+    taskENTER_CRITICAL(&s_lock);
+    (*counter)++;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static void take_request(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    bool request = s_new.request;
+    taskEXIT_CRITICAL(&s_lock);
+    if (!request)
+        return;
+
+    // the writer waits for request to clear, so s_new is stable here
+    m.on = s_new.on;
+    m.learn = s_new.learn;
+    m.margin = s_new.margin;
+    m.hdr = s_new.hdr;
+    if (m.on && !m.learn)
+        memcpy(m.limits, s_new.limits, m.hdr.bins * sizeof(capture_minmax_t));
+    m.head = m.tail = 0;
+    m.edge_armed = false;
+    m.hold_until = 0;
+    m.test = 0;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_new.request = false;
+    memset(&s_counters, 0, sizeof(s_counters));
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (m.on)
+        ESP_LOGI(TAG, "%s channel %d, %d bins of %d samples, %d before the trigger", m.learn ? "learning" : "testing",
+                 m.hdr.channel, m.hdr.bins, m.hdr.bin, m.hdr.pre);
+}
+
+void mask_scan(const frame_t *frame, const double *t_first, double period)
+{
+    take_request();
+    if (!m.on)
+        return;
+
+    trigger_t t;
+    trigger_get(&t);
+    if (t.slope == TRIGGER_OFF || t.channel >= FRAME_INPUTS)
+        return;
+
+    uint32_t rate = capture_get_rate(m.hdr.channel);
+    int64_t after = (int64_t)(m.hdr.bins - m.hdr.pre) * m.hdr.bin * 1000000 / rate;
+
+    const uint16_t *samples = frame_samples(frame, t.channel);
+    size_t n = frame->count[t.channel];
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!trigger_step(&t, &m.edge_armed, samples[i]))
+            continue;
+        int64_t ti = llround(t_first[t.channel] + i * period);
+        if (ti < m.hold_until)
+            continue;
+        if (m.head - m.tail == MASK_PENDING)
+        {
+            count(&s_counters.missed);
+            continue;
+        }
+        m.pending[m.head++ % MASK_PENDING] = ti;
+        m.hold_until = ti + after;
+    }
+}
+
+static void record(int bin, uint64_t i0, uint64_t trigger)
+{
+    const int ch = m.hdr.channel;
+    if (s_rec_head - s_rec_tail == MASK_RECORDS)
+    {
+        count(&s_counters.unsent);
+        return;
+    }
+    mask_record_t *r = &s_records[s_rec_head % MASK_RECORDS];
+
+    // centred on the failing bin, as far as the capture allows
+    uint64_t head = capture_head(ch);
+    uint64_t r0 = i0 + (uint64_t)bin * m.hdr.bin + m.hdr.bin / 2;
+    r0 = r0 > MASK_RECORD_SAMPLES / 2 ? r0 - MASK_RECORD_SAMPLES / 2 : 0;
+    if (r0 + MASK_RECORD_SAMPLES > head)
+        r0 = head > MASK_RECORD_SAMPLES ? head - MASK_RECORD_SAMPLES : 0;
+    r0 = MAX(r0, capture_first(ch));
+
+    size_t n = capture_read(ch, r0, r->samples, MASK_RECORD_SAMPLES);
+    float scale, offset;
+    capture_get_format(ch, &scale, &offset);
+    r->test = m.test;
+    r->bin = bin;
+    r->trigger = trigger >= r0 && trigger < r0 + n ? trigger - r0 + 1 : 0;
+    r->hdr = (wire_channel_hdr_t){
+        .channel = ch,
+        .bits = 16,
+        .count = n,
+        .period_ns = 1000000000ull / capture_get_rate(ch),
+        .t0 = capture_time(ch, r0),
+        .scale = scale,
+        .offset = offset,
+    };
+    s_rec_head++;
+    net_notify(NET_MASK);
+}
+
+int64_t mask_check(void)
+{
+    const int ch = m.hdr.channel;
+    int64_t failed = 0;
+    while (m.on && m.tail != m.head)
+    {
+        uint64_t trigger = capture_index(ch, m.pending[m.tail % MASK_PENDING]);
+        uint64_t pre = (uint64_t)m.hdr.pre * m.hdr.bin;
+        if (trigger < pre)
+        {
+            m.tail++;
+            count(&s_counters.missed);
+            continue;
+        }
+        uint64_t i0 = trigger - pre;
+        if (capture_head(ch) < i0 + (uint64_t)m.hdr.bins * m.hdr.bin)
+            break;
+        m.tail++;
+        if (i0 < capture_first(ch))
+        {
+            count(&s_counters.missed);
+            continue;
+        }
+
+        if (m.learn)
+        {
+            for (int b = 0; b < m.hdr.bins; b++)
+            {
+                capture_minmax_t mm;
+                capture_minmax(ch, i0 + b * m.hdr.bin, i0 + (b + 1) * m.hdr.bin, &mm);
+                m.limits[b].min = MAX((int)mm.min - m.margin, 0);
+                m.limits[b].max = MIN((int)mm.max + m.margin, UINT16_MAX);
+            }
+            m.learn = false;
+            ESP_LOGI(TAG, "learned, margin %d", m.margin);
+            continue;
+        }
+
+        int fail = -1;
+        for (int b = 0; b < m.hdr.bins && fail < 0; b++)
+        {
+            capture_minmax_t mm;
+            capture_minmax(ch, i0 + b * m.hdr.bin, i0 + (b + 1) * m.hdr.bin, &mm);
+            if (mm.min < m.limits[b].min || mm.max > m.limits[b].max)
+                fail = b;
+        }
+
+        taskENTER_CRITICAL(&s_lock);
+        s_counters.tested++;
+        if (fail >= 0)
+            s_counters.failed++;
+        taskEXIT_CRITICAL(&s_lock);
+
+        if (fail >= 0)
+        {
+            record(fail, i0, trigger);
+            failed = m.pending[(m.tail - 1) % MASK_PENDING];
+        }
+        m.test++;
+    }
+    return failed;
+}
+
+bool mask_peek(const mask_record_t **rec)
+{
+    if (s_rec_tail == s_rec_head)
+        return false;
+    *rec = &s_records[s_rec_tail % MASK_RECORDS];
+    return true;
+}
+
+void mask_release(void)
+{
+    if (s_rec_tail != s_rec_head)
+        s_rec_tail++;
+}
+
+esp_err_t mask_command(const char *cmd, char *reply, size_t len)
+{
+    mask_hdr_t hdr = {0};
+    unsigned ch, bins, bin, pre, margin;
+
+    if (strcmp(cmd, "mask") == 0)
+    {
+        mask_counters_t c;
+        mask_get_counters(&c);
+        snprintf(reply, len, "mask tested %" PRIu32 ", failed %" PRIu32 ", missed %" PRIu32 ", unsent %" PRIu32, c.tested, c.failed, c.missed, c.unsent);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "mask off") == 0)
+    {
+        mask_off();
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "mask reset") == 0)
+    {
+        taskENTER_CRITICAL(&s_lock);
+        memset(&s_counters, 0, sizeof(s_counters));
+        taskEXIT_CRITICAL(&s_lock);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "mask only on") == 0 || strcmp(cmd, "mask only off") == 0)
+    {
+        s_only = strcmp(cmd, "mask only on") == 0;
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "mask learn %u %u %u %u %u", &ch, &bins, &bin, &pre, &margin) == 5)
+    {
+        if (bins > MASK_BINS || bin > UINT16_MAX || margin > UINT16_MAX)
+            return ESP_ERR_INVALID_ARG;
+        hdr.channel = ch < CAPTURE_CHANNELS ? ch : CAPTURE_CHANNELS;
+        hdr.bins = bins;
+        hdr.bin = bin;
+        hdr.pre = pre < bins ? pre : bins + 1;
+        return mask_learn(&hdr, margin);
+    }
+    return ESP_ERR_INVALID_ARG;
+}
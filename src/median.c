@@ -0,0 +1,172 @@
+#include "median.h"
+
+#include <string.h>
+
+// heap positions run from -n / 2 to n / 2, 0 is the median
+#define HEAP(w, i) ((w)->heap[(w)->n / 2 + (i)])
+#define MIN_CT(w) (((w)->ct - 1) / 2) // values in the min heap
+#define MAX_CT(w) ((w)->ct / 2)       // values in the max heap
+
+static void window_init(median_window_t *w, unsigned n)
+{
+    memset(w, 0, sizeof(median_window_t));
+    w->n = n;
+    // slot i starts out at position 0, 1, -1, 2, -2, ...
+    for (int i = 0; i < (int)n; i++)
+    {
+        w->pos[i] = (i + 1) / 2 * (i & 1 ? -1 : 1);
+        HEAP(w, w->pos[i]) = i;
+    }
+}
+
+static inline int less(const median_window_t *w, int i, int j)
+{
+    return w->data[HEAP(w, i)] < w->data[HEAP(w, j)];
+}
+
+static inline void swap(median_window_t *w, int i, int j)
+{
+    int8_t t = HEAP(w, i);
+    HEAP(w, i) = HEAP(w, j);
+    HEAP(w, j) = t;
+    w->pos[HEAP(w, i)] = i;
+    w->pos[HEAP(w, j)] = j;
+}
+
+// swap i and j if the value at i is less, returns whether they were swapped
+static inline int order(median_window_t *w, int i, int j)
+{
+    if (!less(w, i, j))
+        return 0;
+    swap(w, i, j);
+    return 1;
+}
+
+static void min_sort_down(median_window_t *w, int i)
+{
+    for (; i <= MIN_CT(w); i *= 2)
+    {
+        if (i > 1 && i < MIN_CT(w) && less(w, i + 1, i))
+            i++;
+        if (!order(w, i, i / 2))
+            break;
+    }
+}
+
+static void max_sort_down(median_window_t *w, int i)
+{
+    for (; i >= -MAX_CT(w); i *= 2)
+    {
+        if (i < -1 && i > -MAX_CT(w) && less(w, i, i - 1))
+            i--;
+        if (!order(w, i / 2, i))
+            break;
+    }
+}
+
+// returns whether the value made it to the median
+static int min_sort_up(median_window_t *w, int i)
+{
+    while (i > 0 && order(w, i, i / 2))
+        i /= 2;
+    return i == 0;
+}
+
+static int max_sort_up(median_window_t *w, int i)
+{
+    while (i < 0 && order(w, i / 2, i))
+        i /= 2;
+    return i == 0;
+}
+
+// replace the oldest value by v, returns the median of the window
+static uint16_t window_push(median_window_t *w, uint16_t v)
+{
+    int fresh = w->ct < w->n;
+    int p = w->pos[w->idx];
+    uint16_t old = w->data[w->idx];
+    w->data[w->idx] = v;
+    if (++w->idx == w->n)
+        w->idx = 0;
+    w->ct += fresh;
+
+    if (p > 0)
+    {
+        if (!fresh && old < v)
+            min_sort_down(w, p * 2);
+        else if (min_sort_up(w, p))
+            max_sort_down(w, -1);
+    }
+    else if (p < 0)
+    {
+        if (!fresh && v < old)
+            max_sort_down(w, p * 2);
+        else if (max_sort_up(w, p))
+            min_sort_down(w, 1);
+    }
+    else
+    {
+        if (MAX_CT(w))
+            max_sort_down(w, -1);
+        if (MIN_CT(w))
+            min_sort_down(w, 1);
+    }
+
+    uint16_t m = w->data[HEAP(w, 0)];
+    // while filling the window may hold an even count
+    if ((w->ct & 1) == 0)
+        m = (m + w->data[HEAP(w, -1)] + 1) / 2;
+    return m;
+}
+
+int median_init(median_filter_t *f, median_type_t type, unsigned window, float k)
+{
+    if (type != MEDIAN_OFF && (window < 1 || window > MEDIAN_MAX_WINDOW || (window & 1) == 0))
+        return -1;
+    if (type == MEDIAN_HAMPEL && (k <= 0 || k * 1.4826f * 256 > UINT16_MAX))
+        return -1;
+
+    memset(f, 0, sizeof(median_filter_t));
+    f->type = type;
+    f->k_q8 = k * 1.4826f * 256 + 0.5f;
+    window_init(&f->values, type == MEDIAN_OFF ? 1 : window);
+    window_init(&f->deviations, type == MEDIAN_OFF ? 1 : window);
+    return 0;
+}
+
+void median_run(median_filter_t *f, uint16_t *v, size_t n)
+{
+    median_window_t *w = &f->values;
+
+    if (f->type == MEDIAN_PLAIN)
+    {
+        for (size_t i = 0; i < n; i++)
+            v[i] = window_push(w, v[i]);
+    }
+    else if (f->type == MEDIAN_HAMPEL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            uint16_t m = window_push(w, v[i]);
+            // the centre slot is still empty until the window fills, the median stands in
+            if (w->ct < w->n)
+            {
+                v[i] = m;
+                continue;
+            }
+            // the window centre, idx is the oldest slot now
+            int c = w->idx + w->n / 2;
+            uint16_t x = w->data[c >= w->n ? c - w->n : c];
+            uint16_t d = x > m ? x - m : m - x;
+            uint32_t mad = window_push(&f->deviations, d);
+
+            if (((uint32_t)d << 8) > f->k_q8 * (mad ? mad : 1))
+            {
+                v[i] = m;
+                f->outliers++;
+            }
+            else
+                v[i] = x;
+        }
+    }
+}
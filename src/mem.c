@@ -0,0 +1,143 @@
+#include "mem.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "esp_heap_caps.h"
+
+static const char *TAG = "mem";
+
+MEM_POOL(frame_pool, sizeof(frame_t), FRAME_POOL_SIZE);
+MEM_POOL(ws_pool, sizeof(ws_buf_t) + WS_BUF_SIZE, WS_POOL_SIZE);
+MEM_POOL(file_pool, FILE_BUF_SIZE, FILE_POOL_SIZE);
+
+static mem_pool_t *pools[] = {&frame_pool, &ws_pool, &file_pool};
+
+static StackType_t stack_arena[STACK_ARENA_SIZE] __attribute__((aligned(16)));
+static size_t stack_used = 0;
+
+static struct
+{
+    TaskHandle_t handle;
+    StaticTask_t tcb;
+    uint32_t stack_size;
+} tasks[MEM_TASKS_MAX];
+static int task_count = 0;
+
+static TaskHandle_t s_sample_task = NULL;
+static volatile uint32_t sample_allocs = 0;
+
+static void pool_init(mem_pool_t *pool)
+{
+    pool->free = xQueueCreateStatic(pool->count, sizeof(void *), pool->queue_storage, &pool->queue_buffer);
+    for (size_t i = 0; i < pool->count; i++)
+    {
+        void *block = pool->blocks + i * pool->block_size;
+        xQueueSend(pool->free, &block, 0);
+    }
+}
+
+void mem_init(void)
+{
+    for (int i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+        pool_init(pools[i]);
+}
+
+void *mem_pool_get(mem_pool_t *pool, TickType_t wait)
+{
+    void *block = NULL;
+    if (xQueueReceive(pool->free, &block, wait) != pdTRUE)
+    {
+        pool->fails++;
+        return NULL;
+    }
+
+    size_t used = pool->count - uxQueueMessagesWaiting(pool->free);
+    if (used > pool->peak)
+        pool->peak = used;
+    return block;
+}
+
+void mem_pool_put(mem_pool_t *pool, void *block)
+{
+    if (block != NULL)
+        xQueueSend(pool->free, &block, 0);
+}
+
+void *IRAM_ATTR mem_pool_get_from_isr(mem_pool_t *pool, BaseType_t *woken)
+{
+    void *block = NULL;
+    if (xQueueReceiveFromISR(pool->free, &block, woken) != pdTRUE)
+    {
+        pool->fails++;
+        return NULL;
+    }
+
+    size_t used = pool->count - uxQueueMessagesWaitingFromISR(pool->free);
+    if (used > pool->peak)
+        pool->peak = used;
+    return block;
+}
+
+void IRAM_ATTR mem_pool_put_from_isr(mem_pool_t *pool, void *block, BaseType_t *woken)
+{
+    if (block != NULL)
+        xQueueSendFromISR(pool->free, &block, woken);
+}
+
+TaskHandle_t mem_task_create(TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg, UBaseType_t prio, BaseType_t core)
+{
+    stack_size = (stack_size + 15) & ~15;
+    if (task_count >= MEM_TASKS_MAX || stack_used + stack_size > STACK_ARENA_SIZE)
+    {
+        // the plan in mem.h is wrong, fail loudly at boot rather than later
+        ESP_LOGE(TAG, "No room for task %s (%" PRIu32 " bytes), arena %zu/%d", name, stack_size, stack_used, STACK_ARENA_SIZE);
+        abort();
+    }
+
+    tasks[task_count].stack_size = stack_size;
+    tasks[task_count].handle = xTaskCreateStaticPinnedToCore(fn, name, stack_size, arg, prio,
+                                                             &stack_arena[stack_used], &tasks[task_count].tcb, core);
+    stack_used += stack_size;
+    return tasks[task_count++].handle;
+}
+
+void mem_sample_path_begin(void)
+{
+    s_sample_task = xTaskGetCurrentTaskHandle();
+}
+
+void mem_sample_path_end(void)
+{
+    s_sample_task = NULL;
+}
+
+#if CONFIG_HEAP_USE_HOOKS
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (s_sample_task != NULL && !xPortInIsrContext() && xTaskGetCurrentTaskHandle() == s_sample_task)
+        sample_allocs++;
+}
+#endif
+
+void mem_report(void)
+{
+    for (int i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+    {
+        mem_pool_t *p = pools[i];
+        ESP_LOGI(TAG, "pool %-10s %5zu x %2zu, in use %2zu, peak %2zu, fails %" PRIu32, p->name, p->block_size, p->count,
+                 p->count - uxQueueMessagesWaiting(p->free), p->peak, p->fails);
+    }
+
+    for (int i = 0; i < task_count; i++)
+        ESP_LOGI(TAG, "task %-14s stack %5" PRIu32 ", unused %5u", pcTaskGetName(tasks[i].handle), tasks[i].stack_size,
+                 (unsigned)uxTaskGetStackHighWaterMark(tasks[i].handle));
+
+    ESP_LOGI(TAG, "heap free %zu, min %zu, largest %zu", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+#if CONFIG_HEAP_USE_HOOKS
+    if (sample_allocs > 0)
+        ESP_LOGE(TAG, "%" PRIu32 " allocations on the sample path", sample_allocs);
+#endif
+}
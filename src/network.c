@@ -8,21 +8,42 @@
 */
 #include "main.h"
 
+#include <inttypes.h>
+#include <stdlib.h>
+
 #include "esp_system.h"
-#include "esp_wifi.h"
 #include "esp_event.h"
 #include "nvs_flash.h"
-#include "esp_mac.h"
+#include "esp_timer.h"
 
+// the Linux build runs on the host's network and clock
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_wifi.h"
+#include "esp_mac.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
 #include "esp_netif.h"
+#include "esp_netif_sntp.h"
+#endif
 
 #include <esp_http_server.h>
 
-#include "esp_spiffs.h"
-
-#include "driver/uart.h"
+#include "mem.h"
+
+#include "capture.h"
+#include "wire.h"
+#include "trigger.h"
+#include "adc.h"
+#include "segment.h"
+#include "mask.h"
+#include "record.h"
+#include "caplog.h"
+#include "trend.h"
+#include "export.h"
+#include "udp.h"
+#include "wired.h"
+#include "trace.h"
+#include "storage.h"
 
 /* The examples use WiFi configuration that you can set via project configuration menu
 
@@ -39,10 +60,14 @@
 #define AP_ESP_WIFI_CHANNEL 1
 #define AP_MAX_STA_CONN 5
 
+#define HOST_HTTP_PORT 8080 // Linux build, 80 needs root
+
+#if !CONFIG_IDF_TARGET_LINUX
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
 /* esp netif object representing the WIFI station */
 static esp_netif_t *sta_netif = NULL;
+#endif
 
 #define PAGE_ROOT "/"
 /* The event group allows multiple bits for each event, but we only care about two events:
@@ -59,15 +84,35 @@ static const char *TAGH = "httpd";
 
 static int s_retry_num = 0;
 
-char buf[CONFIG_LWIP_TCP_MSS];
+int64_t timeout_begin;
 
-size_t buf_len;
+static TaskHandle_t s_net_task = NULL;
 
-int64_t timeout_begin;
+// text commands from WS clients, handled in wifi_task
+#define NET_CMD_MAX 64
+#define NET_CMD_QUEUE 4
 
-bool need_ws_send = false;
+typedef struct
+{
+    httpd_handle_t hd;
+    int fd;
+    char text[NET_CMD_MAX];
+} net_cmd_t;
+
+static QueueHandle_t cmd_queue;
+static StaticQueue_t cmd_queue_buffer;
+static uint8_t cmd_queue_storage[NET_CMD_QUEUE * sizeof(net_cmd_t)];
 
-bool restart = false;
+// frame to wire latency, from the last sample of a frame to its send returning
+#define NET_REPORT_MS 10000
+
+static struct
+{
+    int64_t min, max, sum;
+    uint32_t count;
+    uint32_t dropped; // frames not sent, no buffer or httpd queue full
+} latency;
+static portMUX_TYPE s_latency_lock = portMUX_INITIALIZER_UNLOCKED;
 
 typedef struct
 {
@@ -75,6 +120,7 @@ typedef struct
     char content[32];
 } down_data_t;
 
+#if !CONFIG_IDF_TARGET_LINUX
 static void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
@@ -222,10 +268,10 @@ esp_err_t wifi_init_sta(void)
     vEventGroupDelete(s_wifi_event_group);
     return ret_value;
 }
+#endif
 
-static esp_err_t download_get_handler(httpd_req_t *req)
+static esp_err_t send_file(httpd_req_t *req, const char *filepath, const char *content)
 {
-    char *filepath = ((down_data_t *)(req->user_ctx))->filepath;
     FILE *fd = NULL;
     struct stat file_stat;
 
@@ -237,9 +283,12 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+
     fd = fopen(filepath, "r");
     if (!fd)
     {
+        mem_pool_put(&file_pool, buf);
         ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
@@ -248,7 +297,7 @@ static esp_err_t download_get_handler(httpd_req_t *req)
 
     ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filepath, file_stat.st_size);
 
-    httpd_resp_set_type(req, ((down_data_t *)(req->user_ctx))->content);
+    httpd_resp_set_type(req, content);
     int l = strlen(filepath);
     if (filepath[l - 3] == '.' && filepath[l - 2] == 'g' && filepath[l - 1] == 'z')
         httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
@@ -258,7 +307,7 @@ static esp_err_t download_get_handler(httpd_req_t *req)
     do
     {
         // memset(buf, 0, sizeof(buf));
-        chunksize = fread(buf, 1, sizeof(buf), fd);
+        chunksize = fread(buf, 1, FILE_BUF_SIZE, fd);
         // printf("fread %d\n", chunksize);
 
         if (chunksize > 0)
@@ -267,6 +316,7 @@ static esp_err_t download_get_handler(httpd_req_t *req)
             if (httpd_resp_send_chunk(req, buf, chunksize) != ESP_OK)
             {
                 fclose(fd);
+                mem_pool_put(&file_pool, buf);
                 ESP_LOGE(TAG, "File %s sending failed!", filepath);
                 /* Abort sending file */
                 httpd_resp_sendstr_chunk(req, NULL);
@@ -279,12 +329,351 @@ static esp_err_t download_get_handler(httpd_req_t *req)
 
     /* Close file after sending complete */
     fclose(fd);
+    mem_pool_put(&file_pool, buf);
     // ESP_LOGI(TAG, "File sending complete");
 
     httpd_resp_sendstr_chunk(req, NULL);
     return ESP_OK;
 };
 
+static esp_err_t download_get_handler(httpd_req_t *req)
+{
+    const down_data_t *d = req->user_ctx;
+    return send_file(req, d->filepath, d->content);
+}
+
+// GET /events/<file>, recorded event windows (record.h)
+static esp_err_t event_file_get_handler(httpd_req_t *req)
+{
+    const char *name = req->uri + strlen("/events/");
+    char filepath[32];
+    if (strchr(name, '/') != NULL || strchr(name, '?') != NULL ||
+        snprintf(filepath, sizeof(filepath), RECORD_DIR "/%s", name) >= sizeof(filepath))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad file name");
+        return ESP_FAIL;
+    }
+    return send_file(req, filepath, "application/octet-stream");
+}
+
+/*
+ * GET /capture?ch=0&t0=<us>&t1=<us>&n=<points>
+ * Min/max of n equal slices of [t0, t1] from the capture memory, times are esp_timer microseconds.
+ * Without t1 the newest sample is used, without t0 the last second.
+ */
+static esp_err_t capture_get_handler(httpd_req_t *req)
+{
+    char query[96];
+    char param[24];
+    int ch = 0;
+    int n = 1000;
+    int64_t t0 = 0, t1 = 0;
+    bool has_t0 = false, has_t1 = false;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "ch", param, sizeof(param)) == ESP_OK)
+            ch = atoi(param);
+        if (httpd_query_key_value(query, "n", param, sizeof(param)) == ESP_OK)
+            n = atoi(param);
+        if (httpd_query_key_value(query, "t0", param, sizeof(param)) == ESP_OK)
+        {
+            t0 = strtoll(param, NULL, 10);
+            has_t0 = true;
+        }
+        if (httpd_query_key_value(query, "t1", param, sizeof(param)) == ESP_OK)
+        {
+            t1 = strtoll(param, NULL, 10);
+            has_t1 = true;
+        }
+    }
+
+    if (ch < 0 || ch >= CAPTURE_CHANNELS || n <= 0 || n > 65536)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad ch or n");
+        return ESP_FAIL;
+    }
+
+    uint64_t first = capture_first(ch);
+    uint64_t head = capture_head(ch);
+    uint64_t i1 = has_t1 ? capture_index(ch, t1) : head;
+    uint32_t rate = capture_get_rate(ch);
+    uint64_t i0 = has_t0 ? capture_index(ch, t0) : (i1 > rate ? i1 - rate : 0);
+    if (i1 > head)
+        i1 = head;
+    if (i0 < first)
+        i0 = first;
+    if (i0 > i1)
+        i0 = i1;
+
+    capture_query_hdr_t hdr = {
+        .t0 = capture_time(ch, i0),
+        .t1 = capture_time(ch, i1),
+        .first = capture_time(ch, first),
+        .last = capture_time(ch, head - 1),
+        .points = n,
+        .channel = ch,
+    };
+    float scale, offset;
+    capture_get_format(ch, &scale, &offset);
+    hdr.scale = scale;
+    hdr.offset = offset;
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    if (httpd_resp_send_chunk(req, (const char *)&hdr, sizeof(hdr)) != ESP_OK)
+        return ESP_FAIL;
+
+    // points are computed straight into the chunk buffer, one chunk at a time
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+    capture_minmax_t *mm = (capture_minmax_t *)buf;
+    const int chunk = FILE_BUF_SIZE / sizeof(capture_minmax_t);
+    uint64_t span = i1 - i0;
+    for (int j = 0; j < n;)
+    {
+        int k = 0;
+        for (; k < chunk && j < n; k++, j++)
+            capture_minmax(ch, i0 + span * j / n, i0 + span * (j + 1) / n, &mm[k]);
+
+        if (httpd_resp_send_chunk(req, buf, k * sizeof(capture_minmax_t)) != ESP_OK)
+        {
+            mem_pool_put(&file_pool, buf);
+            ESP_LOGE(TAG, "Capture query sending failed!");
+            httpd_resp_sendstr_chunk(req, NULL);
+            return ESP_FAIL;
+        }
+    }
+
+    mem_pool_put(&file_pool, buf);
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+/*
+ * POST /mask, body mask_hdr_t followed by `bins` capture_minmax_t limits (mask.h)
+ */
+static esp_err_t mask_post_handler(httpd_req_t *req)
+{
+    const size_t max = sizeof(mask_hdr_t) + MASK_BINS * sizeof(capture_minmax_t);
+    if (req->content_len < sizeof(mask_hdr_t) || req->content_len > max)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad mask size");
+        return ESP_FAIL;
+    }
+
+    static uint8_t body[sizeof(mask_hdr_t) + MASK_BINS * sizeof(capture_minmax_t)];
+    size_t got = 0;
+    while (got < req->content_len)
+    {
+        int r = httpd_req_recv(req, (char *)body + got, req->content_len - got);
+        if (r == HTTPD_SOCK_ERR_TIMEOUT)
+            continue;
+        if (r <= 0)
+            return ESP_FAIL;
+        got += r;
+    }
+
+    mask_hdr_t hdr;
+    memcpy(&hdr, body, sizeof(hdr));
+    if (req->content_len != sizeof(mask_hdr_t) + hdr.bins * sizeof(capture_minmax_t))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad mask size");
+        return ESP_FAIL;
+    }
+    capture_minmax_t *limits = (capture_minmax_t *)(body + sizeof(mask_hdr_t));
+    esp_err_t err = mask_set(&hdr, limits);
+    if (err != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr(req, "OK");
+    return ESP_OK;
+}
+
+static bool caplog_send_block(const caplog_block_t *block, const uint8_t *data, void *arg)
+{
+    httpd_req_t *req = arg;
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+    wire_frame_hdr_t *h = (wire_frame_hdr_t *)buf;
+    wire_channel_hdr_t *ch = (wire_channel_hdr_t *)(buf + sizeof(*h));
+    uint16_t *v = (uint16_t *)(buf + sizeof(*h) + sizeof(*ch));
+
+    size_t n = caplog_decode(block, data, v, (FILE_BUF_SIZE - sizeof(*h) - sizeof(*ch)) / sizeof(uint16_t));
+    *h = (wire_frame_hdr_t){.magic = WIRE_MAGIC, .version = WIRE_VERSION, .channels = 1};
+    *ch = (wire_channel_hdr_t){
+        .channel = block->channel,
+        .bits = 16,
+        .count = n,
+        .period_ns = block->period_ns,
+        .t0 = block->t0,
+        .scale = block->scale,
+        .offset = block->offset,
+    };
+    bool ok = httpd_resp_send_chunk(req, buf, sizeof(*h) + sizeof(*ch) + n * sizeof(uint16_t)) == ESP_OK;
+    mem_pool_put(&file_pool, buf);
+    return ok;
+}
+
+/*
+ * GET /caplog, the flash log oldest first as one channel wire frames,
+ * every bin is a min and a max sample (caplog.h)
+ */
+static esp_err_t caplog_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/octet-stream");
+    if (caplog_read(caplog_send_block, req) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No capture log");
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static esp_err_t trace_send(const char *data, size_t len, void *arg)
+{
+    return httpd_resp_send_chunk(arg, data, len);
+}
+
+/*
+ * GET /trace, the pipeline trace rings as Chrome trace JSON (trace.h),
+ * open in chrome://tracing or ui.perfetto.dev
+ */
+static esp_err_t trace_get_handler(httpd_req_t *req)
+{
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.json\"");
+    esp_err_t err = trace_export(trace_send, req, buf, FILE_BUF_SIZE);
+    mem_pool_put(&file_pool, buf);
+    if (err == ESP_OK)
+        httpd_resp_sendstr_chunk(req, NULL);
+    return err;
+}
+
+static bool trend_send_points(const trend_point_t *p, size_t n, void *arg)
+{
+    return httpd_resp_send_chunk(arg, (const char *)p, n * sizeof(*p)) == ESP_OK;
+}
+
+/*
+ * GET /trend?ch=0&t0=<s>&t1=<s>&n=<points>, or span=<s> instead of t0
+ * Rollups of [t0, t1] in unix seconds at the coarsest resolution with at least n points
+ * that still reaches back to t0. Without t1 up to now, without t0 the last hour.
+ */
+static esp_err_t trend_get_handler(httpd_req_t *req)
+{
+    char query[96];
+    char param[24];
+    int ch = 0;
+    int n = 1000;
+    uint32_t t1 = trend_now();
+    uint32_t t0 = t1 - 3600;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "ch", param, sizeof(param)) == ESP_OK)
+            ch = atoi(param);
+        if (httpd_query_key_value(query, "n", param, sizeof(param)) == ESP_OK)
+            n = atoi(param);
+        if (httpd_query_key_value(query, "t1", param, sizeof(param)) == ESP_OK)
+            t1 = strtoul(param, NULL, 10);
+        if (httpd_query_key_value(query, "span", param, sizeof(param)) == ESP_OK)
+        {
+            uint32_t span = strtoul(param, NULL, 10);
+            t0 = span < t1 ? t1 - span : 0;
+        }
+        if (httpd_query_key_value(query, "t0", param, sizeof(param)) == ESP_OK)
+            t0 = strtoul(param, NULL, 10);
+    }
+
+    if (ch < 0 || ch >= CAPTURE_CHANNELS || n <= 0 || n > TREND_MAX_POINTS || t0 > t1)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad ch, n or range");
+        return ESP_FAIL;
+    }
+
+    int level = trend_level(ch, t0, t1, n);
+    trend_query_hdr_t hdr = {
+        .now = trend_now(),
+        .resolution = trend_resolution(level),
+        .channel = ch,
+    };
+    httpd_resp_set_type(req, "application/octet-stream");
+    if (httpd_resp_send_chunk(req, (const char *)&hdr, sizeof(hdr)) != ESP_OK)
+        return ESP_FAIL;
+    trend_read(ch, level, t0, t1, trend_send_points, req);
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static export_stats_t s_export;
+
+static esp_err_t export_send(const char *data, size_t len, void *arg)
+{
+    return httpd_resp_send_chunk(arg, data, len);
+}
+
+/*
+ * GET /export?fmt=csv|wav|raw&ch=0,1&t0=<us>&t1=<us>
+ * The capture of [t0, t1) converted on the fly (export.h). Without t1 up to the
+ * newest sample, without t0 the last second.
+ */
+static esp_err_t export_get_handler(httpd_req_t *req)
+{
+    char query[96];
+    char param[24];
+    export_req_t r = {.format = EXPORT_CSV, .channels = 1};
+    bool has_t0 = false;
+
+    r.t1 = capture_time(0, capture_head(0));
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "fmt", param, sizeof(param)) == ESP_OK &&
+            export_parse_format(param, &r.format) != ESP_OK)
+        {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad fmt");
+            return ESP_FAIL;
+        }
+        if (httpd_query_key_value(query, "ch", param, sizeof(param)) == ESP_OK)
+        {
+            r.channels = 0;
+            for (char *p = param; *p; p++)
+                if (*p >= '0' && *p < '0' + CAPTURE_CHANNELS)
+                    r.channels |= 1 << (*p - '0');
+        }
+        if (httpd_query_key_value(query, "t1", param, sizeof(param)) == ESP_OK)
+            r.t1 = strtoll(param, NULL, 10);
+        if (httpd_query_key_value(query, "t0", param, sizeof(param)) == ESP_OK)
+        {
+            r.t0 = strtoll(param, NULL, 10);
+            has_t0 = true;
+        }
+    }
+    if (!has_t0)
+        r.t0 = r.t1 - 1000000;
+
+    static const char *const ext[] = {"csv", "wav", "bin"};
+    char disposition[48];
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"capture.%s\"", ext[r.format]);
+    httpd_resp_set_type(req, export_content_type(r.format));
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+
+    // conversion goes straight into the chunk buffer
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+    export_stats_t stats;
+    esp_err_t err = export_run(&r, export_send, req, buf, FILE_BUF_SIZE, &stats);
+    mem_pool_put(&file_pool, buf);
+    if (err == ESP_ERR_INVALID_ARG || err == ESP_ERR_INVALID_STATE)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad ch or range");
+        return ESP_FAIL;
+    }
+    s_export = stats;
+    httpd_resp_sendstr_chunk(req, NULL);
+    return err;
+}
+
 httpd_handle_t ws_hd;
 int ws_fd = 0;
 
@@ -304,6 +693,155 @@ static void ws_async_send(char *msg)
     httpd_ws_send_frame_async(ws_hd, ws_fd, &ws_pkt);
 }
 
+/*
+ * binary frame send, runs in the httpd task through httpd_queue_work, returns the buffer to ws_pool
+ */
+static void ws_send_work(void *arg)
+{
+    ws_buf_t *wb = arg;
+    if (wb->text)
+    {
+        httpd_ws_frame_t ws_pkt = {
+            .final = true,
+            .payload = wb->data,
+            .len = wb->len,
+            .type = HTTPD_WS_TYPE_TEXT,
+        };
+        httpd_ws_send_frame_async(ws_hd, wb->fd, &ws_pkt);
+    }
+    else if (ws_fd > 0)
+    {
+        httpd_ws_frame_t ws_pkt = {
+            .final = true,
+            .fragmented = false,
+            .payload = wb->data,
+            .len = wb->len,
+            .type = HTTPD_WS_TYPE_BINARY,
+        };
+        trace(TRACE_WS_SEND, TRACE_BEGIN, wb->seq);
+        esp_err_t err = httpd_ws_send_frame_async(ws_hd, ws_fd, &ws_pkt);
+        trace(TRACE_WS_SEND, TRACE_END, wb->seq);
+        if (err == ESP_OK)
+        {
+            int64_t l = esp_timer_get_time() - wb->stamp;
+            trace_latency(wb->seq, l);
+            taskENTER_CRITICAL(&s_latency_lock);
+            if (latency.count == 0 || l < latency.min)
+                latency.min = l;
+            if (latency.count == 0 || l > latency.max)
+                latency.max = l;
+            latency.sum += l;
+            latency.count++;
+            taskEXIT_CRITICAL(&s_latency_lock);
+        }
+        else
+        {
+            ESP_LOGW(TAGH, "WS client %d gone", ws_fd);
+            ws_fd = 0;
+        }
+    }
+    mem_pool_put(&ws_pool, wb);
+}
+
+// time the newest sample of the frame was taken, us
+static int64_t frame_end_time(const frame_t *frame)
+{
+    int64_t t = 0;
+    for (int c = 0; c < frame->channels; c++)
+    {
+        int64_t e = frame->t0[c] + (int64_t)(frame->count[c] - 1) * frame->period_ns[c] / 1000;
+        if (e > t)
+            t = e;
+    }
+    return t;
+}
+
+// see wire.h for the layout
+size_t ws_encode_frame(const frame_t *frame, uint8_t *out)
+{
+    wire_frame_hdr_t *h = (wire_frame_hdr_t *)out;
+    h->magic = WIRE_MAGIC;
+    h->version = WIRE_VERSION;
+    h->channels = 0;
+    h->seq = frame->seq;
+    h->trigger = frame->trigger >= 0 ? frame->trigger + 1 : 0;
+    h->trigger_channel = frame->trigger_channel;
+    h->reserved = 0;
+
+    uint8_t *p = out + sizeof(wire_frame_hdr_t);
+    for (int c = 0; c < frame->channels; c++)
+    {
+        // unused derived slots
+        if (frame->count[c] == 0 && c >= FRAME_INPUTS)
+            continue;
+
+        wire_channel_hdr_t *ch = (wire_channel_hdr_t *)p;
+        ch->channel = c;
+        ch->bits = frame->bits[c];
+        ch->count = frame->count[c];
+        ch->period_ns = frame->period_ns[c];
+        ch->t0 = frame->t0[c];
+        ch->scale = frame->scale[c];
+        ch->offset = frame->offset[c];
+        p += sizeof(wire_channel_hdr_t);
+        h->channels++;
+
+        if (wire_width(frame->bits[c]) == 2)
+        {
+            memcpy(p, frame_samples(frame, c), frame->count[c] * sizeof(uint16_t));
+            p += frame->count[c] * sizeof(uint16_t);
+            continue;
+        }
+        const uint32_t *v = frame_samples32(frame, c);
+        for (int i = 0; i < frame->count[c]; i++)
+        {
+            *p++ = v[i];
+            *p++ = v[i] >> 8;
+            *p++ = v[i] >> 16;
+        }
+    }
+    return p - out;
+}
+
+// mask failures to the streaming client, they are dropped without one
+static void ws_send_masks(void)
+{
+    const mask_record_t *r;
+    while (mask_peek(&r))
+    {
+        if (ws_fd > 0)
+        {
+            ws_buf_t *wb = mem_pool_get(&ws_pool, 0);
+            if (wb == NULL)
+                return; // retried with the next frame
+
+            wire_frame_hdr_t h = {
+                .magic = WIRE_MAGIC,
+                .version = WIRE_VERSION,
+                .channels = 1,
+                .seq = r->test,
+                .trigger = r->trigger,
+                .trigger_channel = r->hdr.channel,
+            };
+            uint8_t *p = wb->data;
+            memcpy(p, &h, sizeof(h));
+            p += sizeof(h);
+            memcpy(p, &r->hdr, sizeof(r->hdr));
+            p += sizeof(r->hdr);
+            memcpy(p, r->samples, r->hdr.count * sizeof(uint16_t));
+            p += r->hdr.count * sizeof(uint16_t);
+            wb->len = p - wb->data;
+            wb->stamp = esp_timer_get_time();
+            wb->seq = r->test;
+            wb->fd = 0;
+            wb->text = false;
+            if (httpd_queue_work(ws_hd, ws_send_work, wb) != ESP_OK)
+                mem_pool_put(&ws_pool, wb);
+        }
+        mask_release();
+    }
+}
+
 static esp_err_t ws_handler(httpd_req_t *req)
 {
     if (req->method == HTTP_GET)
@@ -312,35 +850,212 @@ static esp_err_t ws_handler(httpd_req_t *req)
         return ESP_OK;
     }
 
-    uint8_t bf[160] = {0};
+    ws_buf_t *bf = mem_pool_get(&ws_pool, 0);
+    if (bf == NULL)
+        return ESP_ERR_NO_MEM;
+
     httpd_ws_frame_t ws_pkt;
     memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.payload = bf;
+    memset(bf->data, 0, WS_BUF_SIZE);
+    ws_pkt.payload = bf->data;
     ws_pkt.type = HTTPD_WS_TYPE_TEXT;
-    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, sizeof(bf));
+    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, WS_BUF_SIZE - 1);
     if (ret != ESP_OK)
     {
+        mem_pool_put(&ws_pool, bf);
         ESP_LOGE(TAGH, "httpd_ws_recv_frame failed with %d", ret);
         return ret;
     }
     ESP_LOGI(TAGH, "Got packet with message: \"%s\"", ws_pkt.payload);
     ESP_LOGI(TAGH, "Packet type: %d", ws_pkt.type);
 
-    ws_hd = req->handle;
-    ws_fd = httpd_req_to_sockfd(req);
-    ESP_LOGI(TAGH, "ws_hd/fd: %d/%d", *(int *)ws_hd, ws_fd);
-
-    if (strcmp("open ws", (const char *)ws_pkt.payload) == 0)
-        need_ws_send = true;
+    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT)
+    {
+        net_cmd_t cmd = {.hd = req->handle, .fd = httpd_req_to_sockfd(req)};
+        strlcpy(cmd.text, (const char *)ws_pkt.payload, sizeof(cmd.text));
+        if (xQueueSend(cmd_queue, &cmd, 0) == pdTRUE)
+            net_notify(NET_CMD);
+        else
+            ESP_LOGW(TAGH, "Command queue full, \"%s\" dropped", cmd.text);
+    }
 
+    mem_pool_put(&ws_pool, bf);
     return ret;
 }
 
+// text reply to the client a command came from
+static void net_reply(const net_cmd_t *cmd, const char *text)
+{
+    ws_buf_t *wb = mem_pool_get(&ws_pool, 0);
+    if (wb == NULL)
+        return;
+    wb->len = strlcpy((char *)wb->data, text, WS_BUF_SIZE);
+    wb->fd = cmd->fd;
+    wb->text = true;
+    if (httpd_queue_work(cmd->hd, ws_send_work, wb) != ESP_OK)
+        mem_pool_put(&ws_pool, wb);
+}
+
+// text is `word` alone or followed by arguments
+static bool net_is(const char *text, const char *word)
+{
+    size_t n = strlen(word);
+    return strncmp(text, word, n) == 0 && (text[n] == ' ' || text[n] == 0);
+}
+
+static void net_command(const net_cmd_t *cmd)
+{
+    char reply[128];
+    esp_err_t err;
+
+    if (strcmp("open ws", cmd->text) == 0)
+    {
+        // the client wants the sample stream
+        ws_hd = cmd->hd;
+        ws_fd = cmd->fd;
+        ESP_LOGI(TAGH, "ws_hd/fd: %d/%d", *(int *)ws_hd, ws_fd);
+    }
+    else if (strncmp("trigger ", cmd->text, 8) == 0)
+    {
+        if (trigger_command(cmd->text) != ESP_OK)
+            ESP_LOGW(TAGH, "Bad trigger \"%s\"", cmd->text);
+    }
+    else if (net_is(cmd->text, "udp") || net_is(cmd->text, "wired"))
+    {
+        if (cmd->text[0] == 'u')
+            err = udp_command(cmd->text, reply, sizeof(reply));
+        else
+            err = wired_command(cmd->text, reply, sizeof(reply));
+        if (err != ESP_OK)
+            snprintf(reply, sizeof(reply), "%s: %s", cmd->text, esp_err_to_name(err));
+        if (reply[0])
+            net_reply(cmd, reply);
+    }
+    else if ((err = adc_command(cmd->text, reply, sizeof(reply))) != ESP_ERR_NOT_FOUND)
+    {
+        if (err != ESP_OK)
+            snprintf(reply, sizeof(reply), "%s: %s", cmd->text, esp_err_to_name(err));
+        if (reply[0])
+            net_reply(cmd, reply);
+    }
+    else if (strcmp("export", cmd->text) == 0)
+    {
+        snprintf(reply, sizeof(reply), "export: %" PRIu64 " bytes in %" PRId64 " us, %.2f MB/s, %" PRIu32 " samples lost", s_export.bytes,
+                 s_export.us, s_export.us > 0 ? (double)s_export.bytes / s_export.us : 0.0, s_export.lost);
+        net_reply(cmd, reply);
+    }
+    else if (strcmp("restart", cmd->text) == 0)
+    {
+#if !CONFIG_IDF_TARGET_LINUX
+        esp_wifi_stop();
+#endif
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+    else
+        ESP_LOGW(TAGH, "Unknown command \"%s\"", cmd->text);
+}
+
+void net_notify(uint32_t events)
+{
+    if (s_net_task != NULL)
+        xTaskNotify(s_net_task, events, eSetBits);
+}
+
+static void net_report(void)
+{
+    taskENTER_CRITICAL(&s_latency_lock);
+    typeof(latency) l = latency;
+    memset(&latency, 0, sizeof(latency));
+    taskEXIT_CRITICAL(&s_latency_lock);
+
+    if (l.count > 0)
+        ESP_LOGI(TAG, "frame to wire: %" PRIu32 " frames, latency min %" PRId64 ", avg %" PRId64 ", max %" PRId64 " us, dropped %" PRIu32,
+                 l.count, l.min, l.sum / l.count, l.max, l.dropped);
+    else if (l.dropped > 0)
+        ESP_LOGI(TAG, "frame to wire: nothing sent, dropped %" PRIu32, l.dropped);
+}
+
+// finished segments as wire frames, seq is the segment index; ?from=&n= for a part of them
+static esp_err_t segments_get_handler(httpd_req_t *req)
+{
+    char query[64];
+    char param[16];
+    unsigned from = 0;
+    unsigned n = SEGMENT_MAX;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "from", param, sizeof(param)) == ESP_OK)
+            from = strtoul(param, NULL, 10);
+        if (httpd_query_key_value(query, "n", param, sizeof(param)) == ESP_OK)
+            n = strtoul(param, NULL, 10);
+    }
+
+    uint32_t generation = segment_generation();
+    unsigned filled = segment_filled();
+    unsigned to = from + n < filled ? from + n : filled;
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    for (unsigned k = from; k < to; k++)
+    {
+        segment_t seg;
+        esp_err_t err = segment_get(k, &seg);
+        if (err == ESP_ERR_INVALID_STATE || segment_generation() != generation)
+        {
+            ESP_LOGW(TAG, "Segments rearmed while sending");
+            return ESP_FAIL;
+        }
+        if (err != ESP_OK)
+            break;
+
+        wire_frame_hdr_t fh = {
+            .magic = WIRE_MAGIC,
+            .version = WIRE_VERSION,
+            .channels = seg.channels,
+            .seq = k,
+            .trigger = seg.pre + 1,
+            .trigger_channel = seg.trigger_channel,
+        };
+        if (httpd_resp_send_chunk(req, (const char *)&fh, sizeof(fh)) != ESP_OK)
+            return ESP_FAIL;
+        for (int c = 0; c < seg.channels; c++)
+        {
+            const segment_channel_t *ch = &seg.ch[c];
+            wire_channel_hdr_t hdr = {
+                .channel = ch->channel,
+                .bits = 16,
+                .count = ch->count,
+                .period_ns = ch->period_ns,
+                .t0 = ch->t0,
+                .scale = ch->scale,
+                .offset = ch->offset,
+            };
+            if (httpd_resp_send_chunk(req, (const char *)&hdr, sizeof(hdr)) != ESP_OK ||
+                httpd_resp_send_chunk(req, (const char *)ch->samples, ch->count * sizeof(uint16_t)) != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Segments sending failed!");
+                return ESP_FAIL;
+            }
+        }
+
+        // rearmed while sending, what went out may be overwritten: fail rather than end the reply cleanly
+        if (segment_generation() != generation)
+        {
+            ESP_LOGW(TAG, "Segments rearmed while sending");
+            return ESP_FAIL;
+        }
+    }
+
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
 static const httpd_uri_t root = {
     .uri = "/",
     .method = HTTP_GET,
     .handler = download_get_handler,
-    .user_ctx = &((down_data_t){.filepath = "/spiffs/index.html", .content = "text/html"}),
+    .user_ctx = &((down_data_t){.filepath = STORAGE_DIR "/index.html", .content = "text/html"}),
     .is_websocket = false};
 
 static const httpd_uri_t ws = {
@@ -354,14 +1069,77 @@ static const httpd_uri_t d3_get = {
     .uri = "/d3",
     .method = HTTP_GET,
     .handler = download_get_handler,
-    .user_ctx = &((down_data_t){.filepath = "/spiffs/D3.html", .content = "text/html"}),
+    .user_ctx = &((down_data_t){.filepath = STORAGE_DIR "/D3.html", .content = "text/html"}),
     .is_websocket = false};
 
 static const httpd_uri_t d3_get_gz = {
     .uri = "/d3.min.js",
     .method = HTTP_GET,
     .handler = download_get_handler,
-    .user_ctx = &((down_data_t){.filepath = "/spiffs/d3.min.js.gz", .content = "application/javascript"}),
+    .user_ctx = &((down_data_t){.filepath = STORAGE_DIR "/d3.min.js.gz", .content = "application/javascript"}),
+    .is_websocket = false};
+
+static const httpd_uri_t events_get = {
+    .uri = "/events",
+    .method = HTTP_GET,
+    .handler = download_get_handler,
+    .user_ctx = &((down_data_t){.filepath = RECORD_INDEX, .content = "text/csv"}),
+    .is_websocket = false};
+
+static const httpd_uri_t event_file_get = {
+    .uri = "/events/*",
+    .method = HTTP_GET,
+    .handler = event_file_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t trace_get = {
+    .uri = "/trace",
+    .method = HTTP_GET,
+    .handler = trace_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t caplog_get = {
+    .uri = "/caplog",
+    .method = HTTP_GET,
+    .handler = caplog_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t trend_get = {
+    .uri = "/trend",
+    .method = HTTP_GET,
+    .handler = trend_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t export_get = {
+    .uri = "/export",
+    .method = HTTP_GET,
+    .handler = export_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t capture_get = {
+    .uri = "/capture",
+    .method = HTTP_GET,
+    .handler = capture_get_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t mask_post = {
+    .uri = "/mask",
+    .method = HTTP_POST,
+    .handler = mask_post_handler,
+    .user_ctx = NULL,
+    .is_websocket = false};
+
+static const httpd_uri_t segments_get = {
+    .uri = "/segments",
+    .method = HTTP_GET,
+    .handler = segments_get_handler,
+    .user_ctx = NULL,
     .is_websocket = false};
 
 static httpd_handle_t start_webserver(void)
@@ -371,6 +1149,11 @@ static httpd_handle_t start_webserver(void)
     // config.max_open_sockets = 2;
     // config.stack_size = 1024 * 10;
     config.lru_purge_enable = true;
+    config.max_uri_handlers = 16;
+    config.uri_match_fn = httpd_uri_match_wildcard;
+#if CONFIG_IDF_TARGET_LINUX
+    config.server_port = HOST_HTTP_PORT;
+#endif
     // config.send_wait_timeout = 30;
     // config.recv_wait_timeout = 30;
     // config.task_priority = 6;
@@ -385,7 +1168,17 @@ static httpd_handle_t start_webserver(void)
         httpd_register_uri_handler(server, &ws);
         httpd_register_uri_handler(server, &d3_get);
         httpd_register_uri_handler(server, &d3_get_gz);
-
+        httpd_register_uri_handler(server, &capture_get);
+        httpd_register_uri_handler(server, &segments_get);
+        httpd_register_uri_handler(server, &mask_post);
+        httpd_register_uri_handler(server, &events_get);
+        httpd_register_uri_handler(server, &event_file_get);
+        httpd_register_uri_handler(server, &caplog_get);
+        httpd_register_uri_handler(server, &trend_get);
+        httpd_register_uri_handler(server, &export_get);
+        httpd_register_uri_handler(server, &trace_get);
+
+        ws_hd = server;
         ws_fd = 0;
 
         return server;
@@ -397,6 +1190,9 @@ static httpd_handle_t start_webserver(void)
 
 void wifi_task(void *arg)
 {
+#if CONFIG_IDF_TARGET_LINUX
+    ESP_LOGI(TAG, "Files from %s", STORAGE_DIR);
+#else
     ESP_LOGI("SPIFFS", "Initializing SPIFFS");
     esp_vfs_spiffs_conf_t conf = {
         .base_path = "/spiffs",
@@ -434,10 +1230,22 @@ void wifi_task(void *arg)
     {
         ESP_LOGI("SPIFFS", "Partition size: total: %d, used: %d", total, used);
     }
+#endif
 
     int wifi_on = 1;
 
+    cmd_queue = xQueueCreateStatic(NET_CMD_QUEUE, sizeof(net_cmd_t), cmd_queue_storage, &cmd_queue_buffer);
+    s_net_task = xTaskGetCurrentTaskHandle();
+
+#if !CONFIG_IDF_TARGET_LINUX
     esp_err_t e = wifi_init_sta();
+    if (e == ESP_OK)
+    {
+        // wall clock for the trend store
+        esp_sntp_config_t sntp = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
+        esp_netif_sntp_init(&sntp);
+    }
+#endif
     // if (e == ESP_OK)
     // vTaskDelay(5000 / portTICK_PERIOD_MS);
     // else
@@ -446,53 +1254,82 @@ void wifi_task(void *arg)
     /* Start the server for the first time */
     start_webserver();
 
-    uint32_t ret_num = 0;
-    uint8_t buffer_adc_data[BLOCK];
-
-    uint32_t sum = 0;
-    uint32_t num = 0;
+    int64_t report = esp_timer_get_time();
 
     while (1)
     {
-        ret = 0;
-        if ((ret == ESP_OK || ret == ESP_ERR_INVALID_STATE) && ret_num > 0)
+        // sleep until there is work, wake up at least for the periodic report
+        int64_t wait_ms = NET_REPORT_MS - (esp_timer_get_time() - report) / 1000;
+        uint32_t events = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &events, wait_ms > 0 ? pdMS_TO_TICKS(wait_ms) : 0);
+
+        if (events & NET_CMD)
         {
-            if (ws_fd > 0)
-            {
-                httpd_ws_frame_t ws_pkt = {
-                    .final = true,
-                    .fragmented = false,
-                    .payload = buffer_adc_data,
-                    .len = ret_num,
-                    .type = HTTPD_WS_TYPE_BINARY,
-                };
-                httpd_ws_send_frame_async(ws_hd, ws_fd, &ws_pkt);
-            }
-            /*
-                        adc_digi_output_data_t *p = (void *)buffer_adc_data;
+            net_cmd_t cmd;
+            while (xQueueReceive(cmd_queue, &cmd, 0) == pdTRUE)
+                net_command(&cmd);
+        }
 
-                        while ((uint8_t *)p < buffer_adc_data + ret_num)
-                        {
-                            sum += p->type1.data;
-                            num++;
-                            if (num == 10)
-                            {
-                                uint8_t r = (sum / num) >> (12 - 5);
-                                xQueueSend(ui_queue, &r, 0);
-                                num = 0;
-                                sum = 0;
-                            }
-                            p++;
-                        }*/
-        };
+        if (events & (NET_FRAME | NET_MASK))
+            ws_send_masks();
 
-        if (restart == true)
+        if (events & NET_FRAME)
         {
-            esp_wifi_stop();
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-            esp_restart();
+            frame_t *frame;
+            while (xQueueReceive(adc_queue, &frame, 0) == pdTRUE)
+            {
+                // mask_only() keeps the frames from the browser, not from the datagrams or the cable
+                bool ws = ws_fd > 0 && !mask_only();
+                if (ws || udp_active() || wired_active())
+                {
+                    ws_buf_t *wb = mem_pool_get(&ws_pool, 0);
+                    if (wb != NULL)
+                    {
+                        trace(TRACE_ENCODE, TRACE_BEGIN, frame->seq);
+                        wb->len = ws_encode_frame(frame, wb->data);
+                        trace(TRACE_ENCODE, TRACE_END, frame->seq);
+                        wb->stamp = frame_end_time(frame);
+                        wb->seq = frame->seq;
+                        // datagrams and the cable get it right away, ahead of the WS copy
+                        if (udp_active())
+                        {
+                            trace(TRACE_UDP, TRACE_BEGIN, frame->seq);
+                            udp_send_frame(wb->data, wb->len, frame->seq, wb->stamp);
+                            trace(TRACE_UDP, TRACE_END, frame->seq);
+                        }
+                        if (wired_active())
+                        {
+                            trace(TRACE_WIRED, TRACE_BEGIN, frame->seq);
+                            wired_send_frame(wb->data, wb->len);
+                            trace(TRACE_WIRED, TRACE_END, frame->seq);
+                        }
+                        wb->fd = 0;
+                        wb->text = false;
+                        if (!ws)
+                            mem_pool_put(&ws_pool, wb);
+                        else if (httpd_queue_work(ws_hd, ws_send_work, wb) != ESP_OK)
+                        {
+                            mem_pool_put(&ws_pool, wb);
+                            wb = NULL;
+                        }
+                        else
+                            trace(TRACE_WS_QUEUE, TRACE_INSTANT, frame->seq);
+                    }
+                    if (wb == NULL)
+                    {
+                        taskENTER_CRITICAL(&s_latency_lock);
+                        latency.dropped++;
+                        taskEXIT_CRITICAL(&s_latency_lock);
+                    }
+                }
+                mem_pool_put(&frame_pool, frame);
+            }
         }
 
-        vTaskDelay(1);
+        if (esp_timer_get_time() - report >= NET_REPORT_MS * 1000)
+        {
+            net_report();
+            report = esp_timer_get_time();
+        }
     }
 }
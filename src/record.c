@@ -0,0 +1,368 @@
+#include "main.h"
+#include "record.h"
+#include "capture.h"
+#include "wire.h"
+#include "mem.h"
+#include "storage.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+static const char *TAG = "record";
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// samples per written frame, one file_pool block each
+#define RECORD_CHUNK ((FILE_BUF_SIZE - sizeof(wire_frame_hdr_t) - sizeof(wire_channel_hdr_t)) / sizeof(uint16_t))
+
+typedef struct
+{
+    int64_t t0, t1; // us
+    uint8_t sources;
+    uint16_t events;
+} record_window_t;
+
+static struct
+{
+    bool on;
+    int64_t pre, post; // us
+    uint8_t channels;
+    uint8_t sources; // enabled event sources
+    int64_t since;   // when recording was switched on, us
+    record_window_t windows[RECORD_WINDOWS];
+    unsigned head, tail; // windows[tail] is the oldest, windows[head - 1] still takes events
+    int64_t written_until;
+    uint32_t events, dropped;
+} s;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// level events, under s_lock
+static struct
+{
+    int channel; // -1 off
+    uint16_t lo, hi;
+} s_level = {.channel = -1};
+static bool s_outside = false;
+
+// written by record_task
+static uint64_t s_bytes;
+static uint32_t s_files, s_full;
+static TaskHandle_t s_task = NULL;
+
+esp_err_t record_set(uint32_t pre_ms, uint32_t post_ms, uint8_t channels)
+{
+    if (channels == 0 || channels >= 1 << CAPTURE_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+    taskENTER_CRITICAL(&s_lock);
+    s.pre = (int64_t)pre_ms * 1000;
+    s.post = (int64_t)post_ms * 1000;
+    s.channels = channels;
+    if (!s.on)
+    {
+        s.since = esp_timer_get_time();
+        s.written_until = 0;
+        s.events = s.dropped = 0;
+    }
+    s.on = true;
+    s.sources |= RECORD_MANUAL;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+void record_off(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s.on = false;
+    s.head = s.tail = 0;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void record_event(int64_t t, uint8_t source)
+{
+    taskENTER_CRITICAL(&s_lock);
+    if (!s.on || !(s.sources & source))
+    {
+        taskEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    s.events++;
+    int64_t t0 = MAX(t - s.pre, s.written_until);
+    int64_t t1 = t + s.post;
+    record_window_t *last = s.head != s.tail ? &s.windows[(s.head - 1) % RECORD_WINDOWS] : NULL;
+    if (last != NULL && t0 <= last->t1)
+    {
+        last->t1 = MAX(last->t1, t1);
+        last->sources |= source;
+        last->events++;
+    }
+    else if (s.head - s.tail == RECORD_WINDOWS)
+        s.dropped++;
+    else
+        s.windows[s.head++ % RECORD_WINDOWS] = (record_window_t){.t0 = t0, .t1 = t1, .sources = source, .events = 1};
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (s_task != NULL)
+        xTaskNotifyGive(s_task);
+}
+
+void record_scan(const frame_t *frame, const double *t_first, double period)
+{
+    if (frame->trigger >= 0 && frame->trigger_channel < FRAME_INPUTS)
+        record_event(llround(t_first[frame->trigger_channel] + frame->trigger * period), RECORD_TRIGGER);
+
+    taskENTER_CRITICAL(&s_lock);
+    int ch = s_level.channel;
+    uint16_t lo = s_level.lo, hi = s_level.hi;
+    taskEXIT_CRITICAL(&s_lock);
+    if (ch < 0 || ch >= frame->channels)
+        return;
+
+    // an event when the signal leaves the range, the next one after it came back
+    const uint16_t *v = frame_samples(frame, ch);
+    for (int i = 0; i < frame->count[ch]; i++)
+    {
+        bool outside = v[i] < lo || v[i] > hi;
+        if (outside && !s_outside)
+            record_event(llround(t_first[ch] + i * period), RECORD_LEVEL);
+        s_outside = outside;
+    }
+}
+
+// the oldest window, once the capture holds all of it and no event can extend it any more
+static bool take_window(record_window_t *w, uint8_t *channels)
+{
+    while (1)
+    {
+        bool taken = false;
+        taskENTER_CRITICAL(&s_lock);
+        if (s.on && s.head != s.tail)
+        {
+            *w = s.windows[s.tail % RECORD_WINDOWS];
+            *channels = s.channels;
+            taken = true;
+        }
+        taskEXIT_CRITICAL(&s_lock);
+        if (!taken)
+            return false;
+
+        for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        {
+            uint64_t head = capture_head(c);
+            if ((*channels & (1 << c)) && (head == 0 || capture_time(c, head - 1) < w->t1))
+                return false;
+        }
+
+        // an event in between may have extended the window past what was checked
+        taskENTER_CRITICAL(&s_lock);
+        taken = s.on && s.head != s.tail && s.windows[s.tail % RECORD_WINDOWS].t1 == w->t1;
+        if (taken)
+        {
+            *w = s.windows[s.tail % RECORD_WINDOWS];
+            s.tail++;
+            s.written_until = w->t1;
+        }
+        taskEXIT_CRITICAL(&s_lock);
+        if (taken)
+            return true;
+    }
+}
+
+static uint32_t next_id(void)
+{
+    FILE *f = fopen(RECORD_INDEX, "r");
+    if (f == NULL)
+        return 0;
+    uint32_t n = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF)
+        if (c == '\n')
+            n++;
+    fclose(f);
+    return n;
+}
+
+static size_t write_channel(FILE *f, int c, const record_window_t *w, uint32_t *seq, char *buf)
+{
+    uint64_t first = capture_first(c);
+    uint64_t i0 = MAX(capture_index(c, w->t0), first);
+    uint64_t i1 = capture_index(c, w->t1);
+    float scale, offset;
+    capture_get_format(c, &scale, &offset);
+    uint32_t rate = capture_get_rate(c);
+
+    size_t bytes = 0;
+    for (uint64_t i = i0; i < i1;)
+    {
+        wire_frame_hdr_t *h = (wire_frame_hdr_t *)buf;
+        wire_channel_hdr_t *ch = (wire_channel_hdr_t *)(buf + sizeof(*h));
+        uint16_t *samples = (uint16_t *)(buf + sizeof(*h) + sizeof(*ch));
+
+        // the writer may fall behind the capture, what is gone is gone
+        i = MAX(i, capture_first(c));
+        if (i >= i1)
+            break;
+        size_t n = capture_read(c, i, samples, MIN(RECORD_CHUNK, i1 - i));
+        if (n == 0)
+            break;
+        *h = (wire_frame_hdr_t){
+            .magic = WIRE_MAGIC,
+            .version = WIRE_VERSION,
+            .channels = 1,
+            .seq = (*seq)++,
+        };
+        *ch = (wire_channel_hdr_t){
+            .channel = c,
+            .bits = 16,
+            .count = n,
+            .period_ns = 1000000000ull / rate,
+            .t0 = capture_time(c, i),
+            .scale = scale,
+            .offset = offset,
+        };
+        size_t len = sizeof(*h) + sizeof(*ch) + n * sizeof(uint16_t);
+        if (fwrite(buf, 1, len, f) != len)
+            break;
+        bytes += len;
+        i += n;
+    }
+    return bytes;
+}
+
+static void write_window(const record_window_t *w, uint8_t channels)
+{
+    static uint32_t id = UINT32_MAX;
+    if (id == UINT32_MAX)
+        id = next_id();
+
+    // rough size, samples of every channel
+    size_t need = 0;
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        if (channels & (1 << c))
+            need += (w->t1 - w->t0) * capture_get_rate(c) / 1000000 * sizeof(uint16_t);
+    size_t total = 0, used = 0;
+    if (esp_spiffs_info(NULL, &total, &used) != ESP_OK || (used + need) * 100 > total * RECORD_FULL_PERCENT)
+    {
+        s_full++;
+        ESP_LOGW(TAG, "No room for %zu bytes, event at %" PRId64 " us not written", need, w->t0);
+        return;
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), RECORD_DIR "/ev%05" PRIu32 ".osc", id);
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return;
+    }
+    char *buf = mem_pool_get(&file_pool, portMAX_DELAY);
+    uint32_t seq = 0;
+    size_t bytes = 0;
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        if (channels & (1 << c))
+            bytes += write_channel(f, c, w, &seq, buf);
+    mem_pool_put(&file_pool, buf);
+    fclose(f);
+
+    f = fopen(RECORD_INDEX, "a");
+    if (f != NULL)
+    {
+        fprintf(f, "%" PRIu32 ",%" PRId64 ",%" PRId64 ",%d,%zu\n", id, w->t0, w->t1, w->sources, bytes);
+        fclose(f);
+    }
+    ESP_LOGI(TAG, "%s: %d events, %" PRId64 " us, %zu bytes", path, w->events, w->t1 - w->t0, bytes);
+    id++;
+    s_files++;
+    s_bytes += bytes;
+}
+
+void record_task(void *arg)
+{
+    s_task = xTaskGetCurrentTaskHandle();
+    while (1)
+    {
+        // events notify, the post window needs the time to pass
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+        record_window_t w;
+        uint8_t channels;
+        while (take_window(&w, &channels))
+            write_window(&w, channels);
+    }
+}
+
+esp_err_t record_command(const char *cmd, char *reply, size_t len)
+{
+    unsigned pre, post, channels = (1 << FRAME_INPUTS) - 1;
+    int ch, lo, hi;
+    char arg[8];
+
+    if (strcmp(cmd, "event") == 0)
+    {
+        record_event(esp_timer_get_time(), RECORD_MANUAL);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "record") == 0)
+    {
+        taskENTER_CRITICAL(&s_lock);
+        typeof(s) r = s;
+        taskEXIT_CRITICAL(&s_lock);
+
+        // what writing everything since record on would have taken
+        uint64_t continuous = 0;
+        if (r.on)
+            for (int c = 0; c < CAPTURE_CHANNELS; c++)
+                if (r.channels & (1 << c))
+                    continuous += (esp_timer_get_time() - r.since) * capture_get_rate(c) / 1000000 * sizeof(uint16_t);
+        snprintf(reply, len, "record %s: %" PRIu32 " events, %" PRIu32 " files, %" PRIu64 " bytes, %" PRIu64 " saved, %" PRIu32 " dropped, %" PRIu32 " full",
+                 r.on ? "on" : "off", r.events, s_files, s_bytes, continuous > s_bytes ? continuous - s_bytes : 0,
+                 r.dropped, s_full);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "record off") == 0)
+    {
+        record_off();
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "record level off") == 0)
+    {
+        taskENTER_CRITICAL(&s_lock);
+        s_level.channel = -1;
+        s.sources &= ~RECORD_LEVEL;
+        taskEXIT_CRITICAL(&s_lock);
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "record level %d %d %d", &ch, &lo, &hi) == 3)
+    {
+        if (ch < 0 || ch >= FRAME_INPUTS || lo < 0 || hi < lo || hi > UINT16_MAX)
+            return ESP_ERR_INVALID_ARG;
+        taskENTER_CRITICAL(&s_lock);
+        s_level.channel = ch;
+        s_level.lo = lo;
+        s_level.hi = hi;
+        s.sources |= RECORD_LEVEL;
+        taskEXIT_CRITICAL(&s_lock);
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "record trigger %7s", arg) == 1 || sscanf(cmd, "record mask %7s", arg) == 1)
+    {
+        uint8_t source = strncmp(cmd, "record trigger", 14) == 0 ? RECORD_TRIGGER : RECORD_MASK;
+        if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)
+            return ESP_ERR_INVALID_ARG;
+        taskENTER_CRITICAL(&s_lock);
+        if (strcmp(arg, "on") == 0)
+            s.sources |= source;
+        else
+            s.sources &= ~source;
+        taskEXIT_CRITICAL(&s_lock);
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "record on %u %u %x", &pre, &post, &channels) >= 2)
+        return record_set(pre, post, channels);
+    return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,281 @@
+#include "main.h"
+#include "segment.h"
+#include "trigger.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+
+static const char *TAG = "segment";
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct
+{
+    int64_t trigger;
+    int64_t start, end; // window, us
+    uint32_t dead_us;
+    uint16_t pre;
+    uint8_t trigger_channel;
+    uint8_t mask; // channels with data
+    segment_t seg;
+} segment_info_t;
+
+static uint8_t *s_mem = NULL;
+static size_t s_mem_size = 0;
+
+// set by segment_arm, taken over by adc_dma_task
+static struct
+{
+    bool request;
+    bool armed;
+    unsigned n, len, pre;
+} s_req;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// owned by adc_dma_task, filled and generation also read by others
+static struct
+{
+    bool armed;
+    unsigned n, len, pre;
+    segment_info_t *info;
+    uint16_t *samples; // n x CAPTURE_CHANNELS x len
+    volatile unsigned filled;
+    unsigned accepted;
+    volatile uint32_t generation;
+    bool edge_armed;
+    bool dead; // between the end of a window and the trigger being ready again
+    int64_t hold_until;
+    uint32_t missed;
+    uint32_t dead_min, dead_max;
+    uint64_t dead_sum;
+} seg;
+
+esp_err_t segment_init(void)
+{
+    s_mem_size = SEGMENT_PSRAM_BYTES;
+    s_mem = heap_caps_malloc(s_mem_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (s_mem == NULL)
+    {
+        s_mem_size = SEGMENT_INTERNAL_BYTES;
+        s_mem = heap_caps_malloc(s_mem_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (s_mem == NULL)
+    {
+        s_mem_size = 0;
+        ESP_LOGE(TAG, "No memory for segments");
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "%zu bytes for segments", s_mem_size);
+    return ESP_OK;
+}
+
+esp_err_t segment_arm(unsigned n, unsigned len, unsigned pre)
+{
+    if (n == 0 || n > SEGMENT_MAX || len == 0 || len > UINT16_MAX || pre >= len)
+        return ESP_ERR_INVALID_ARG;
+    if (n * (sizeof(segment_info_t) + CAPTURE_CHANNELS * len * sizeof(uint16_t)) > s_mem_size)
+        return ESP_ERR_NO_MEM;
+
+    taskENTER_CRITICAL(&s_lock);
+    s_req.request = true;
+    s_req.armed = true;
+    s_req.n = n;
+    s_req.len = len;
+    s_req.pre = pre;
+    taskEXIT_CRITICAL(&s_lock);
+    return ESP_OK;
+}
+
+void segment_disarm(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_req.request = true;
+    s_req.armed = false;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+static void take_request(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    bool request = s_req.request;
+    s_req.request = false;
+    bool armed = s_req.armed;
+    unsigned n = s_req.n, len = s_req.len, pre = s_req.pre;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (!request)
+        return;
+
+    seg.generation++;
+    seg.armed = false;
+    seg.filled = 0;
+    seg.accepted = 0;
+    if (!armed)
+        return;
+
+    seg.n = n;
+    seg.len = len;
+    seg.pre = pre;
+    seg.info = (segment_info_t *)s_mem;
+    seg.samples = (uint16_t *)(s_mem + n * sizeof(segment_info_t));
+    seg.edge_armed = false;
+    seg.dead = false;
+    seg.hold_until = 0;
+    seg.missed = 0;
+    seg.dead_min = UINT32_MAX;
+    seg.dead_max = 0;
+    seg.dead_sum = 0;
+    seg.armed = true;
+    ESP_LOGI(TAG, "armed: %d segments of %d samples, %d before the trigger", n, len, pre);
+}
+
+void segment_scan(const frame_t *frame, const double *t_first, double period)
+{
+    take_request();
+    if (!seg.armed || seg.accepted >= seg.n)
+        return;
+
+    trigger_t t;
+    trigger_get(&t);
+    if (t.slope == TRIGGER_OFF || t.channel >= FRAME_INPUTS)
+        return;
+
+    const uint16_t *samples = frame_samples(frame, t.channel);
+    size_t n = frame->count[t.channel];
+    double t0 = t_first[t.channel];
+    for (size_t i = 0; i < n; i++)
+    {
+        int64_t ti = llround(t0 + i * period);
+        bool fired = trigger_step(&t, &seg.edge_armed, samples[i]);
+
+        if (seg.dead && ti >= seg.hold_until && (seg.edge_armed || fired))
+        {
+            seg.dead = false;
+            uint32_t dead = ti - seg.hold_until;
+            seg.info[seg.accepted].dead_us = dead;
+        }
+        if (!fired)
+            continue;
+        if (seg.dead || ti < seg.hold_until || seg.accepted >= seg.n)
+        {
+            seg.missed++;
+            continue;
+        }
+
+        segment_info_t *s = &seg.info[seg.accepted];
+        if (seg.accepted == 0)
+            s->dead_us = 0;
+        else
+        {
+            // with the segment, so the statistics cover accepted - 1 gaps
+            seg.dead_min = MIN(seg.dead_min, s->dead_us);
+            seg.dead_max = MAX(seg.dead_max, s->dead_us);
+            seg.dead_sum += s->dead_us;
+        }
+        s->trigger = ti;
+        s->start = llround(t0 + (i - (double)seg.pre) * period);
+        s->end = llround(t0 + (i + (double)(seg.len - seg.pre)) * period);
+        s->pre = seg.pre;
+        s->trigger_channel = t.channel;
+        s->mask = 0;
+        for (int c = 0; c < frame->channels && c < CAPTURE_CHANNELS; c++)
+            if (frame->count[c] > 0)
+                s->mask |= 1 << c;
+
+        seg.accepted++;
+        seg.hold_until = s->end;
+        seg.dead = true;
+        // all taken, there is no info[n] for the dead time of another
+        if (seg.accepted == seg.n)
+            break;
+    }
+}
+
+void segment_collect(void)
+{
+    while (seg.armed && seg.filled < seg.accepted)
+    {
+        segment_info_t *s = &seg.info[seg.filled];
+        uint64_t i0[CAPTURE_CHANNELS];
+        size_t count[CAPTURE_CHANNELS];
+
+        // all of the window has to be in the capture
+        for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        {
+            if (!(s->mask & (1 << c)))
+                continue;
+            uint32_t rate = capture_get_rate(c);
+            i0[c] = MAX(capture_index(c, s->start), capture_first(c));
+            count[c] = MIN(seg.len, (size_t)((s->end - s->start) * rate / 1000000));
+            if (capture_head(c) < i0[c] + count[c])
+                return;
+        }
+
+        segment_t *out = &s->seg;
+        out->trigger = s->trigger;
+        out->dead_us = s->dead_us;
+        out->pre = s->pre;
+        out->trigger_channel = s->trigger_channel;
+        out->channels = 0;
+        for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        {
+            if (!(s->mask & (1 << c)))
+                continue;
+            uint16_t *dst = seg.samples + ((size_t)seg.filled * CAPTURE_CHANNELS + c) * seg.len;
+            segment_channel_t *ch = &out->ch[out->channels++];
+            ch->channel = c;
+            ch->count = capture_read(c, i0[c], dst, count[c]);
+            ch->period_ns = 1000000000ull / capture_get_rate(c);
+            ch->t0 = capture_time(c, i0[c]);
+            capture_get_format(c, &ch->scale, &ch->offset);
+            ch->samples = dst;
+        }
+        seg.filled++;
+    }
+}
+
+unsigned segment_filled(void)
+{
+    return seg.filled;
+}
+
+uint32_t segment_generation(void)
+{
+    return seg.generation;
+}
+
+esp_err_t segment_get(unsigned k, segment_t *out)
+{
+    uint32_t generation = seg.generation;
+    if (k >= seg.filled)
+        return ESP_ERR_NOT_FOUND;
+    *out = seg.info[k].seg;
+    // rearmed during the copy, it may be half a new one
+    return seg.generation == generation ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t segment_command(const char *cmd, char *reply, size_t len)
+{
+    unsigned n, length, pre = 0;
+    if (strcmp(cmd, "segments off") == 0)
+    {
+        segment_disarm();
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "segments") == 0)
+    {
+        unsigned filled = seg.filled, accepted = seg.accepted;
+        snprintf(reply, len, "segments %d/%d, missed %" PRIu32 ", dead time min %" PRIu32 " us, mean %.1f us, max %" PRIu32 " us",
+                 filled, seg.armed ? seg.n : 0, seg.missed, accepted > 1 ? seg.dead_min : 0,
+                 accepted > 1 ? (double)seg.dead_sum / (accepted - 1) : 0.0, seg.dead_max);
+        return ESP_OK;
+    }
+    if (sscanf(cmd, "segments %u %u %u", &n, &length, &pre) < 2)
+        return ESP_ERR_INVALID_ARG;
+    return segment_arm(n, length, pre);
+}
@@ -0,0 +1,72 @@
+#include "timebase.h"
+
+#include <math.h>
+
+// wide loop while locking, then narrow to average out ISR latency
+#define LOCK_BANDWIDTH 2.0
+#define TRACK_BANDWIDTH 0.05
+#define LOCK_FRAMES 1000
+
+// a raw timestamp further than this many frames off the prediction restarts the loop
+#define MAX_ERROR_FRAMES 4
+
+void timebase_init(timebase_t *tb, uint32_t sample_freq_hz)
+{
+    tb->nominal = 1e6 / sample_freq_hz;
+    tb->period = tb->nominal;
+    tb->t = 0;
+    tb->bandwidth = LOCK_BANDWIDTH;
+    tb->err_rms = 0;
+    tb->frames = 0;
+    tb->resets = 0;
+}
+
+double timebase_update(timebase_t *tb, int64_t t_raw, uint32_t conversions)
+{
+    double span = conversions * tb->period;
+
+    if (tb->frames == 0)
+    {
+        tb->t = t_raw;
+        tb->frames++;
+        return tb->t;
+    }
+
+    double predicted = tb->t + span;
+    double e = t_raw - predicted;
+
+    if (fabs(e) > MAX_ERROR_FRAMES * span)
+    {
+        // lost frames or a stalled task, the old phase means nothing now
+        tb->t = t_raw;
+        tb->frames = 1;
+        tb->bandwidth = LOCK_BANDWIDTH;
+        tb->resets++;
+        return tb->t;
+    }
+
+    if (tb->frames == LOCK_FRAMES)
+        tb->bandwidth = TRACK_BANDWIDTH;
+
+    // loop gains for the current update interval
+    double omega = 2 * M_PI * tb->bandwidth * span * 1e-6;
+    double b = M_SQRT2 * omega;
+    double c = omega * omega;
+
+    tb->t = predicted + b * e;
+    tb->period += c * e / conversions;
+    tb->err_rms = sqrt(0.99 * tb->err_rms * tb->err_rms + 0.01 * e * e);
+    tb->frames++;
+
+    return tb->t;
+}
+
+double timebase_rate(const timebase_t *tb)
+{
+    return 1e6 / tb->period;
+}
+
+double timebase_ppm(const timebase_t *tb)
+{
+    return (tb->nominal / tb->period - 1) * 1e6;
+}
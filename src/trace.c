@@ -0,0 +1,202 @@
+#include "trace.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#define trace_core() 0 // the simulator schedules on one core
+#else
+#include "esp_cpu.h"
+#define trace_core() esp_cpu_get_core_id()
+#endif
+
+static const char *TAG = "trace";
+
+#define TRACE_EVENT_JSON 320 // longest event with its flow step
+
+typedef struct
+{
+    int64_t t; // us
+    uint32_t seq;
+    uint8_t stage;
+    uint8_t phase;
+} trace_event_t;
+
+typedef struct
+{
+    uint32_t head; // events ever written
+    trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+static const char *const names[TRACE_STAGES] = {
+    [TRACE_ISR] = "dma isr",
+    [TRACE_TRIGGER] = "trigger",
+    [TRACE_RECEIVE] = "receive",
+    [TRACE_FILTER] = "filter",
+    [TRACE_ANALYSIS] = "analysis",
+    [TRACE_CAPTURE] = "capture",
+    [TRACE_QUEUE] = "queue",
+    [TRACE_ENCODE] = "encode",
+    [TRACE_UDP] = "udp",
+    [TRACE_WIRED] = "wired",
+    [TRACE_WS_QUEUE] = "ws queue",
+    [TRACE_WS_SEND] = "ws send",
+    [TRACE_OLED] = "oled",
+};
+
+volatile bool trace_on = false;
+
+// internal RAM, the ISR writes here
+static trace_ring_t s_rings[portNUM_PROCESSORS];
+
+static int64_t s_late_us = 0;
+static bool s_late_hit = false;
+static uint32_t s_late_seq;
+static int64_t s_late_latency;
+
+void IRAM_ATTR trace_write(trace_stage_t stage, trace_phase_t phase, uint32_t seq)
+{
+    int64_t t = esp_timer_get_time();
+    trace_ring_t *r = &s_rings[trace_core()];
+    // an ISR on this core that comes in between takes the next slot
+    uint32_t i = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *e = &r->events[i % TRACE_EVENTS];
+    e->t = t;
+    e->seq = seq;
+    e->stage = stage;
+    e->phase = phase;
+}
+
+void trace_latency(uint32_t seq, int64_t us)
+{
+    if (!trace_on || s_late_us == 0 || us <= s_late_us)
+        return;
+    trace_on = false;
+    s_late_hit = true;
+    s_late_seq = seq;
+    s_late_latency = us;
+    ESP_LOGW(TAG, "Frame %" PRIu32 " took %" PRId64 " us, tracing stopped", seq, us);
+}
+
+// flow arrows follow a frame from the ISR to the WS send across cores
+static char flow_phase(const trace_event_t *e)
+{
+    if (e->phase != TRACE_BEGIN || e->stage == TRACE_TRIGGER || e->stage == TRACE_OLED)
+        return 0;
+    if (e->stage == TRACE_ISR)
+        return 's';
+    if (e->stage == TRACE_WS_SEND)
+        return 'f';
+    return 't';
+}
+
+esp_err_t trace_export(trace_sink_t sink, void *arg, char *buf, size_t len)
+{
+    // writers are quiet while the rings are read
+    bool was_on = trace_on;
+    trace_on = false;
+    vTaskDelay(1);
+
+    esp_err_t err = ESP_OK;
+    size_t used = snprintf(buf, len, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first = true;
+    for (int core = 0; core < portNUM_PROCESSORS && err == ESP_OK; core++)
+    {
+        if (len - used < TRACE_EVENT_JSON)
+        {
+            err = sink(buf, used, arg);
+            used = 0;
+        }
+        used += snprintf(buf + used, len - used, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                                                 "\"args\":{\"name\":\"core %d\"}}",
+                         first ? "" : ",", core, core);
+        first = false;
+
+        const trace_ring_t *r = &s_rings[core];
+        uint32_t head = r->head;
+        for (uint32_t i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head && err == ESP_OK; i++)
+        {
+            const trace_event_t *e = &r->events[i % TRACE_EVENTS];
+            if (e->stage >= TRACE_STAGES)
+                continue;
+
+            if (len - used < TRACE_EVENT_JSON)
+            {
+                err = sink(buf, used, arg);
+                used = 0;
+            }
+            used += snprintf(buf + used, len - used, ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRId64 ",\"pid\":1,\"tid\":%d%s",
+                             names[e->stage], e->phase, e->t, core, e->phase == TRACE_INSTANT ? ",\"s\":\"t\"" : "");
+            if (e->stage != TRACE_OLED)
+                used += snprintf(buf + used, len - used, ",\"args\":{\"seq\":%" PRIu32 "}", e->seq);
+            used += snprintf(buf + used, len - used, "}");
+
+            char flow = flow_phase(e);
+            if (flow)
+                used += snprintf(buf + used, len - used, ",{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%c\",\"id\":%" PRIu32 ","
+                                                         "\"ts\":%" PRId64 ",\"pid\":1,\"tid\":%d%s}",
+                                 flow, e->seq, e->t, core, flow == 'f' ? ",\"bp\":\"e\"" : "");
+        }
+    }
+    if (err == ESP_OK)
+    {
+        used += snprintf(buf + used, len - used, "]}");
+        err = sink(buf, used, arg);
+    }
+
+    trace_on = was_on;
+    return err;
+}
+
+esp_err_t trace_command(const char *cmd, char *reply, size_t len)
+{
+    long late = 0;
+
+    reply[0] = 0;
+    if (strcmp(cmd, "trace") == 0)
+    {
+        uint32_t events = 0;
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+            events += s_rings[core].head < TRACE_EVENTS ? s_rings[core].head : TRACE_EVENTS;
+        size_t n = snprintf(reply, len, "trace %s, %" PRIu32 " events", trace_on ? "on" : "off", events);
+        if (s_late_us > 0)
+            n += snprintf(reply + n, len - n, ", late over %" PRId64 " us", s_late_us);
+        if (s_late_hit)
+            snprintf(reply + n, len - n, ", stopped at frame %" PRIu32 " (%" PRId64 " us)", s_late_seq, s_late_latency);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "trace off") == 0)
+    {
+        trace_on = false;
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "trace clear") == 0)
+    {
+        bool was_on = trace_on;
+        trace_on = false;
+        vTaskDelay(1);
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+            s_rings[core].head = 0;
+        s_late_hit = false;
+        trace_on = was_on;
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "trace on") == 0 || sscanf(cmd, "trace on %ld", &late) == 1)
+    {
+        if (late < 0)
+            return ESP_ERR_INVALID_ARG;
+        s_late_us = late;
+        s_late_hit = false;
+        trace_on = true;
+        return ESP_OK;
+    }
+    return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,413 @@
+#include "main.h"
+#include "trend.h"
+#include "storage.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
+#include "nvs.h"
+
+static const char *TAG = "trend";
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TREND_MAGIC 0x444e5254 // "TRND"
+#define TREND_SYNCED 1600000000 // earlier clocks have not been set
+#define TREND_PENDING 64        // second points in RAM, more than a minute
+#define TREND_CHUNK 32
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint8_t level;
+    uint8_t channel;
+    uint16_t reserved;
+    uint32_t capacity;
+    uint32_t head; // next slot
+    uint32_t count;
+} trend_file_t;
+
+// value sums of the open point of a level
+typedef struct
+{
+    uint32_t t;
+    double min, max, sum, sumsq;
+    uint64_t n;
+} trend_acc_t;
+
+static const uint32_t s_res[TREND_LEVELS] = {1, 60, 3600};
+static const uint32_t s_cap[TREND_LEVELS] = {TREND_S_POINTS, TREND_MIN_POINTS, TREND_H_POINTS};
+
+static struct
+{
+    bool on;
+    uint64_t cursor;
+    trend_acc_t acc[TREND_LEVELS]; // acc[0] is not used, seconds are closed right away
+    trend_point_t pending[TREND_PENDING];
+    uint64_t pending_n[TREND_PENDING];
+    int npending;
+} tr[CAPTURE_CHANNELS];
+
+// files and pending points, trend_task against the queries
+static SemaphoreHandle_t s_mutex;
+static StaticSemaphore_t s_mutex_buffer;
+
+static volatile uint8_t s_channels;
+static uint32_t s_base; // unset clock: newest stored point, s
+static uint32_t s_written;
+
+uint32_t trend_now(void)
+{
+    time_t t = time(NULL);
+    if (t >= TREND_SYNCED)
+        return t;
+    return s_base + esp_timer_get_time() / 1000000;
+}
+
+uint32_t trend_resolution(int level)
+{
+    return s_res[level];
+}
+
+static void path(char *out, size_t len, int level, int channel)
+{
+    snprintf(out, len, TREND_DIR "/trend%d_%d.bin", level, channel);
+}
+
+// open the file of a level, a missing or foreign one is started over
+static FILE *open_file(int level, int channel, trend_file_t *h, bool create)
+{
+    char name[32];
+    path(name, sizeof(name), level, channel);
+    FILE *f = fopen(name, create ? "r+b" : "rb");
+    if (f != NULL && fread(h, sizeof(*h), 1, f) == 1 && h->magic == TREND_MAGIC && h->level == level &&
+        h->channel == channel && h->capacity == s_cap[level] && h->head < h->capacity && h->count <= h->capacity)
+        return f;
+    if (f != NULL)
+        fclose(f);
+    if (!create)
+        return NULL;
+
+    f = fopen(name, "w+b");
+    if (f == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create %s", name);
+        return NULL;
+    }
+    *h = (trend_file_t){.magic = TREND_MAGIC, .level = level, .channel = channel, .capacity = s_cap[level]};
+    fwrite(h, sizeof(*h), 1, f);
+    return f;
+}
+
+static bool read_point(FILE *f, const trend_file_t *h, uint32_t k, trend_point_t *p)
+{
+    uint32_t slot = (h->head + h->capacity - h->count + k) % h->capacity;
+    return fseek(f, sizeof(*h) + slot * sizeof(*p), SEEK_SET) == 0 && fread(p, sizeof(*p), 1, f) == 1;
+}
+
+static void write_points(int level, int channel, const trend_point_t *p, size_t n)
+{
+    if (n == 0)
+        return;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    trend_file_t h;
+    FILE *f = open_file(level, channel, &h, true);
+    if (f != NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            fseek(f, sizeof(h) + h.head * sizeof(*p), SEEK_SET);
+            if (fwrite(&p[i], sizeof(*p), 1, f) != 1)
+                break;
+            h.head = (h.head + 1) % h.capacity;
+            h.count = MIN(h.count + 1, h.capacity);
+            s_written++;
+        }
+        fseek(f, 0, SEEK_SET);
+        fwrite(&h, sizeof(h), 1, f);
+        fclose(f);
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+static void flush_pending(int c)
+{
+    write_points(0, c, tr[c].pending, tr[c].npending);
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    tr[c].npending = 0;
+    xSemaphoreGive(s_mutex);
+}
+
+static trend_point_t close_acc(const trend_acc_t *a)
+{
+    return (trend_point_t){
+        .t = a->t,
+        .min = a->min,
+        .max = a->max,
+        .mean = a->sum / a->n,
+        .rms = sqrt(a->sumsq / a->n),
+    };
+}
+
+static void emit(int c, int level, const trend_point_t *p, uint64_t n)
+{
+    if (level == 0)
+    {
+        if (tr[c].npending == TREND_PENDING)
+            flush_pending(c);
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        tr[c].pending[tr[c].npending] = *p;
+        tr[c].pending_n[tr[c].npending++] = n;
+        xSemaphoreGive(s_mutex);
+    }
+    else
+        write_points(level, c, p, 1);
+
+    if (level + 1 == TREND_LEVELS)
+        return;
+
+    // roll up into the next resolution, closing its point when p starts a new one
+    trend_acc_t *a = &tr[c].acc[level + 1];
+    uint32_t t = p->t - p->t % s_res[level + 1];
+    if (a->n > 0 && a->t != t)
+    {
+        trend_point_t up = close_acc(a);
+        uint64_t up_n = a->n;
+        a->n = 0;
+        // the seconds of a closed minute go to flash with it
+        if (level == 0)
+            flush_pending(c);
+        emit(c, level + 1, &up, up_n);
+    }
+    if (a->n == 0)
+        *a = (trend_acc_t){.t = t, .min = p->min, .max = p->max};
+    a->min = MIN(a->min, p->min);
+    a->max = MAX(a->max, p->max);
+    a->sum += (double)p->mean * n;
+    a->sumsq += (double)p->rms * p->rms * n;
+    a->n += n;
+}
+
+// every sample the capture got in the last second
+static void second(int c, uint32_t now)
+{
+    uint64_t head = capture_head(c);
+    uint64_t first = capture_first(c);
+    if (!tr[c].on)
+    {
+        tr[c].on = true;
+        tr[c].cursor = head;
+        return;
+    }
+    tr[c].cursor = MAX(tr[c].cursor, first);
+
+    uint16_t buf[256];
+    uint32_t mn = UINT16_MAX, mx = 0;
+    uint64_t sum = 0, sumsq = 0, n = 0;
+    while (tr[c].cursor < head)
+    {
+        size_t got = capture_read(c, tr[c].cursor, buf, MIN(head - tr[c].cursor, 256));
+        if (got == 0)
+            break;
+        for (size_t i = 0; i < got; i++)
+        {
+            uint32_t v = buf[i];
+            mn = MIN(mn, v);
+            mx = MAX(mx, v);
+            sum += v;
+            sumsq += v * v;
+        }
+        n += got;
+        tr[c].cursor += got;
+    }
+    if (n == 0)
+        return;
+
+    // samples to values, v = s * scale + offset
+    float scale, offset;
+    capture_get_format(c, &scale, &offset);
+    double ms = (double)scale * scale * sumsq / n + 2.0 * scale * offset * sum / n + (double)offset * offset;
+    trend_point_t p = {
+        .t = now - 1,
+        .min = MIN(mn * scale, mx * scale) + offset,
+        .max = MAX(mn * scale, mx * scale) + offset,
+        .mean = (double)sum / n * scale + offset,
+        .rms = sqrt(MAX(ms, 0)),
+    };
+    emit(c, 0, &p, n);
+}
+
+static uint32_t newest(int c, int level)
+{
+    trend_file_t h;
+    trend_point_t p;
+    FILE *f = open_file(level, c, &h, false);
+    uint32_t t = 0;
+    if (f != NULL && h.count > 0 && read_point(f, &h, h.count - 1, &p))
+        t = p.t + s_res[level];
+    if (f != NULL)
+        fclose(f);
+    return t;
+}
+
+void trend_task(void *arg)
+{
+    // the files live next to the web pages, wifi_task mounts them
+    while (!esp_spiffs_mounted(NULL))
+        vTaskDelay(pdMS_TO_TICKS(100));
+    s_mutex = xSemaphoreCreateMutexStatic(&s_mutex_buffer);
+
+    nvs_handle_t nvs;
+    uint8_t channels = 0;
+    if (nvs_open("trend", NVS_READONLY, &nvs) == ESP_OK)
+    {
+        nvs_get_u8(nvs, "channels", &channels);
+        nvs_close(nvs);
+    }
+    s_channels = channels;
+
+    // until SNTP sets the clock, carry on after the newest stored point
+    for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        for (int l = 0; l < TREND_LEVELS; l++)
+            s_base = MAX(s_base, newest(c, l));
+
+    TickType_t wake = xTaskGetTickCount();
+    while (1)
+    {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(1000));
+        uint32_t now = trend_now();
+        for (int c = 0; c < CAPTURE_CHANNELS; c++)
+        {
+            if ((s_channels & (1 << c)) && capture_get_rate(c) > 0)
+                second(c, now);
+            else if (tr[c].on)
+            {
+                flush_pending(c);
+                tr[c].on = false;
+            }
+        }
+    }
+}
+
+esp_err_t trend_set(uint8_t channels)
+{
+    if (channels >= 1 << CAPTURE_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+    s_channels = channels;
+
+    nvs_handle_t nvs;
+    if (nvs_open("trend", NVS_READWRITE, &nvs) != ESP_OK)
+        return ESP_FAIL;
+    nvs_set_u8(nvs, "channels", channels);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    return ESP_OK;
+}
+
+// oldest point of a level, the RAM ones included; UINT32_MAX if it has none
+static uint32_t oldest(int channel, int level)
+{
+    trend_file_t h;
+    trend_point_t p;
+    uint32_t t = UINT32_MAX;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    FILE *f = open_file(level, channel, &h, false);
+    if (f != NULL && h.count > 0 && read_point(f, &h, 0, &p))
+        t = p.t;
+    if (f != NULL)
+        fclose(f);
+    if (t == UINT32_MAX && level == 0 && tr[channel].npending > 0)
+        t = tr[channel].pending[0].t;
+    xSemaphoreGive(s_mutex);
+    return t;
+}
+
+int trend_level(int channel, uint32_t t0, uint32_t t1, size_t n)
+{
+    bool holds[TREND_LEVELS];
+    if (s_mutex == NULL)
+        return 0;
+    for (int l = 0; l < TREND_LEVELS; l++)
+        holds[l] = oldest(channel, l) <= t0;
+
+    for (int l = TREND_LEVELS - 1; l >= 0; l--)
+        if (holds[l] && (t1 - t0) / s_res[l] >= n)
+            return l;
+    for (int l = 0; l < TREND_LEVELS; l++)
+        if (holds[l])
+            return l;
+    return TREND_LEVELS - 1;
+}
+
+esp_err_t trend_read(int channel, int level, uint32_t t0, uint32_t t1, trend_cb_t cb, void *arg)
+{
+    if (channel < 0 || channel >= CAPTURE_CHANNELS || level < 0 || level >= TREND_LEVELS)
+        return ESP_ERR_INVALID_ARG;
+    if (s_mutex == NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    trend_point_t buf[TREND_CHUNK];
+    trend_file_t h;
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    FILE *f = open_file(level, channel, &h, false);
+    xSemaphoreGive(s_mutex);
+
+    // the file may move on between chunks, a point more or less at the old end does not matter
+    uint32_t k = 0;
+    while (f != NULL)
+    {
+        size_t n = 0;
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        for (; k < h.count && n < TREND_CHUNK; k++)
+            if (read_point(f, &h, k, &buf[n]) && buf[n].t >= t0 && buf[n].t <= t1)
+                n++;
+        xSemaphoreGive(s_mutex);
+        if (n == 0 && k >= h.count)
+            break;
+        if (n > 0 && !cb(buf, n, arg))
+        {
+            fclose(f);
+            return ESP_OK;
+        }
+    }
+    if (f != NULL)
+        fclose(f);
+
+    // and the seconds not written yet
+    for (int i = 0; level == 0;)
+    {
+        size_t n = 0;
+        xSemaphoreTake(s_mutex, portMAX_DELAY);
+        for (; i < tr[channel].npending && n < TREND_CHUNK; i++)
+            if (tr[channel].pending[i].t >= t0 && tr[channel].pending[i].t <= t1)
+                buf[n++] = tr[channel].pending[i];
+        bool more = i < tr[channel].npending;
+        xSemaphoreGive(s_mutex);
+        if ((n > 0 && !cb(buf, n, arg)) || !more)
+            break;
+    }
+    return ESP_OK;
+}
+
+esp_err_t trend_command(const char *cmd, char *reply, size_t len)
+{
+    unsigned channels;
+    if (strcmp(cmd, "trend") == 0)
+    {
+        snprintf(reply, len, "trend channels 0x%x, time %" PRIu32 " %s, %" PRIu32 " points written", s_channels, trend_now(),
+                 time(NULL) >= TREND_SYNCED ? "synced" : "not synced", s_written);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "trend off") == 0)
+        return trend_set(0);
+    if (sscanf(cmd, "trend %x", &channels) == 1)
+        return trend_set(channels);
+    return ESP_ERR_INVALID_ARG;
+}
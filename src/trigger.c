@@ -0,0 +1,74 @@
+#include "main.h"
+#include "trigger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "trigger";
+
+static trigger_t s_trigger = {.slope = TRIGGER_OFF, .level = 2048, .hysteresis = 32};
+static bool s_armed = false;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void trigger_set(const trigger_t *t)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_trigger = *t;
+    s_armed = false;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void trigger_get(trigger_t *t)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *t = s_trigger;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void IRAM_ATTR trigger_frame_from_isr(frame_t *frame)
+{
+    taskENTER_CRITICAL_ISR(&s_lock);
+    trigger_t t = s_trigger;
+    bool armed = s_armed;
+    taskEXIT_CRITICAL_ISR(&s_lock);
+
+    frame->trigger = -1;
+    frame->trigger_channel = t.channel;
+    if (t.slope == TRIGGER_OFF)
+        return;
+
+    const uint16_t *samples = frame->data[t.channel];
+    size_t n = frame->count[t.channel];
+    int found = -1;
+    for (size_t i = 0; i < n; i++)
+        if (trigger_step(&t, &armed, samples[i]) && found < 0)
+            found = i;
+
+    taskENTER_CRITICAL_ISR(&s_lock);
+    s_armed = armed;
+    taskEXIT_CRITICAL_ISR(&s_lock);
+    frame->trigger = found;
+}
+
+esp_err_t trigger_command(const char *cmd)
+{
+    char slope[8] = {0};
+    int channel, level, hysteresis = 32;
+    if (sscanf(cmd, "trigger %d %d %7s %d", &channel, &level, slope, &hysteresis) < 3 ||
+        channel < 0 || channel >= FRAME_INPUTS || level < 0 || level > 0xfff || hysteresis < 0)
+        return ESP_ERR_INVALID_ARG;
+
+    trigger_t t = {.channel = channel, .level = level, .hysteresis = hysteresis};
+    if (strcmp(slope, "rising") == 0)
+        t.slope = TRIGGER_RISING;
+    else if (strcmp(slope, "falling") == 0)
+        t.slope = TRIGGER_FALLING;
+    else if (strcmp(slope, "off") == 0)
+        t.slope = TRIGGER_OFF;
+    else
+        return ESP_ERR_INVALID_ARG;
+
+    trigger_set(&t);
+    ESP_LOGI(TAG, "channel %d, level %d, %s, hysteresis %d", channel, level, slope, hysteresis);
+    return ESP_OK;
+}
@@ -0,0 +1,195 @@
+#include "udp.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lwip/sockets.h"
+
+#include "wire.h"
+
+static const char *TAG = "udp";
+
+// expedited forwarding, with WMM the datagrams skip the best effort queue the TCP traffic waits in
+#define UDP_TOS 0xB8
+
+static int s_sock = -1;
+static struct sockaddr_in s_to;
+static int s_group; // configured, 0 - no FEC
+
+static uint32_t s_seq;
+static uint8_t s_dgram[WIRE_UDP_DATAGRAM] __attribute__((aligned(4)));
+
+// parity of the open group
+static uint8_t s_parity[WIRE_UDP_DATAGRAM] __attribute__((aligned(4)));
+static uint32_t s_parity_first;
+static int s_parity_count;
+static size_t s_parity_len;
+
+static struct
+{
+    uint32_t datagrams;
+    uint32_t parity;
+    uint32_t failed; // sendto refused, out of buffers as a rule
+    int64_t latency_sum;
+    int64_t latency_max;
+    uint32_t frames;
+} s_stats;
+
+static void udp_emit(const uint8_t *data, size_t len)
+{
+    // never wait for buffers, a late datagram is worth no more than a lost one
+    if (sendto(s_sock, data, len, MSG_DONTWAIT, (struct sockaddr *)&s_to, sizeof(s_to)) < 0)
+        s_stats.failed++;
+}
+
+static void udp_parity_flush(void)
+{
+    if (s_parity_count == 0)
+        return;
+
+    wire_udp_hdr_t *h = (wire_udp_hdr_t *)s_parity;
+    h->magic = WIRE_UDP_MAGIC;
+    h->version = WIRE_VERSION;
+    h->flags = WIRE_UDP_PARITY;
+    h->seq = s_parity_first;
+    h->group = s_parity_count;
+    h->reserved = 0;
+    udp_emit(s_parity, s_parity_len);
+    s_stats.parity++;
+
+    memset(s_parity, 0, sizeof(s_parity));
+    s_parity_count = 0;
+    s_parity_len = 0;
+}
+
+esp_err_t udp_start(const char *host, uint16_t port, int group)
+{
+    if (group < 0 || group > UDP_FEC_MAX || port == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &to.sin_addr) != 1)
+        return ESP_ERR_INVALID_ARG;
+
+    udp_stop();
+    s_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s_sock < 0)
+    {
+        ESP_LOGE(TAG, "socket: %d", errno);
+        return ESP_FAIL;
+    }
+
+    int tos = UDP_TOS;
+    setsockopt(s_sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (IN_MULTICAST(ntohl(to.sin_addr.s_addr)))
+    {
+        // the local network only, Wi-Fi sends multicast at the basic rate anyway
+        uint8_t ttl = 1;
+        setsockopt(s_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    }
+
+    s_to = to;
+    s_group = group;
+    s_seq = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    memset(s_parity, 0, sizeof(s_parity));
+    s_parity_count = 0;
+    s_parity_len = 0;
+    ESP_LOGI(TAG, "Streaming to %s:%u, fec %d", host, port, group);
+    return ESP_OK;
+}
+
+void udp_stop(void)
+{
+    if (s_sock < 0)
+        return;
+    close(s_sock);
+    s_sock = -1;
+}
+
+bool udp_active(void)
+{
+    return s_sock >= 0;
+}
+
+void udp_send_frame(const uint8_t *frame, size_t len, uint32_t seq, int64_t stamp)
+{
+    if (s_sock < 0)
+        return;
+
+    wire_udp_hdr_t *h = (wire_udp_hdr_t *)s_dgram;
+    for (size_t offset = 0; offset < len; offset += WIRE_UDP_PAYLOAD)
+    {
+        size_t n = len - offset < WIRE_UDP_PAYLOAD ? len - offset : WIRE_UDP_PAYLOAD;
+        h->magic = WIRE_UDP_MAGIC;
+        h->version = WIRE_VERSION;
+        h->flags = 0;
+        h->seq = s_seq++;
+        h->group = s_group;
+        h->reserved = 0;
+        h->len = n;
+        h->frame = seq;
+        h->offset = offset;
+        h->total = len;
+        memcpy(s_dgram + sizeof(*h), frame + offset, n);
+        udp_emit(s_dgram, sizeof(*h) + n);
+        s_stats.datagrams++;
+
+        if (s_group == 0)
+            continue;
+
+        // a datagram sendto refused is still in the parity, the receiver may get it back
+        if (s_parity_count++ == 0)
+            s_parity_first = h->seq;
+        for (size_t i = WIRE_UDP_PROTECTED; i < sizeof(*h) + n; i++)
+            s_parity[i] ^= s_dgram[i];
+        if (sizeof(*h) + n > s_parity_len)
+            s_parity_len = sizeof(*h) + n;
+        if (s_parity_count == s_group)
+            udp_parity_flush();
+    }
+    // groups end with the frame, so a repair never waits for the next one
+    udp_parity_flush();
+
+    int64_t l = esp_timer_get_time() - stamp;
+    s_stats.latency_sum += l;
+    if (l > s_stats.latency_max)
+        s_stats.latency_max = l;
+    s_stats.frames++;
+}
+
+esp_err_t udp_command(const char *cmd, char *reply, size_t len)
+{
+    char host[16];
+    unsigned port;
+    int group = 0;
+
+    reply[0] = 0;
+    if (strcmp(cmd, "udp") == 0)
+    {
+        if (s_sock < 0)
+        {
+            snprintf(reply, len, "udp off");
+            return ESP_OK;
+        }
+        char ip[16];
+        inet_ntop(AF_INET, &s_to.sin_addr, ip, sizeof(ip));
+        snprintf(reply, len, "udp %s:%u fec %d: %" PRIu32 " datagrams, %" PRIu32 " parity, %" PRIu32 " not sent, latency avg %" PRId64 " max %" PRId64 " us",
+                 ip, ntohs(s_to.sin_port), s_group, s_stats.datagrams, s_stats.parity, s_stats.failed,
+                 s_stats.frames > 0 ? s_stats.latency_sum / s_stats.frames : 0, s_stats.latency_max);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "udp off") == 0)
+    {
+        udp_stop();
+        return ESP_OK;
+    }
+    int n = sscanf(cmd, "udp %15s %u fec %d", host, &port, &group);
+    if (n < 2 || port > UINT16_MAX)
+        return ESP_ERR_INVALID_ARG;
+    return udp_start(host, port, group);
+}
@@ -9,6 +9,7 @@
 #include <u8g2.h>
 
 #include "ui.h"
+#include "trace.h"
 
 #include "nvs_flash.h"
 #include "nvs.h"
@@ -107,7 +108,9 @@ void task_SSD1306i2c(void *ignore)
 
 		uint32_t pixel = 1 << (31 - val);
 
+		trace(TRACE_OLED, TRACE_BEGIN, 0);
 		u8g2_SendF(&u8g2, "cddddc", 0x2e, pixel, pixel >> 8, pixel >> 16, pixel >> 24, 0x2f);
+		trace(TRACE_OLED, TRACE_END, 0);
 
 		vTaskDelay(1);
 	};
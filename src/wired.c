@@ -0,0 +1,250 @@
+#include "wired.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include "driver/uart.h"
+#if SOC_USB_SERIAL_JTAG_SUPPORTED
+#include "driver/usb_serial_jtag.h"
+#endif
+
+#include "mem.h"
+#include "wire.h"
+#include "bench.h"
+
+static const char *TAG = "wired";
+
+#define WIRED_UART_CONSOLE UART_NUM_0
+#define WIRED_UART_PINNED UART_NUM_1
+
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG || CONFIG_ESP_CONSOLE_USB_CDC
+#define WIRED_USB_CONSOLE 1
+#else
+#define WIRED_USB_CONSOLE 0
+#endif
+
+static wired_port_t s_port = WIRED_OFF;
+static uart_port_t s_uart;
+static uint32_t s_baud;
+static int s_cdc = -1; // USB CDC console file
+static vprintf_like_t s_log_vprintf;
+
+// frame + CRC, then its COBS form between two zeros
+static uint8_t s_raw[WS_BUF_SIZE + sizeof(uint32_t)];
+static uint8_t s_cobs[WIRE_COBS_MAX(sizeof(s_raw)) + 2];
+
+static struct
+{
+    int64_t start;
+    uint32_t frames;
+    uint32_t dropped; // no room in the driver queue
+    uint32_t torn;    // written in part, the receiver fails its CRC
+    uint64_t bytes;
+} s_stats;
+
+static int wired_log_muted(const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static void wired_mute_log(bool mute)
+{
+    if (mute && s_log_vprintf == NULL)
+        s_log_vprintf = esp_log_set_vprintf(wired_log_muted);
+    else if (!mute && s_log_vprintf != NULL)
+    {
+        esp_log_set_vprintf(s_log_vprintf);
+        s_log_vprintf = NULL;
+    }
+}
+
+static esp_err_t wired_start_uart(uint32_t baud, int tx_pin)
+{
+    s_uart = tx_pin < 0 ? WIRED_UART_CONSOLE : WIRED_UART_PINNED;
+#if CONFIG_ESP_CONSOLE_UART
+    // the console REPL reads through the driver that would be replaced
+    if (s_uart == CONFIG_ESP_CONSOLE_UART_NUM && bench_console_active())
+        return ESP_ERR_INVALID_STATE;
+#endif
+    if (uart_is_driver_installed(s_uart))
+        uart_driver_delete(s_uart);
+
+    uart_config_t config = {
+        .baud_rate = baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+    esp_err_t err = uart_driver_install(s_uart, UART_HW_FIFO_LEN(s_uart) * 2, WIRED_TX_BUF, 0, NULL, 0);
+    if (err == ESP_OK)
+        err = uart_param_config(s_uart, &config);
+    if (err == ESP_OK && tx_pin >= 0)
+        err = uart_set_pin(s_uart, tx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (err != ESP_OK)
+    {
+        uart_driver_delete(s_uart);
+        return err;
+    }
+    // the clock divider gets as close as it can
+    uart_get_baudrate(s_uart, &s_baud);
+    return ESP_OK;
+}
+
+static esp_err_t wired_start_usb(void)
+{
+#if SOC_USB_SERIAL_JTAG_SUPPORTED
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    // the console REPL holds the driver, with buffers far too small for the stream
+    if (bench_console_active())
+        return ESP_ERR_INVALID_STATE;
+#endif
+    usb_serial_jtag_driver_config_t config = {
+        .tx_buffer_size = WIRED_TX_BUF,
+        .rx_buffer_size = 256,
+    };
+    return usb_serial_jtag_driver_install(&config);
+#elif CONFIG_ESP_CONSOLE_USB_CDC
+    s_cdc = open("/dev/cdcacm", O_WRONLY);
+    return s_cdc >= 0 ? ESP_OK : ESP_FAIL;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t wired_start(wired_port_t port, uint32_t baud, int tx_pin)
+{
+    wired_stop();
+
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (port == WIRED_UART && baud > 0)
+        err = wired_start_uart(baud, tx_pin);
+    else if (port == WIRED_USB)
+        err = wired_start_usb();
+    if (err != ESP_OK)
+        return err;
+
+    if (port == WIRED_UART)
+        ESP_LOGI(TAG, "Streaming on UART%d at %lu baud", s_uart, s_baud);
+    else
+        ESP_LOGI(TAG, "Streaming on USB");
+
+    wired_mute_log(port == WIRED_UART ? s_uart == CONFIG_ESP_CONSOLE_UART_NUM : WIRED_USB_CONSOLE);
+
+    s_port = port;
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.start = esp_timer_get_time();
+    return ESP_OK;
+}
+
+void wired_stop(void)
+{
+    if (s_port == WIRED_UART)
+    {
+        uart_wait_tx_done(s_uart, pdMS_TO_TICKS(100));
+        uart_driver_delete(s_uart);
+#if CONFIG_ESP_CONSOLE_UART
+        // the console goes on at its own rate
+        if (s_uart == CONFIG_ESP_CONSOLE_UART_NUM)
+            uart_set_baudrate(s_uart, CONFIG_ESP_CONSOLE_UART_BAUDRATE);
+#endif
+    }
+#if SOC_USB_SERIAL_JTAG_SUPPORTED
+    else if (s_port == WIRED_USB)
+        usb_serial_jtag_driver_uninstall();
+#endif
+    if (s_cdc >= 0)
+    {
+        close(s_cdc);
+        s_cdc = -1;
+    }
+    s_port = WIRED_OFF;
+    wired_mute_log(false);
+}
+
+bool wired_active(void)
+{
+    return s_port != WIRED_OFF;
+}
+
+void wired_send_frame(const uint8_t *frame, size_t len)
+{
+    if (s_port == WIRED_OFF || len > WS_BUF_SIZE)
+        return;
+
+    memcpy(s_raw, frame, len);
+    uint32_t crc = esp_rom_crc32_le(0, frame, len);
+    memcpy(s_raw + len, &crc, sizeof(crc));
+
+    // the leading zero ends whatever a short write left unfinished
+    s_cobs[0] = 0;
+    size_t n = 1 + wire_cobs_encode(s_raw, len + sizeof(crc), s_cobs + 1);
+    s_cobs[n++] = 0;
+
+    int sent = 0;
+    if (s_port == WIRED_UART)
+    {
+        size_t room = 0;
+        uart_get_tx_buffer_free_size(s_uart, &room);
+        if (room >= n)
+            sent = uart_write_bytes(s_uart, s_cobs, n);
+    }
+#if SOC_USB_SERIAL_JTAG_SUPPORTED
+    else
+        sent = usb_serial_jtag_write_bytes(s_cobs, n, 0);
+#else
+    else if (s_cdc >= 0)
+        sent = write(s_cdc, s_cobs, n);
+#endif
+
+    if (sent == (int)n)
+        s_stats.frames++;
+    else if (sent > 0)
+        s_stats.torn++;
+    else
+        s_stats.dropped++;
+    if (sent > 0)
+        s_stats.bytes += sent;
+}
+
+esp_err_t wired_command(const char *cmd, char *reply, size_t len)
+{
+    unsigned baud;
+    int tx_pin = -1;
+
+    reply[0] = 0;
+    if (strcmp(cmd, "wired") == 0)
+    {
+        if (s_port == WIRED_OFF)
+        {
+            snprintf(reply, len, "wired off");
+            return ESP_OK;
+        }
+        int64_t us = esp_timer_get_time() - s_stats.start;
+        if (s_port == WIRED_UART)
+            snprintf(reply, len, "wired UART%d %lu baud: ", s_uart, s_baud);
+        else
+            snprintf(reply, len, "wired usb: ");
+        size_t l = strlen(reply);
+        snprintf(reply + l, len - l, "%lu frames, %lu dropped, %lu torn, %.2f MB/s", s_stats.frames, s_stats.dropped,
+                 s_stats.torn, us > 0 ? (double)s_stats.bytes / us : 0.0);
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "wired off") == 0)
+    {
+        wired_stop();
+        return ESP_OK;
+    }
+    if (strcmp(cmd, "wired usb") == 0)
+        return wired_start(WIRED_USB, 0, -1);
+    if (sscanf(cmd, "wired uart %u %d", &baud, &tx_pin) >= 1)
+        return wired_start(WIRED_UART, baud, tx_pin);
+    return ESP_ERR_INVALID_ARG;
+}
@@ -0,0 +1,130 @@
+/*
+ * Host benchmark of the per-sample stages of adc_dma_task: median, filter
+ * chain and decimation, in time and CPU cycles per sample.
+ *
+ *   cc -O2 -Iinclude -o bench tools/bench/bench.c src/median.c src/filter.c src/decim.c -lm
+ *   ./bench
+ *
+ * Cycles come from the time stamp counter on x86 and are left out elsewhere.
+ * Host numbers rank the configurations, they do not predict the ESP32 ones.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "median.h"
+#include "filter.h"
+#include "decim.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0
+#endif
+
+#define SAMPLES (1 << 20)
+#define FRAME 256 // samples handed to a stage at a time, like FRAME_SAMPLES
+
+static uint16_t input[SAMPLES];
+static uint16_t work[SAMPLES];
+static uint32_t out[FRAME];
+
+typedef void (*stage_t)(void *state, uint16_t *v, size_t n);
+
+static void run_median(void *state, uint16_t *v, size_t n)
+{
+    median_run(state, v, n);
+}
+
+static void run_filter(void *state, uint16_t *v, size_t n)
+{
+    filter_run(state, v, n);
+}
+
+static void run_decim(void *state, uint16_t *v, size_t n)
+{
+    size_t first;
+    decim_run(state, v, n, out, &first);
+}
+
+static void bench(const char *name, stage_t stage, void *state)
+{
+    memcpy(work, input, sizeof(work));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = CYCLES();
+    for (size_t i = 0; i < SAMPLES; i += FRAME)
+        stage(state, work + i, FRAME);
+    uint64_t c1 = CYCLES();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / SAMPLES;
+    printf("%-32s %7.1f ns %7.1f cycles per sample\n", name, ns, (double)(c1 - c0) / SAMPLES);
+}
+
+static void bench_filter(const char *specs, float rate)
+{
+    static filter_chain_t f;
+    filter_clear(&f);
+
+    char text[64];
+    strncpy(text, specs, sizeof(text) - 1);
+    for (char *s = strtok(text, ";"); s; s = strtok(NULL, ";"))
+    {
+        filter_spec_t spec;
+        if (filter_parse(s, &spec) != 0 || filter_add(&f, &spec) != 0)
+        {
+            printf("bad filter %s\n", s);
+            return;
+        }
+    }
+    if (filter_design(&f, rate) != 0)
+    {
+        printf("filter %s does not fit %.0f Hz\n", specs, rate);
+        return;
+    }
+    bench(specs, run_filter, &f);
+}
+
+int main(void)
+{
+    const float rate = 30000;
+    srand(1);
+    for (size_t i = 0; i < SAMPLES; i++)
+        input[i] = rand() % 4096;
+
+    char name[32];
+    static median_filter_t m;
+    for (unsigned w = 3; w <= MEDIAN_MAX_WINDOW; w = w * 2 + 1)
+    {
+        median_init(&m, MEDIAN_PLAIN, w, 0);
+        snprintf(name, sizeof(name), "median %u", w);
+        bench(name, run_median, &m);
+        median_init(&m, MEDIAN_HAMPEL, w, MEDIAN_HAMPEL_K);
+        snprintf(name, sizeof(name), "hampel %u", w);
+        bench(name, run_median, &m);
+    }
+
+    bench_filter("lp 1000", rate);
+    bench_filter("notch 50;notch 100", rate);
+    bench_filter("lp 1000;lp 1000;hp 10;notch 50", rate);
+    bench_filter("fir lp 1000 31", rate);
+    bench_filter("fir lp 1000 63", rate);
+    bench_filter("lp 1000;notch 50;fir lp 1000 63", rate);
+
+    static decim_t d;
+    for (unsigned r = 4; r <= 1u << DECIM_MAX_SHIFT; r *= 4)
+    {
+        decim_init(&d, DECIM_BOXCAR, r, 16);
+        snprintf(name, sizeof(name), "box %u", r);
+        bench(name, run_decim, &d);
+        decim_init(&d, DECIM_CIC, r, 24);
+        snprintf(name, sizeof(name), "cic %u", r);
+        bench(name, run_decim, &d);
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Host check of the sliding median and the Hampel filter (src/median.c) against
+ * a sorted copy of the window, for every odd window up to MEDIAN_MAX_WINDOW.
+ *
+ *   cc -O2 -Iinclude -o mediancheck tools/mediancheck/mediancheck.c src/median.c -lm
+ *   ./mediancheck
+ *
+ * The inputs are noise over the full 12 bit range, noise of a few levels so the
+ * window holds many equal values, and ramps up and down, so every new value is
+ * the largest or the smallest of the window, and a flat line with spikes for
+ * the Hampel filter to replace. They go in frames of varying length. The
+ * reference includes the start, where the window is still filling and an even
+ * count averages the two middle values. Exits 1 on the first mismatch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "median.h"
+
+#define SAMPLES (1 << 16)
+#define FRAME 256 // longest frame, like FRAME_SAMPLES
+
+static uint16_t input[SAMPLES];
+static uint16_t work[SAMPLES];
+static uint16_t deviation[SAMPLES];
+
+static int compare(const void *a, const void *b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+// median of the up to n values ending at v[i]
+static uint16_t reference(const uint16_t *v, size_t i, unsigned n)
+{
+    uint16_t w[MEDIAN_MAX_WINDOW];
+    size_t ct = i + 1 < n ? i + 1 : n;
+    memcpy(w, &v[i + 1 - ct], ct * sizeof(uint16_t));
+    qsort(w, ct, sizeof(uint16_t), compare);
+    return ct & 1 ? w[ct / 2] : (w[ct / 2 - 1] + w[ct / 2] + 1) / 2;
+}
+
+// the Hampel filter written out: the median until the window is full, then the
+// centre unless it is too far from the median, the MAD starts with the full window
+static uint16_t reference_hampel(const median_filter_t *f, size_t i, unsigned n, uint32_t *outliers)
+{
+    uint16_t m = reference(input, i, n);
+    if (i + 1 < n)
+        return m;
+    uint16_t x = input[i - n / 2];
+    size_t j = i + 1 - n;
+    deviation[j] = x > m ? x - m : m - x;
+    uint32_t mad = reference(deviation, j, n);
+    if (((uint32_t)deviation[j] << 8) <= f->k_q8 * (mad ? mad : 1))
+        return x;
+    (*outliers)++;
+    return m;
+}
+
+static uint16_t sample(int kind, size_t i)
+{
+    if (kind == 0)
+        return rand() % 4096;
+    if (kind == 1)
+        return rand() % 4 * 1000;
+    if (kind == 2)
+    {
+        size_t r = i % 1000;
+        return (i / 1000 & 1 ? 1000 - r : r) * 4;
+    }
+    return rand() % 50 == 0 ? rand() % 2 * 4095 : 2000 + rand() % 8;
+}
+
+static int check(const char *name, median_type_t type, unsigned n)
+{
+    static median_filter_t m;
+    median_init(&m, type, n, MEDIAN_HAMPEL_K);
+    memcpy(work, input, sizeof(work));
+    for (size_t i = 0, len; i < SAMPLES; i += len)
+    {
+        len = 1 + rand() % FRAME;
+        if (len > SAMPLES - i)
+            len = SAMPLES - i;
+        median_run(&m, work + i, len);
+    }
+
+    uint32_t outliers = 0;
+    for (size_t i = 0; i < SAMPLES; i++)
+    {
+        uint16_t want = type == MEDIAN_HAMPEL ? reference_hampel(&m, i, n, &outliers) : reference(input, i, n);
+        if (work[i] != want)
+        {
+            printf("%s, %s %u: sample %zu is %u, the sorted window has %u\n", name,
+                   type == MEDIAN_HAMPEL ? "hampel" : "median", n, i, work[i], want);
+            return -1;
+        }
+    }
+    if (m.outliers != outliers)
+    {
+        printf("%s, hampel %u: %u outliers, the sorted window has %u\n", name, n, (unsigned)m.outliers,
+               (unsigned)outliers);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const char *names[] = {"noise", "levels", "ramps", "spikes"};
+    srand(1);
+
+    for (int k = 0; k < 4; k++)
+    {
+        for (size_t i = 0; i < SAMPLES; i++)
+            input[i] = sample(k, i);
+        for (unsigned n = 1; n <= MEDIAN_MAX_WINDOW; n += 2)
+            if (check(names[k], MEDIAN_PLAIN, n) != 0 || check(names[k], MEDIAN_HAMPEL, n) != 0)
+                return 1;
+        printf("%-8s windows 1 to %u match, median and Hampel\n", names[k], MEDIAN_MAX_WINDOW);
+    }
+    return 0;
+}
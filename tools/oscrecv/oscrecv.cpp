@@ -0,0 +1,970 @@
+/*
+ * Host receiver and recorder of the sample stream, and a stand-in device.
+ *
+ *   c++ -O2 -std=c++17 -Iinclude -o oscrecv tools/oscrecv/oscrecv.cpp
+ *   ./oscrecv [-o capture.osc] [-r prefix] [-i seconds] source
+ *   ./oscrecv serve [-p port] [-x speed] [-l] capture.osc
+ *
+ * source is ws://host[:port][/ws] for a device or a stand-in, a capture file,
+ * or - for frames on stdin, which is how the other transports come in:
+ *
+ *   ./udprecv -o - 5000 | ./oscrecv -o soak.osc -
+ *   ./wiredrecv -o - /dev/ttyACM0 | ./oscrecv -o soak.osc -
+ *
+ * Frames are parsed where they were received and written out from there. The
+ * capture file holds the wire frames (wire.h) back to back like the device's
+ * recordings, capture.osc.idx next to it one osc_index_t per frame in file
+ * order, so a reader finds a time by bisecting it. -r appends the samples of
+ * every channel to prefix.chN.raw as they are on the wire. WebSocket sources
+ * are reconnected until ^C.
+ *
+ * Every -i seconds: throughput, frames, seq gaps and how far the arrival delay
+ * was above the smallest one seen, which is what the link queued on top. The
+ * device clock is not the host's, so the delay itself is unknown, and every
+ * connection is measured against its own smallest delay.
+ *
+ * serve answers ws://localhost:port/ws the way the device does after "open ws",
+ * with the frames of a capture file at their recorded pace (-x times faster),
+ * over and over with -l. Seq and times go on across the repeats.
+ */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "wire.h"
+
+namespace
+{
+
+constexpr size_t RX_SIZE = 4 << 20; // several of the largest frames
+constexpr const char *WS_PORT = "80";
+constexpr int SERVE_PORT = 8080;
+constexpr unsigned RECONNECT_S = 2;
+constexpr int CHANNELS_MAX = 256;
+
+struct __attribute__((packed)) osc_index_t
+{
+    int64_t t0;      // first sample of the first channel, us
+    uint64_t offset; // of the frame in the capture file
+    uint32_t seq;
+    uint32_t len;
+};
+
+volatile sig_atomic_t stop;
+
+void on_signal(int)
+{
+    stop = 1;
+}
+
+int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+bool send_all(int fd, const void *data, size_t n)
+{
+    auto p = static_cast<const uint8_t *>(data);
+    while (n > 0)
+    {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR && !stop)
+            continue;
+        if (k <= 0)
+            return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+// bytes of the wire frame at p, 0 if n does not hold all of it yet, -1 if it is none
+long frame_size(const uint8_t *p, size_t n)
+{
+    auto h = reinterpret_cast<const wire_frame_hdr_t *>(p);
+    if (n < sizeof(*h))
+        return 0;
+    if (h->magic != WIRE_MAGIC || h->version != WIRE_VERSION)
+        return -1;
+    size_t size = sizeof(*h);
+    for (int c = 0; c < h->channels; c++)
+    {
+        if (n < size + sizeof(wire_channel_hdr_t))
+            return 0;
+        auto ch = reinterpret_cast<const wire_channel_hdr_t *>(p + size);
+        size += sizeof(*ch) + (size_t)ch->count * wire_width(ch->bits);
+    }
+    return size <= n ? (long)size : 0;
+}
+
+int64_t frame_time(const uint8_t *f)
+{
+    auto h = reinterpret_cast<const wire_frame_hdr_t *>(f);
+    if (h->channels == 0)
+        return 0;
+    return reinterpret_cast<const wire_channel_hdr_t *>(f + sizeof(*h))->t0;
+}
+
+struct Delays
+{
+    int64_t sum = 0, max = 0;
+    uint64_t n = 0;
+
+    void add(int64_t d)
+    {
+        sum += d;
+        if (n == 0 || d > max)
+            max = d;
+        n++;
+    }
+
+    Delays &operator+=(const Delays &o)
+    {
+        if (o.n > 0 && (n == 0 || o.max > max))
+            max = o.max;
+        sum += o.sum;
+        n += o.n;
+        return *this;
+    }
+};
+
+struct Stats
+{
+    uint64_t bytes = 0, frames = 0, gaps = 0, lost = 0, restarts = 0, bad = 0;
+    Delays delay; // arrival delays of the connection, in the totals their excess over its best
+};
+
+// what becomes of the received frames: files and statistics
+class Recorder
+{
+public:
+    ~Recorder()
+    {
+        if (capture_ != nullptr)
+        {
+            fclose(capture_);
+            fclose(capture_idx_);
+        }
+        for (FILE *f : raw_)
+            if (f != nullptr)
+                fclose(f);
+    }
+
+    bool open_capture(const std::string &name)
+    {
+        capture_ = fopen(name.c_str(), "ab");
+        capture_idx_ = fopen((name + ".idx").c_str(), "ab");
+        if (capture_ == nullptr || capture_idx_ == nullptr)
+            return false;
+        fseek(capture_, 0, SEEK_END);
+        capture_offset_ = ftell(capture_);
+        return true;
+    }
+
+    void set_raw_prefix(const char *prefix)
+    {
+        raw_prefix_ = prefix;
+    }
+
+    // a new connection may be a restarted device with a new clock, so the delays
+    // so far go to the totals against the best of the old one
+    void restart()
+    {
+        conn_ += interval.delay;
+        interval.delay = Delays();
+        fold_delays();
+        have_seq_ = false;
+        have_delay_ = false;
+    }
+
+    void sink(const uint8_t *f, size_t len, bool live);
+    void report(double seconds, bool final);
+
+    Stats interval;
+
+private:
+    void raw_write(int channel, const uint8_t *samples, size_t n);
+    void fold_delays();
+
+    FILE *capture_ = nullptr, *capture_idx_ = nullptr;
+    uint64_t capture_offset_ = 0;
+    const char *raw_prefix_ = nullptr;
+    std::array<FILE *, CHANNELS_MAX> raw_{};
+
+    bool have_seq_ = false;
+    uint32_t next_seq_ = 0;
+    bool have_delay_ = false;
+    int64_t delay_best_ = 0;
+    Delays conn_; // reported intervals of the connection
+
+    Stats total_;
+};
+
+void Recorder::raw_write(int channel, const uint8_t *samples, size_t n)
+{
+    if (raw_[channel] == nullptr)
+    {
+        std::string name = std::string(raw_prefix_) + ".ch" + std::to_string(channel) + ".raw";
+        if ((raw_[channel] = fopen(name.c_str(), "ab")) == nullptr)
+        {
+            perror(name.c_str());
+            exit(1);
+        }
+    }
+    fwrite(samples, 1, n, raw_[channel]);
+}
+
+// one complete frame, still in the buffer it arrived in
+void Recorder::sink(const uint8_t *f, size_t len, bool live)
+{
+    int64_t arrival = now_us();
+    auto h = reinterpret_cast<const wire_frame_hdr_t *>(f);
+
+    if (have_seq_ && h->seq != next_seq_)
+    {
+        uint32_t d = h->seq - next_seq_;
+        if (d < 1u << 31)
+        {
+            interval.gaps++;
+            interval.lost += d;
+        }
+        else
+            interval.restarts++;
+    }
+    next_seq_ = h->seq + 1;
+    have_seq_ = true;
+
+    int64_t t_end = INT64_MIN;
+    const uint8_t *p = f + sizeof(*h);
+    for (int c = 0; c < h->channels; c++)
+    {
+        auto ch = reinterpret_cast<const wire_channel_hdr_t *>(p);
+        size_t n = (size_t)ch->count * wire_width(ch->bits);
+        if (raw_prefix_ != nullptr)
+            raw_write(ch->channel, p + sizeof(*ch), n);
+        int64_t e = ch->t0 + (int64_t)(ch->count > 0 ? ch->count - 1 : 0) * ch->period_ns / 1000;
+        if (e > t_end)
+            t_end = e;
+        p += sizeof(*ch) + n;
+    }
+
+    if (capture_ != nullptr)
+    {
+        osc_index_t e = {frame_time(f), capture_offset_, h->seq, (uint32_t)len};
+        fwrite(f, 1, len, capture_);
+        fwrite(&e, sizeof(e), 1, capture_idx_);
+        capture_offset_ += len;
+    }
+
+    if (live && h->channels > 0)
+    {
+        int64_t delay = arrival - t_end;
+        if (!have_delay_ || delay < delay_best_)
+            delay_best_ = delay;
+        have_delay_ = true;
+        interval.delay.add(delay);
+    }
+    interval.frames++;
+}
+
+void Recorder::fold_delays()
+{
+    if (conn_.n == 0)
+        return;
+    conn_.sum -= (int64_t)conn_.n * delay_best_;
+    conn_.max -= delay_best_;
+    total_.delay += conn_;
+    conn_ = Delays();
+}
+
+void Recorder::report(double seconds, bool final)
+{
+    if (!final)
+    {
+        fprintf(stderr, "%.2f MB/s, %" PRIu64 " frames, %" PRIu64 " gaps (%" PRIu64 " frames lost)",
+                interval.bytes / seconds / 1e6, interval.frames, interval.gaps, interval.lost);
+        if (interval.delay.n > 0)
+            fprintf(stderr, ", delay over best avg %.1f max %.1f ms",
+                    (interval.delay.sum / (double)interval.delay.n - delay_best_) / 1000,
+                    (interval.delay.max - delay_best_) / 1000.0);
+        if (interval.bad > 0)
+            fprintf(stderr, ", %" PRIu64 " bad bytes", interval.bad);
+        fprintf(stderr, "\n");
+    }
+
+    total_.bytes += interval.bytes;
+    total_.frames += interval.frames;
+    total_.gaps += interval.gaps;
+    total_.lost += interval.lost;
+    total_.restarts += interval.restarts;
+    total_.bad += interval.bad;
+    conn_ += interval.delay;
+    interval = Stats();
+
+    if (final)
+    {
+        fold_delays();
+        fprintf(stderr,
+                "total %" PRIu64 " bytes, %" PRIu64 " frames, %" PRIu64 " gaps (%" PRIu64 " frames lost), %" PRIu64
+                " restarts, %" PRIu64 " bad bytes",
+                total_.bytes, total_.frames, total_.gaps, total_.lost, total_.restarts, total_.bad);
+        if (total_.delay.n > 0)
+            fprintf(stderr, ", delay over best avg %.1f max %.1f ms", total_.delay.sum / (double)total_.delay.n / 1000,
+                    total_.delay.max / 1000.0);
+        fprintf(stderr, "\n");
+    }
+}
+
+/*
+ * WebSocket, RFC 6455, as much as the device and the stand-in use: unfragmented
+ * messages, text commands, binary frames.
+ */
+
+enum
+{
+    WS_TEXT = 1,
+    WS_BINARY = 2,
+    WS_CLOSE = 8,
+    WS_PING = 9,
+    WS_PONG = 10,
+};
+
+constexpr const char *WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// clients mask what they send, servers do not
+bool ws_send(int fd, int opcode, const uint8_t *data, size_t n, bool mask)
+{
+    uint8_t h[14];
+    size_t k = 0;
+    h[k++] = 0x80 | opcode;
+    if (n < 126)
+        h[k++] = n;
+    else if (n < 65536)
+    {
+        h[k++] = 126;
+        h[k++] = n >> 8;
+        h[k++] = n;
+    }
+    else
+    {
+        h[k++] = 127;
+        for (int i = 7; i >= 0; i--)
+            h[k++] = (uint64_t)n >> (8 * i);
+    }
+    if (!mask)
+        return send_all(fd, h, k) && send_all(fd, data, n);
+
+    uint8_t key[4] = {(uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand()};
+    h[1] |= 0x80;
+    memcpy(h + k, key, 4);
+    k += 4;
+    uint8_t masked[125];
+    if (n > sizeof(masked))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        masked[i] = data[i] ^ key[i % 4];
+    return send_all(fd, h, k) && send_all(fd, masked, n);
+}
+
+// handles the complete messages in p with message(fd, opcode, data, n), returns the bytes used, -1 to close
+template <typename Message>
+long ws_parse(int fd, uint8_t *p, size_t n, Message &&message)
+{
+    size_t off = 0;
+    while (n - off >= 2)
+    {
+        uint8_t *m = p + off;
+        int opcode = m[0] & 0x0F;
+        bool masked = m[1] & 0x80;
+        uint64_t len = m[1] & 0x7F;
+        size_t h = 2;
+        if (len == 126)
+        {
+            if (n - off < 4)
+                break;
+            len = (uint64_t)m[2] << 8 | m[3];
+            h = 4;
+        }
+        else if (len == 127)
+        {
+            if (n - off < 10)
+                break;
+            len = 0;
+            for (int i = 0; i < 8; i++)
+                len = len << 8 | m[2 + i];
+            h = 10;
+        }
+        if (masked)
+            h += 4;
+        if (h + len > RX_SIZE)
+            return -1;
+        if (n - off < h + len)
+            break;
+
+        uint8_t *data = m + h;
+        if (masked)
+            for (uint64_t i = 0; i < len; i++)
+                data[i] ^= m[h - 4 + i % 4];
+        if (opcode == WS_CLOSE || !message(fd, opcode, data, len))
+            return -1;
+        off += h + len;
+    }
+    return off;
+}
+
+int tcp_connect(const char *host, const char *port)
+{
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (addrinfo *a = res; a != nullptr && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// the request or response head up to the blank line, which nothing follows yet on either side
+bool read_head(int fd, std::string &head)
+{
+    head.clear();
+    while (head.size() < 2048)
+    {
+        char c;
+        if (recv(fd, &c, 1, 0) <= 0)
+            return false;
+        head += c;
+        if (head.size() >= 4 && head.compare(head.size() - 4, 4, "\r\n\r\n") == 0)
+            return true;
+    }
+    return false;
+}
+
+int ws_connect(const std::string &url)
+{
+    // ws://host[:port][/path]
+    std::string rest = url.substr(strlen("ws://"));
+    size_t h = rest.find_first_of(":/");
+    std::string host = rest.substr(0, h), port = WS_PORT, path = "/ws";
+    if (host.empty())
+        return -1;
+    if (h != std::string::npos && rest[h] == ':')
+    {
+        size_t k = rest.find('/', h + 1);
+        port = rest.substr(h + 1, k == std::string::npos ? std::string::npos : k - h - 1);
+        if (port.empty())
+            return -1;
+        h = k;
+    }
+    if (h != std::string::npos && rest[h] == '/')
+        path = rest.substr(h);
+
+    int fd = tcp_connect(host.c_str(), port.c_str());
+    if (fd < 0)
+        return -1;
+
+    std::string head = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+                       "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    if (!send_all(fd, head.data(), head.size()) || !read_head(fd, head) || head.size() < 12 || head.compare(8, 4, " 101") != 0 ||
+        !ws_send(fd, WS_TEXT, reinterpret_cast<const uint8_t *>("open ws"), 7, true))
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+void receive_ws(const std::string &url, int interval_s, Recorder &rec, std::vector<uint8_t> &rx)
+{
+    auto message = [&rec](int fd, int opcode, uint8_t *data, size_t n) {
+        if (opcode == WS_BINARY)
+        {
+            if (frame_size(data, n) == (long)n)
+                rec.sink(data, n, true);
+            else
+                rec.interval.bad += n;
+        }
+        else if (opcode == WS_TEXT)
+            fprintf(stderr, "device: %.*s\n", (int)n, reinterpret_cast<const char *>(data));
+        else if (opcode == WS_PING)
+            return ws_send(fd, WS_PONG, data, n < 125 ? n : 125, true);
+        return true;
+    };
+
+    int64_t last = now_us();
+    while (!stop)
+    {
+        int fd = ws_connect(url);
+        if (fd < 0)
+        {
+            fprintf(stderr, "can't connect to %s, retrying\n", url.c_str());
+            sleep(RECONNECT_S);
+            continue;
+        }
+        fprintf(stderr, "connected to %s\n", url.c_str());
+        rec.restart();
+
+        size_t fill = 0;
+        while (!stop)
+        {
+            pollfd p{};
+            p.fd = fd;
+            p.events = POLLIN;
+            if (poll(&p, 1, 200) > 0)
+            {
+                ssize_t k = recv(fd, rx.data() + fill, rx.size() - fill, 0);
+                if (k <= 0)
+                    break;
+                rec.interval.bytes += k;
+                fill += k;
+                long used = ws_parse(fd, rx.data(), fill, message);
+                if (used < 0)
+                    break;
+                // the unfinished message moves to the front, the rest was used in place
+                memmove(rx.data(), rx.data() + used, fill - used);
+                fill -= used;
+            }
+            if (now_us() - last >= interval_s * 1000000LL)
+            {
+                rec.report((now_us() - last) / 1e6, false);
+                last = now_us();
+            }
+        }
+        close(fd);
+        if (!stop)
+            fprintf(stderr, "connection lost\n");
+    }
+}
+
+// frames back to back from a file or a pipe
+void receive_stream(int fd, int interval_s, Recorder &rec, std::vector<uint8_t> &rx)
+{
+    struct stat st;
+    bool live = fstat(fd, &st) == 0 && !S_ISREG(st.st_mode);
+    int64_t last = now_us();
+    size_t fill = 0;
+
+    while (!stop)
+    {
+        ssize_t k = read(fd, rx.data() + fill, rx.size() - fill);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            break;
+        rec.interval.bytes += k;
+        fill += k;
+
+        size_t off = 0;
+        while (off < fill)
+        {
+            long n = frame_size(rx.data() + off, fill - off);
+            if (n == 0)
+                break;
+            if (n < 0)
+            {
+                // not a frame start, look for the next one
+                rec.interval.bad++;
+                off++;
+                continue;
+            }
+            rec.sink(rx.data() + off, n, live);
+            off += n;
+        }
+        memmove(rx.data(), rx.data() + off, fill - off);
+        fill -= off;
+
+        if (live && now_us() - last >= interval_s * 1000000LL)
+        {
+            rec.report((now_us() - last) / 1e6, false);
+            last = now_us();
+        }
+    }
+    rec.interval.bad += fill;
+}
+
+/*
+ * The stand-in device
+ */
+
+std::array<uint8_t, 20> sha1(const std::string &data)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint8_t block[64];
+    size_t n = data.size();
+    uint64_t bits = (uint64_t)n * 8;
+    size_t total = (n + 9 + 63) / 64 * 64;
+
+    for (size_t off = 0; off < total; off += 64)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            size_t k = off + i;
+            block[i] = k < n ? (uint8_t)data[k] : k == n ? 0x80 : k >= total - 8 ? bits >> (8 * (total - 1 - k)) : 0;
+        }
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+        {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = b << 30 | b >> 2;
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::array<uint8_t, 20> out;
+    for (int i = 0; i < 20; i++)
+        out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+    return out;
+}
+
+std::string base64(const uint8_t *data, size_t n)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < n; i += 3)
+    {
+        uint32_t v = data[i] << 16 | (i + 1 < n ? data[i + 1] << 8 : 0) | (i + 2 < n ? data[i + 2] : 0);
+        out += digits[v >> 18];
+        out += digits[v >> 12 & 63];
+        out += i + 1 < n ? digits[v >> 6 & 63] : '=';
+        out += i + 2 < n ? digits[v & 63] : '=';
+    }
+    return out;
+}
+
+bool ws_accept(int fd)
+{
+    std::string head;
+    if (!read_head(fd, head))
+        return false;
+
+    const char *key = strcasestr(head.c_str(), "\r\nSec-WebSocket-Key:");
+    if (head.compare(0, 8, "GET /ws ") != 0 || key == nullptr)
+    {
+        const char *reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        send_all(fd, reply, strlen(reply));
+        return false;
+    }
+    key += strlen("\r\nSec-WebSocket-Key:");
+    key += strspn(key, " ");
+
+    auto digest = sha1(std::string(key, strcspn(key, " \r")) + WS_GUID);
+    head = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " +
+           base64(digest.data(), digest.size()) + "\r\n\r\n";
+    return send_all(fd, head.data(), head.size());
+}
+
+void serve_usage()
+{
+    fprintf(stderr, "usage: oscrecv serve [-p port] [-x speed] [-l] capture.osc\n");
+}
+
+int serve(int argc, char **argv)
+{
+    int port = SERVE_PORT;
+    double speed = 1;
+    bool loop = false;
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "p:x:l")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'l':
+            loop = true;
+            break;
+        default:
+            serve_usage();
+            return 1;
+        }
+    }
+    if (optind >= argc || speed <= 0)
+    {
+        serve_usage();
+        return 1;
+    }
+
+    int file = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) < 0 || st.st_size == 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    auto data = static_cast<const uint8_t *>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file, 0));
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    std::vector<size_t> offsets;
+    for (size_t off = 0; off < (size_t)st.st_size;)
+    {
+        long n = frame_size(data + off, st.st_size - off);
+        if (n <= 0)
+            break;
+        offsets.push_back(off);
+        off += n;
+    }
+    if (offsets.empty())
+    {
+        fprintf(stderr, "%s: no frames\n", argv[optind]);
+        return 1;
+    }
+    size_t count = offsets.size();
+
+    // one repeat of the file, in seq and in time
+    auto first = reinterpret_cast<const wire_frame_hdr_t *>(data + offsets.front());
+    auto last = reinterpret_cast<const wire_frame_hdr_t *>(data + offsets.back());
+    uint32_t seq_span = last->seq - first->seq + 1;
+    int64_t t_first = frame_time(data + offsets.front());
+    int64_t t_span = frame_time(data + offsets.back()) - t_first;
+    t_span += count > 1 ? t_span / (int64_t)(count - 1) : 1000;
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(server, 1) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    fprintf(stderr, "%zu frames, %.1f s, serving ws://localhost:%d/ws\n", count, t_span / 1e6, port);
+
+    std::vector<uint8_t> rx(RX_SIZE), out(RX_SIZE);
+    while (!stop)
+    {
+        int fd = accept(server, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        if (!ws_accept(fd))
+        {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fprintf(stderr, "client connected\n");
+
+        bool streaming = false;
+        auto message = [&streaming](int fd, int opcode, uint8_t *data, size_t n) {
+            if (opcode == WS_PING)
+                return ws_send(fd, WS_PONG, data, n, false);
+            if (opcode != WS_TEXT)
+                return true;
+            if (n == 7 && memcmp(data, "open ws", 7) == 0)
+            {
+                streaming = true;
+                return true;
+            }
+            std::string reply = std::string(reinterpret_cast<const char *>(data), n < 100 ? n : 100) +
+                                ": not in the replay";
+            return ws_send(fd, WS_TEXT, reinterpret_cast<const uint8_t *>(reply.data()), reply.size(), false);
+        };
+
+        size_t i = 0, fill = 0;
+        uint32_t repeat = 0;
+        int64_t start = 0;
+        bool open = true;
+        while (open && !stop)
+        {
+            int wait = -1;
+            int64_t due = 0;
+            if (streaming)
+            {
+                if (start == 0)
+                    start = now_us();
+                due = start + (int64_t)((frame_time(data + offsets[i]) - t_first + repeat * t_span) / speed);
+                int64_t us = due - now_us();
+                wait = us > 0 ? (int)((us + 999) / 1000) : 0;
+            }
+
+            pollfd p{};
+            p.fd = fd;
+            p.events = POLLIN;
+            if (poll(&p, 1, wait) > 0)
+            {
+                ssize_t k = recv(fd, rx.data() + fill, rx.size() - fill, 0);
+                long used = k > 0 ? ws_parse(fd, rx.data(), fill + k, message) : -1;
+                if (used < 0)
+                    break;
+                fill += k - used;
+                memmove(rx.data(), rx.data() + used, fill);
+                continue;
+            }
+            if (!streaming || now_us() < due)
+                continue;
+
+            // a copy, with seq and times moved on by the repeats
+            size_t n = frame_size(data + offsets[i], st.st_size - offsets[i]);
+            memcpy(out.data(), data + offsets[i], n);
+            auto h = reinterpret_cast<wire_frame_hdr_t *>(out.data());
+            h->seq += repeat * seq_span;
+            uint8_t *c = out.data() + sizeof(*h);
+            for (int k = 0; k < h->channels; k++)
+            {
+                auto ch = reinterpret_cast<wire_channel_hdr_t *>(c);
+                ch->t0 += repeat * t_span;
+                c += sizeof(*ch) + (size_t)ch->count * wire_width(ch->bits);
+            }
+            open = ws_send(fd, WS_BINARY, out.data(), n, false);
+
+            if (++i == count)
+            {
+                i = 0;
+                repeat++;
+                if (!loop)
+                {
+                    uint8_t code[2] = {1000 >> 8, 1000 & 0xFF};
+                    ws_send(fd, WS_CLOSE, code, sizeof(code), false);
+                    open = false;
+                }
+            }
+        }
+        close(fd);
+        fprintf(stderr, "client gone\n");
+    }
+    close(server);
+    return 0;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o capture.osc] [-r prefix] [-i seconds] ws://host[:port][/ws] | file | -\n", name);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    if (argc > 1 && strcmp(argv[1], "serve") == 0)
+        return serve(argc - 1, argv + 1);
+
+    Recorder rec;
+    const char *capture_name = nullptr;
+    int interval_s = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:r:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            capture_name = optarg;
+            break;
+        case 'r':
+            rec.set_raw_prefix(optarg);
+            break;
+        case 'i':
+            interval_s = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (capture_name != nullptr && !rec.open_capture(capture_name))
+    {
+        perror(capture_name);
+        return 1;
+    }
+
+    // frames are parsed and written out where they landed in here
+    std::vector<uint8_t> rx(RX_SIZE);
+    std::string source = argv[optind];
+    if (source.compare(0, 5, "ws://") == 0)
+        receive_ws(source, interval_s, rec, rx);
+    else
+    {
+        int fd = source == "-" ? STDIN_FILENO : open(source.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            perror(source.c_str());
+            return 1;
+        }
+        receive_stream(fd, interval_s, rec, rx);
+        close(fd);
+    }
+
+    rec.report(1, true);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Host replay of the decimation chain (src/decim.c) with the ENOB it reaches.
+ *
+ *   cc -O2 -Iinclude -o replay tools/replay/replay.c src/decim.c -lm
+ *   ./replay [-r rate] [-f tone] [-n noise] [file]
+ *
+ * file holds raw 12 bit samples of one channel as little endian uint16, a
+ * sine plus gaussian noise is synthesized without it. The recorded input must
+ * be a single tone of frequency -f. Each output is fitted with a sine at that
+ * frequency, whatever is left is noise and distortion. ENOB is referred to
+ * full scale, so it does not depend on the tone amplitude.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decim.h"
+
+#define SYNTH_SAMPLES (1 << 20)
+#define SETTLE 8 // output samples left out of the fit
+
+static double gauss(void)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static uint16_t *synthesize(size_t n, double rate, double tone, double noise)
+{
+    uint16_t *x = malloc(n * sizeof(uint16_t));
+    for (size_t i = 0; i < n; i++)
+    {
+        double v = 2048 + 1800 * sin(2 * M_PI * tone * i / rate) + noise * gauss();
+        x[i] = v < 0 ? 0 : v > 4095 ? 4095 : lround(v);
+    }
+    return x;
+}
+
+static uint16_t *load(const char *path, size_t *n)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *n = ftell(f) / sizeof(uint16_t);
+    fseek(f, 0, SEEK_SET);
+    uint16_t *x = malloc(*n * sizeof(uint16_t));
+    *n = fread(x, sizeof(uint16_t), *n, f);
+    fclose(f);
+    return x;
+}
+
+// least squares fit of a + b sin + c cos at w radians per sample, returns the rms residual
+static double residual(const double *y, size_t n, double w)
+{
+    double s[3][4] = {0};
+    for (size_t i = 0; i < n; i++)
+    {
+        double b[3] = {1, sin(w * i), cos(w * i)};
+        for (int r = 0; r < 3; r++)
+        {
+            for (int c = 0; c < 3; c++)
+                s[r][c] += b[r] * b[c];
+            s[r][3] += b[r] * y[i];
+        }
+    }
+    for (int p = 0; p < 3; p++)
+        for (int r = p + 1; r < 3; r++)
+        {
+            double m = s[r][p] / s[p][p];
+            for (int c = p; c < 4; c++)
+                s[r][c] -= m * s[p][c];
+        }
+    double k[3];
+    for (int r = 2; r >= 0; r--)
+    {
+        k[r] = s[r][3];
+        for (int c = r + 1; c < 3; c++)
+            k[r] -= s[r][c] * k[c];
+        k[r] /= s[r][r];
+    }
+
+    double e = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        double d = y[i] - (k[0] + k[1] * sin(w * i) + k[2] * cos(w * i));
+        e += d * d;
+    }
+    return sqrt(e / n);
+}
+
+// ENOB of n values of full scale 2^bits holding a tone at w radians per sample
+static double enob(const double *y, size_t n, double w, unsigned bits)
+{
+    double fs_rms = ldexp(1, bits) / 2 / sqrt(2);
+    double sinad = 20 * log10(fs_rms / residual(y, n, w));
+    return (sinad - 1.76) / 6.02;
+}
+
+static void run(const uint16_t *x, size_t n, double rate, double tone, decim_type_t type, unsigned ratio)
+{
+    decim_t d;
+    decim_init(&d, type, ratio, 24);
+
+    uint32_t *out = malloc((n / ratio + 1) * sizeof(uint32_t));
+    double *y = malloc((n / ratio + 1) * sizeof(double));
+    size_t first;
+    size_t m = type == DECIM_OFF ? n : decim_run(&d, x, n, out, &first);
+    for (size_t i = 0; i < m; i++)
+        y[i] = type == DECIM_OFF ? x[i] : out[i];
+
+    unsigned bits = type == DECIM_OFF ? 12 : 24;
+    size_t skip = type == DECIM_OFF ? 0 : SETTLE;
+    double e = enob(y + skip, m - skip, 2 * M_PI * tone * ratio / rate, bits);
+    printf("%-6s %3u %9.0f Hz %6.2f bits\n", type == DECIM_CIC ? "cic" : type == DECIM_BOXCAR ? "box" : "raw",
+           ratio, rate / ratio, e);
+
+    free(out);
+    free(y);
+}
+
+int main(int argc, char **argv)
+{
+    double rate = 30000, tone = 50, noise = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'f':
+            tone = atof(optarg);
+            break;
+        case 'n':
+            noise = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r rate] [-f tone] [-n noise] [file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t n = SYNTH_SAMPLES;
+    uint16_t *x = optind < argc ? load(argv[optind], &n) : synthesize(n, rate, tone, noise);
+    if (x == NULL || n < (SETTLE + 16) << DECIM_MAX_SHIFT)
+    {
+        fprintf(stderr, "no input or too short\n");
+        return 1;
+    }
+
+    printf("%zu samples at %.0f Hz, tone %.1f Hz\n", n, rate, tone);
+    printf("filter  R      rate     ENOB\n");
+    run(x, n, rate, tone, DECIM_OFF, 1);
+    for (unsigned r = 2; r <= 1u << DECIM_MAX_SHIFT; r *= 2)
+    {
+        run(x, n, rate, tone, DECIM_BOXCAR, r);
+        run(x, n, rate, tone, DECIM_CIC, r);
+    }
+    free(x);
+    return 0;
+}
@@ -0,0 +1,416 @@
+/*
+ * Host receiver of the UDP sample stream (src/udp.c), writes the frames to disk.
+ *
+ *   c++ -O2 -std=c++17 -Iinclude -o udprecv tools/udprecv/udprecv.cpp
+ *   ./udprecv [-g group] [-o frames.osc] [-l gaps.txt] port
+ *
+ * Complete wire frames (wire.h) are appended to the output as they come, in
+ * arrival order, so one repaired by parity may land after a newer one; their
+ * seq tells. -o - writes them to stdout, for oscrecv.
+ *
+ * A datagram counts as lost once WINDOW newer ones have arrived without it or
+ * parity bringing it back, every run of lost ones is a "first last" line of the
+ * gap log. Frames with a lost datagram are left out. Stop with ^C.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "wire.h"
+
+namespace
+{
+
+constexpr uint32_t WINDOW = 256; // datagrams kept for repair and reordering
+constexpr int ASSEMBLY = 4;      // frames being put together at once
+constexpr size_t FRAME_MAX = 65536;
+constexpr auto REPORT = std::chrono::seconds(5);
+
+struct Slot
+{
+    bool valid = false;
+    uint32_t seq = 0;
+    size_t len = 0;
+    std::array<uint8_t, WIRE_UDP_DATAGRAM> data{};
+};
+
+struct Assembly
+{
+    bool used = false;
+    uint32_t frame = 0;
+    uint32_t total = 0;
+    uint32_t have = 0;
+    std::vector<uint8_t> data = std::vector<uint8_t>(FRAME_MAX);
+};
+
+struct Stats
+{
+    uint64_t received = 0, parity = 0, repaired = 0, lost = 0, late = 0, gaps = 0;
+    uint64_t frames = 0, incomplete = 0, bytes = 0;
+};
+
+class Receiver
+{
+public:
+    Receiver(FILE *out, FILE *gaps) : out_(out), gaps_(gaps) {}
+
+    void datagram(const uint8_t *data, size_t len);
+    // whatever is still missing in the window will not come any more
+    void finish();
+    void report() const;
+
+private:
+    bool have(uint32_t seq) const
+    {
+        const Slot &s = window_[seq % WINDOW];
+        return s.valid && s.seq == seq;
+    }
+
+    void gap_flush();
+    void lost(uint32_t seq);
+    void frame_data(const wire_udp_hdr_t *h, const uint8_t *payload);
+    void deliver(uint32_t seq, const uint8_t *data, size_t len);
+    void advance(uint32_t seq);
+    void repair(const wire_udp_hdr_t *p, size_t len);
+
+    std::array<Slot, WINDOW> window_;
+    std::array<Assembly, ASSEMBLY> assembly_;
+
+    bool started_ = false;
+    uint32_t floor_seq_ = 0; // older ones are settled, received or lost
+    uint32_t top_seq_ = 0;   // newest seen
+
+    FILE *out_;
+    FILE *gaps_;
+    uint32_t gap_first_ = 0, gap_last_ = 0;
+    bool gap_open_ = false;
+
+    Stats stats_;
+};
+
+void Receiver::gap_flush()
+{
+    if (!gap_open_)
+        return;
+    if (gaps_ != nullptr)
+    {
+        fprintf(gaps_, "%" PRIu32 " %" PRIu32 "\n", gap_first_, gap_last_);
+        fflush(gaps_);
+    }
+    stats_.gaps++;
+    gap_open_ = false;
+}
+
+void Receiver::lost(uint32_t seq)
+{
+    stats_.lost++;
+    if (gap_open_ && seq == gap_last_ + 1)
+    {
+        gap_last_ = seq;
+        return;
+    }
+    gap_flush();
+    gap_first_ = gap_last_ = seq;
+    gap_open_ = true;
+}
+
+void Receiver::frame_data(const wire_udp_hdr_t *h, const uint8_t *payload)
+{
+    // the header comes off the network, nothing in it may reach past the buffer
+    if (h->total == 0 || h->total > FRAME_MAX || (size_t)h->offset + h->len > h->total)
+        return;
+
+    Assembly *a = nullptr, *oldest = nullptr;
+    for (Assembly &e : assembly_)
+    {
+        if (e.used && e.frame == h->frame)
+            a = &e;
+        else if (oldest == nullptr || !e.used || (oldest->used && (int32_t)(e.frame - oldest->frame) < 0))
+            oldest = &e;
+    }
+    if (a == nullptr)
+    {
+        // the oldest one will not be completed any more
+        a = oldest;
+        if (a->used)
+            stats_.incomplete++;
+        a->used = true;
+        a->frame = h->frame;
+        a->total = h->total;
+        a->have = 0;
+    }
+    else if (h->total != a->total)
+        return;
+    memcpy(a->data.data() + h->offset, payload, h->len);
+    a->have += h->len;
+    if (a->have < a->total)
+        return;
+
+    fwrite(a->data.data(), 1, a->total, out_);
+    fflush(out_);
+    stats_.frames++;
+    stats_.bytes += a->total;
+    a->used = false;
+}
+
+// a data datagram, fresh or repaired
+void Receiver::deliver(uint32_t seq, const uint8_t *data, size_t len)
+{
+    Slot &s = window_[seq % WINDOW];
+    s.valid = true;
+    s.seq = seq;
+    s.len = len;
+    memcpy(s.data.data(), data, len);
+
+    auto h = reinterpret_cast<const wire_udp_hdr_t *>(data);
+    if (sizeof(*h) + h->len <= len)
+        frame_data(h, data + sizeof(*h));
+}
+
+// settle everything that fell out of the window
+void Receiver::advance(uint32_t seq)
+{
+    if ((int32_t)(seq - top_seq_) > 0)
+        top_seq_ = seq;
+    while ((int32_t)(top_seq_ - floor_seq_) >= (int32_t)WINDOW)
+    {
+        if (!have(floor_seq_))
+            lost(floor_seq_);
+        window_[floor_seq_ % WINDOW].valid = false;
+        floor_seq_++;
+    }
+}
+
+void Receiver::repair(const wire_udp_hdr_t *p, size_t len)
+{
+    uint32_t missing = 0;
+    int n = 0;
+    for (int i = 0; i < p->group; i++)
+    {
+        uint32_t seq = p->seq + i;
+        if ((int32_t)(seq - floor_seq_) < 0)
+            return; // settled already
+        if (!have(seq))
+        {
+            missing = seq;
+            n++;
+        }
+    }
+    if (n != 1)
+        return;
+
+    std::array<uint8_t, WIRE_UDP_DATAGRAM> d{};
+    auto raw = reinterpret_cast<const uint8_t *>(p);
+    memcpy(d.data() + WIRE_UDP_PROTECTED, raw + WIRE_UDP_PROTECTED, len - WIRE_UDP_PROTECTED);
+    for (int i = 0; i < p->group; i++)
+    {
+        const Slot &s = window_[(p->seq + i) % WINDOW];
+        if (p->seq + i == missing)
+            continue;
+        for (size_t k = WIRE_UDP_PROTECTED; k < s.len; k++)
+            d[k] ^= s.data[k];
+    }
+    auto h = reinterpret_cast<wire_udp_hdr_t *>(d.data());
+    if (sizeof(*h) + h->len > len)
+        return; // parity shorter than the payload, not one of ours
+    h->magic = WIRE_UDP_MAGIC;
+    h->version = p->version;
+    h->flags = 0;
+    h->seq = missing;
+    h->group = p->group;
+    stats_.repaired++;
+    advance(missing);
+    deliver(missing, d.data(), sizeof(*h) + h->len);
+}
+
+void Receiver::datagram(const uint8_t *data, size_t len)
+{
+    auto h = reinterpret_cast<const wire_udp_hdr_t *>(data);
+    if (len < sizeof(*h) || h->magic != WIRE_UDP_MAGIC)
+        return;
+
+    // a restarted sender begins at 0 again
+    if (!started_ || (int32_t)(h->seq - floor_seq_) < -(int32_t)(16 * WINDOW))
+    {
+        if (started_)
+            fprintf(stderr, "stream restarted at %" PRIu32 "\n", (uint32_t)h->seq);
+        for (Slot &s : window_)
+            s.valid = false;
+        floor_seq_ = top_seq_ = h->seq;
+        started_ = true;
+    }
+
+    if (h->flags & WIRE_UDP_PARITY)
+    {
+        stats_.parity++;
+        if (h->group > 0)
+            repair(h, len);
+        return;
+    }
+
+    stats_.received++;
+    if ((int32_t)(h->seq - floor_seq_) < 0)
+    {
+        // too late, counted lost already
+        stats_.late++;
+        return;
+    }
+    if (have(h->seq))
+        return;
+    advance(h->seq);
+    deliver(h->seq, data, len);
+}
+
+void Receiver::finish()
+{
+    if (started_)
+        for (uint32_t seq = floor_seq_; (int32_t)(seq - top_seq_) <= 0; seq++)
+            if (!have(seq))
+                lost(seq);
+    gap_flush();
+}
+
+void Receiver::report() const
+{
+    fprintf(stderr,
+            "%" PRIu64 " datagrams, %" PRIu64 " parity, %" PRIu64 " repaired, %" PRIu64 " lost in %" PRIu64
+            " gaps, %" PRIu64 " late; %" PRIu64 " frames, %" PRIu64 " incomplete, %" PRIu64 " bytes\n",
+            stats_.received, stats_.parity, stats_.repaired, stats_.lost, stats_.gaps, stats_.late, stats_.frames,
+            stats_.incomplete, stats_.bytes);
+}
+
+volatile sig_atomic_t stop;
+
+void on_signal(int)
+{
+    stop = 1;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-g group] [-o frames.osc] [-l gaps.txt] port\n", name);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const char *group = nullptr;
+    const char *out_name = "frames.osc";
+    const char *gaps_name = nullptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:o:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g':
+            group = optarg;
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'l':
+            gaps_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    int rcvbuf = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind]));
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    if (group != nullptr)
+    {
+        ip_mreq mreq{};
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1 ||
+            setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        {
+            fprintf(stderr, "can't join %s\n", group);
+            return 1;
+        }
+    }
+
+    FILE *out = strcmp(out_name, "-") == 0 ? stdout : fopen(out_name, "ab");
+    if (out == nullptr)
+    {
+        perror(out_name);
+        return 1;
+    }
+    FILE *gaps = nullptr;
+    if (gaps_name != nullptr && (gaps = fopen(gaps_name, "a")) == nullptr)
+    {
+        perror(gaps_name);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    // the window and the assembly buffers are too big for the stack
+    auto rx = std::make_unique<Receiver>(out, gaps);
+    auto last = std::chrono::steady_clock::now();
+    std::array<uint8_t, WIRE_UDP_DATAGRAM + 1> buf;
+    while (!stop)
+    {
+        pollfd p{};
+        p.fd = sock;
+        p.events = POLLIN;
+        if (poll(&p, 1, 1000) > 0)
+        {
+            ssize_t n = recv(sock, buf.data(), buf.size(), 0);
+            if (n > 0 && n <= WIRE_UDP_DATAGRAM)
+                rx->datagram(buf.data(), n);
+            else if (n < 0 && errno != EINTR)
+                perror("recv");
+        }
+        if (std::chrono::steady_clock::now() - last >= REPORT)
+        {
+            rx->report();
+            last = std::chrono::steady_clock::now();
+        }
+    }
+
+    rx->finish();
+    rx->report();
+    fclose(out);
+    if (gaps != nullptr)
+        fclose(gaps);
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Host receiver of the wired sample stream (src/wired.c): throughput, lost and
+ * corrupt frames once a second, the frames themselves optionally to a file or
+ * with -o - to stdout, for oscrecv.
+ *
+ *   c++ -O2 -std=c++17 -Iinclude -o wiredrecv tools/wiredrecv/wiredrecv.cpp
+ *   ./wiredrecv [-b baud] [-o frames.osc] /dev/ttyACM0
+ *
+ * The device starts it with "wired usb" or "wired uart <baud> [tx pin]". The
+ * baud rate only matters for a UART bridge, USB ignores it. Lost frames are seq
+ * gaps, corrupt ones fail the CRC or the COBS decoding; anything the console
+ * printed before the stream took over counts as the latter, so do frames the
+ * device wrote only in part ("torn" in its "wired" reply).
+ */
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "wire.h"
+
+namespace
+{
+
+constexpr size_t FRAME_MAX = 65536;
+
+uint32_t crc32(const uint8_t *p, size_t n)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (n--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+speed_t baud_constant(long baud)
+{
+    static const struct
+    {
+        long baud;
+        speed_t speed;
+    } rates[] = {
+        {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600},
+#ifdef B2000000
+        {1000000, B1000000}, {1500000, B1500000}, {2000000, B2000000}, {2500000, B2500000},
+        {3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+#endif
+    };
+    for (const auto &r : rates)
+        if (r.baud == baud)
+            return r.speed;
+    return 0;
+}
+
+struct Counts
+{
+    uint64_t frames = 0, lost = 0, corrupt = 0;
+
+    Counts &operator+=(const Counts &o)
+    {
+        frames += o.frames;
+        lost += o.lost;
+        corrupt += o.corrupt;
+        return *this;
+    }
+};
+
+// COBS blocks between zeros back into checked wire frames
+class Deframer
+{
+public:
+    explicit Deframer(FILE *out) : out_(out), block_(WIRE_COBS_MAX(FRAME_MAX)) {}
+
+    void feed(const uint8_t *p, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (p[i] != 0)
+            {
+                if (fill_ < block_.size())
+                    block_[fill_++] = p[i];
+                else
+                    overflow_ = true;
+                continue;
+            }
+
+            // a zero ends the block, empty ones sit between two frames
+            if (fill_ > 0 && synced_)
+                frame();
+            synced_ = true;
+            fill_ = 0;
+            overflow_ = false;
+        }
+    }
+
+    Counts counts; // since the last take()
+
+    Counts take()
+    {
+        Counts c = counts;
+        counts = Counts();
+        return c;
+    }
+
+private:
+    void frame()
+    {
+        size_t len = overflow_ ? 0 : wire_cobs_decode(block_.data(), fill_, block_.data());
+        uint32_t crc;
+        auto h = reinterpret_cast<const wire_frame_hdr_t *>(block_.data());
+        if (len < sizeof(*h) + sizeof(crc))
+        {
+            counts.corrupt++;
+            return;
+        }
+        len -= sizeof(crc);
+        memcpy(&crc, block_.data() + len, sizeof(crc));
+        if (crc != crc32(block_.data(), len) || h->magic != WIRE_MAGIC)
+        {
+            counts.corrupt++;
+            return;
+        }
+        if (have_seq_ && h->seq != next_seq_)
+            counts.lost += (uint32_t)(h->seq - next_seq_) < 1u << 31 ? h->seq - next_seq_ : 0;
+        next_seq_ = h->seq + 1;
+        have_seq_ = true;
+        counts.frames++;
+        if (out_ != nullptr)
+            fwrite(block_.data(), 1, len, out_);
+    }
+
+    FILE *out_;
+    std::vector<uint8_t> block_;
+    size_t fill_ = 0;
+    bool overflow_ = false;
+    bool synced_ = false; // the first zero ends a block that began before we did
+    bool have_seq_ = false;
+    uint32_t next_seq_ = 0;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b baud] [-o frames.osc] device\n", name);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    long baud = 0;
+    const char *out_name = nullptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            baud = atol(optarg);
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_NOCTTY);
+    if (fd < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    termios tio;
+    if (tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        if (baud > 0)
+        {
+            speed_t speed = baud_constant(baud);
+            if (speed == 0)
+            {
+                fprintf(stderr, "unsupported baud rate %ld\n", baud);
+                return 1;
+            }
+            cfsetispeed(&tio, speed);
+            cfsetospeed(&tio, speed);
+        }
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIFLUSH);
+    }
+
+    FILE *out = nullptr;
+    if (out_name != nullptr && strcmp(out_name, "-") == 0)
+        out = stdout;
+    else if (out_name != nullptr && (out = fopen(out_name, "ab")) == nullptr)
+    {
+        perror(out_name);
+        return 1;
+    }
+
+    using clock = std::chrono::steady_clock;
+    Deframer deframer(out);
+    Counts total;
+    std::vector<uint8_t> buf(1 << 16);
+    uint64_t bytes = 0;
+    auto start = clock::now(), last = start;
+
+    while (1)
+    {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+        if (n == 0)
+            break;
+        bytes += n;
+        deframer.feed(buf.data(), n);
+
+        auto t = clock::now();
+        if (t - last >= std::chrono::seconds(1))
+        {
+            Counts c = deframer.take();
+            total += c;
+            fprintf(stderr,
+                    "%.1f s: %.3f MB/s, %" PRIu64 " frames/s, %" PRIu64 " lost, %" PRIu64 " corrupt (total %" PRIu64
+                    " frames, %" PRIu64 " lost, %" PRIu64 " corrupt)\n",
+                    std::chrono::duration<double>(t - start).count(),
+                    bytes / std::chrono::duration<double>(t - last).count() / 1e6, c.frames, c.lost, c.corrupt,
+                    total.frames, total.lost, total.corrupt);
+            if (out != nullptr)
+                fflush(out);
+            bytes = 0;
+            last = t;
+        }
+    }
+
+    total += deframer.take();
+    fprintf(stderr, "total %" PRIu64 " frames, %" PRIu64 " lost, %" PRIu64 " corrupt\n", total.frames, total.lost,
+            total.corrupt);
+    if (out != nullptr)
+        fclose(out);
+    close(fd);
+    return 0;
+}